@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "mbc.h"
+
+block_cache_t *block_cache_new(void) {
+  block_cache_t *bc = calloc(1, sizeof(block_cache_t));
+  if (!bc) return NULL;
+  bc->entries = calloc(BLOCK_CACHE_ENTRIES, sizeof(block_t));
+  if (!bc->entries) {
+    free(bc);
+    return NULL;
+  }
+  return bc;
+}
+
+void block_cache_free(block_cache_t *bc) {
+  if (!bc) return;
+  free(bc->entries);
+  free(bc);
+}
+
+void block_cache_flush(block_cache_t *bc) {
+  for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++)
+    bc->entries[i].valid = false;
+}
+
+static inline uint32_t block_slot(uint32_t bank, u16 pc) {
+  return (pc ^ (bank * 0x9E3u)) & (BLOCK_CACHE_ENTRIES - 1);
+}
+
+static void block_build(block_t *b, const u8 *code, u16 base, u16 end, u16 pc) {
+  u16 addy = pc;
+  b->count = 0;
+
+  while (b->count < BLOCK_MAX_OPS) {
+    const instr_t *in = cpu_decode(code[addy - base]);
+    u8 len = 1 + in->imm_len;
+    if ((uint32_t)addy + len > end)
+      break;
+
+    block_op_t *op = &b->ops[b->count++];
+    op->in = in;
+    op->len = len;
+    op->native = NULL;
+    op->native_len = 0;
+    op->native_cycles = 0;
+    for (int i = 0; i < len; i++)
+      op->bytes[i] = code[addy - base + i];
+    addy += len;
+
+    if (in->flags & INSTR_BRANCH)
+      break;
+  }
+}
+
+block_t *block_lookup(block_cache_t *bc, Bus_t *bus, u16 pc) {
+  const u8 *code;
+  const uint32_t *gen;
+  uint32_t bank;
+  u16 base;
+  uint32_t end;
+
+  if (pc < 0x8000) {
+    if (pc < 0x0100 && bus->bootrom_enabled)
+      return NULL;
+    if (!bus->cartridge)
+      return NULL;
+    code = cart_rom_window(bus->cartridge, pc, &bank);
+    if (!code)
+      return NULL;
+    base = pc & 0xC000;
+    end = (uint32_t)base + 0x4000;
+    gen = &bus->cartridge->bank_gen;
+  } else if (pc >= 0xC000 && pc <= 0xDFFF) {
+    base = pc & 0xFF00;
+    end = (uint32_t)base + 0x100;
+    code = bus->wram + (base - 0xC000);
+    gen = &bus->code_gen[(base - 0xC000) >> 8];
+    bank = BLOCK_BANK_RAM;
+    bus_watch_code(bus, base);  // keep this page's writes bumping gen
+  } else if (pc >= 0xFF80 && pc <= 0xFFFE) {
+    base = 0xFF80;
+    end = 0xFFFF;
+    code = bus->hram;
+    gen = &bus->code_gen[CODE_GEN_HRAM];
+    bank = BLOCK_BANK_RAM;
+  } else {
+    return NULL;
+  }
+
+  block_t *b = &bc->entries[block_slot(bank, pc)];
+  if (b->valid && b->pc == pc && b->bank == bank &&
+      (bank != BLOCK_BANK_RAM || b->built_gen == *gen)) {
+    bc->hits++;
+    return b;
+  }
+
+  b->valid = false;
+  block_build(b, code, base, end, pc);
+  if (b->count == 0)
+    return NULL;
+
+  b->pc = pc;
+  b->bank = bank;
+  b->gen = gen;
+  b->built_gen = *gen;
+  b->runs = 0;
+  b->jitted = false;
+  b->valid = true;
+  bc->builds++;
+  return b;
+}
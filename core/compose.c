@@ -0,0 +1,56 @@
+#include "compose.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COMPOSE_X86
+#include <immintrin.h>
+#endif
+
+/* --------------- scalar --------------- */
+
+static void argb_scalar(uint32_t *dst, const uint8_t *idx,
+                        const uint32_t *lut, int n) {
+  for (int i = 0; i < n; i++)
+    dst[i] = lut[idx[i] & 3];
+}
+
+static const compose_t compose_scalar = { "scalar", argb_scalar };
+
+#ifdef COMPOSE_X86
+
+/* --------------- AVX2 --------------- */
+// vpermd looks 8 pixels up in the table at once
+
+__attribute__((target("avx2")))
+static void argb_avx2(uint32_t *dst, const uint8_t *idx,
+                      const uint32_t *lut, int n) {
+  __m256i table = _mm256_setr_epi32((int)lut[0], (int)lut[1], (int)lut[2],
+                                    (int)lut[3], 0, 0, 0, 0);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i b = _mm_loadl_epi64((const __m128i *)(idx + i));
+    __m256i v = _mm256_cvtepu8_epi32(b);
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permutevar8x32_epi32(table, v));
+  }
+  argb_scalar(dst + i, idx + i, lut, n - i);
+}
+
+static const compose_t compose_avx2 = { "avx2", argb_avx2 };
+
+#endif
+
+int compose_list(const compose_t **out, int max) {
+  int n = 0;
+  if (n < max) out[n++] = &compose_scalar;
+#ifdef COMPOSE_X86
+  __builtin_cpu_init();
+  if (n < max && __builtin_cpu_supports("avx2")) out[n++] = &compose_avx2;
+#endif
+  return n;
+}
+
+const compose_t *compose_best(void) {
+  const compose_t *all[4];
+  int n = compose_list(all, 4);
+  return all[n - 1];
+}
@@ -6,30 +6,107 @@
 #include "timers.h"
 #include "interrupts.h"
 #include "logging.h"
-
-#define TRACE_LEN 4096
+#include "block.h"
+#include "jit.h"
+#include "trace.h"
 
 void log_cpu(registers_t *cpu) {
   write_log("[CPU] Dumping state\n");
-  write_log(" [*] A = 0x%02X   F = 0x%02X   BC = 0x%04X   DE = 0x%04X\n", cpu->A, cpu->F, cpu->BC, cpu->DE);
+  write_log(" [*] A = 0x%02X   F = 0x%02X   BC = 0x%04X   DE = 0x%04X\n", cpu->A, cpu_flags_byte(cpu), cpu->BC, cpu->DE);
   write_log(" [*] HL = 0x%04X   SP = 0x%04X   PC = 0x%04X\n", cpu->HL, cpu->SP, cpu->PC);
 }
 
 
+// timers and PPU run when the scheduler's next deadline is reached (sched.h)
 #define TICK(cpu, n) do {                                       \
     (cpu)->cycle += (n);                                        \
-    if (!(cpu)->stopped) {                                      \
-        tick_timers(&(cpu)->bus->timers, (n), &(cpu)->bus->IF); \
-        display_cycle((cpu)->ppu, (cpu)->bus, (n));             \
-    }                                                           \
+    if (!(cpu)->stopped)                                        \
+        sched_tick((cpu)->bus, &(cpu)->bus->sched, (n));        \
 } while(0)
 
+#define FRAME_CYCLES (456ul * 154)
+#define RUN_FOREVER (~0ul)
+// longest HALT or idle-loop skip: one frame, so the frontend still polls
+#define SKIP_MAX FRAME_CYCLES
+
 
 #define SET_Z(cpu, n) ((cpu)->F.Z = ((n) == 0))
 #define SET_N(cpu, n) ((cpu)->F.N = (n))
 #define SET_H(cpu, n) ((cpu)->F.H = (n))
 #define SET_C(cpu, n) ((cpu)->F.C = (n))
 
+// Lazy flags: the 8-bit ALU ops only record what they computed in cpu->lf,
+// and F is brought up to date when something reads it. Z comes straight
+// from the result; branches use lf_z()/lf_c() without materializing the rest.
+enum { LF_NONE, LF_ADD, LF_SUB, LF_AND, LF_OR, LF_INC, LF_DEC };
+
+static inline bool lf_z(const registers_t *cpu) {
+  return cpu->lf.op ? (u8)cpu->lf.res == 0 : cpu->F.Z;
+}
+
+static inline bool lf_n(const registers_t *cpu) {
+  switch (cpu->lf.op) {
+    case LF_SUB: case LF_DEC: return 1;
+    case LF_NONE: return cpu->F.N;
+    default: return 0;
+  }
+}
+
+static inline bool lf_h(const registers_t *cpu) {
+  const u8 a = cpu->lf.a;
+  switch (cpu->lf.op) {
+    case LF_ADD: case LF_SUB: return ((a ^ cpu->lf.b ^ cpu->lf.res) & 0x10) != 0;
+    case LF_AND: return 1;
+    case LF_OR: return 0;
+    case LF_INC: return (a & 0x0F) == 0x0F;
+    case LF_DEC: return (a & 0x0F) == 0x00;
+    default: return cpu->F.H;
+  }
+}
+
+// INC/DEC keep C, so they fold the pending carry into F.C before recording
+static inline bool lf_c(const registers_t *cpu) {
+  switch (cpu->lf.op) {
+    case LF_ADD: case LF_SUB: return cpu->lf.res > 0xFF;
+    case LF_AND: case LF_OR: return 0;
+    default: return cpu->F.C;
+  }
+}
+
+void cpu_sync_flags(registers_t *cpu) {
+  if (cpu->lf.op == LF_NONE) return;
+  bool z = lf_z(cpu), n = lf_n(cpu), h = lf_h(cpu), c = lf_c(cpu);
+  cpu->F.Z = z;
+  cpu->F.N = n;
+  cpu->F.H = h;
+  cpu->F.C = c;
+  cpu->lf.op = LF_NONE;
+}
+
+u8 cpu_flags_byte(const registers_t *cpu) {
+  return (lf_z(cpu) << 7) | (lf_n(cpu) << 6) | (lf_h(cpu) << 5) |
+         (lf_c(cpu) << 4);
+}
+
+static inline void flags_sync(registers_t *cpu) {
+  if (cpu->lf.op != LF_NONE) cpu_sync_flags(cpu);
+}
+
+// for handlers that are about to write all four flags themselves
+static inline void flags_drop(registers_t *cpu) {
+  cpu->lf.op = LF_NONE;
+}
+
+static inline void flags_set(registers_t *cpu, u8 op, u8 a, u8 b, u16 res) {
+  cpu->lf.op = op;
+  cpu->lf.a = a;
+  cpu->lf.b = b;
+  cpu->lf.res = res;
+#ifdef GB_EAGER_FLAGS
+  cpu_sync_flags(cpu);
+#endif
+}
+
 
 // 8-bit registers
 #define REG_B 0
@@ -49,11 +126,16 @@ void log_cpu(registers_t *cpu) {
 
 #define JOYP_IF 0x10
 
+// handlers share one signature; most ignore the predecoded instruction
+#define UNUSED(x) (void)(x)
+
 
-void (*cb_ops[256])(registers_t *cpu);
+void (*cb_ops[256])(registers_t *cpu, const instr_t *in);
+
+static instr_t decode_table[512];
 
 // helpers
-static inline u8 read8(registers_t *cpu, u16 addy) {
+static inline void dma_wait(registers_t *cpu, u16 addy) {
   if (cpu->ppu && cpu->ppu->dma_active) {
     if (!(addy >= 0xFF80 && addy <= 0xFFFE)) {
       while (cpu->ppu->dma_active) {
@@ -61,10 +143,32 @@ static inline u8 read8(registers_t *cpu, u16 addy) {
       }
     }
   }
+}
+
+// I/O registers that change between scheduler deadlines; everything else a
+// loop can read only changes at a deadline or through a write
+// (bit i pairs with idle_t.until[i])
+enum { IDLE_STAT = 0x01, IDLE_DIV = 0x02, IDLE_TIMA = 0x04, IDLE_LY = 0x08 };
+
+static inline u8 idle_source(u16 addy) {
+  switch (addy) {
+    case 0xFF41: return IDLE_STAT;
+    case 0xFF04: return IDLE_DIV;
+    case 0xFF05: return IDLE_TIMA;
+    case 0xFF44: return IDLE_LY;
+    default: return 0;
+  }
+}
+
+static inline u8 read8(registers_t *cpu, u16 addy) {
+  dma_wait(cpu, addy);
+  if (addy >= 0xFF00)
+    cpu->idle.reads |= idle_source(addy);
   return read_byte_bus(cpu->bus, addy);
 }
 
 static inline void write8(registers_t *cpu, u16 addy, u8 val) {
+  cpu->idle.dirty = true;
   if (cpu->ppu && cpu->ppu->dma_active) {
     if (!(addy >= 0xFF80 && addy <= 0xFFFE)) {
       while (cpu->ppu->dma_active) {
@@ -75,6 +179,89 @@ static inline void write8(registers_t *cpu, u16 addy, u8 val) {
   write_byte_bus(cpu->bus, addy, val);
 }
 
+// Idle loops (`ldh a,(LY); cp 144; jr nz` and friends): when a short
+// backward branch reaches the same loop head with the same registers as the
+// last time, with no write or interrupt in between, that iteration depended
+// only on what it read. If nothing it could have read changed while it ran
+// (no scheduler deadline, no STAT/LY/DIV/TIMA edge), the following iterations
+// repeat it until the next such change, and are skipped as a block of cycles.
+#define IDLE_MAX_LEN 16  // loop body bytes
+
+#ifndef GB_NO_IDLE_SKIP
+// absolute time of a change `at` cycles after sched.synced (UINT32_MAX = never)
+static inline unsigned long idle_at(const Sched_t *s, uint32_t at) {
+  return at == UINT32_MAX ? SCHED_NEVER : s->synced + at;
+}
+
+static void idle_skip(registers_t *cpu, unsigned long period) {
+  Sched_t *s = &cpu->bus->sched;
+  const idle_t *l = &cpu->idle;
+  unsigned long limit = s->next;
+
+  for (int i = 0; i < 4; i++) {
+    if ((l->reads & (1u << i)) && l->until[i] < limit)
+      limit = l->until[i];
+  }
+  // also fails if a read register changed during the iteration itself
+  if (limit <= s->time + period)
+    return;
+  if (limit - s->time > SKIP_MAX)
+    limit = s->time + SKIP_MAX;  // also covers JOYP, set by the frontend
+
+  // every skipped iteration has to end before the first possible change
+  unsigned long skip = (limit - 1 - s->time) / period * period;
+  cpu->cycle += skip;
+  s->time += skip;
+  cpu->idle.skipped += skip;
+  cpu->idle.loops++;
+}
+
+static void idle_check(registers_t *cpu) {
+  idle_t *l = &cpu->idle;
+  const Sched_t *s = &cpu->bus->sched;
+  u8 f = cpu_flags_byte(cpu);
+
+  bool same = l->armed && !l->dirty && l->pc == cpu->PC && l->A == cpu->A &&
+              l->F == f && l->BC == cpu->BC && l->DE == cpu->DE &&
+              l->HL == cpu->HL && l->SP == cpu->SP && l->IME == cpu->IME &&
+              !cpu->ime_pending && !cpu->halt_bug && !cpu->stopped;
+  if (same && l->repeat && l->flushes == s->flushes)
+    idle_skip(cpu, cpu->cycle - l->cycle);
+
+  l->armed = true;
+  l->repeat = same;
+  l->dirty = false;
+  l->reads = 0;
+  l->pc = cpu->PC;
+  l->A = cpu->A;
+  l->F = f;
+  l->BC = cpu->BC;
+  l->DE = cpu->DE;
+  l->HL = cpu->HL;
+  l->SP = cpu->SP;
+  l->IME = cpu->IME;
+  l->cycle = cpu->cycle;
+  l->flushes = s->flushes;
+  if (same) {
+    l->until[0] = idle_at(s, ppu_next_change(cpu->ppu, 0xFF41));
+    l->until[1] = idle_at(s, timers_next_change(&cpu->bus->timers, 0xFF04));
+    l->until[2] = idle_at(s, timers_next_change(&cpu->bus->timers, 0xFF05));
+    l->until[3] = idle_at(s, ppu_next_change(cpu->ppu, 0xFF44));
+  }
+}
+#endif
+
+// after a taken jump; `from` is the address after the jump instruction
+static inline void idle_branch(registers_t *cpu, u16 from) {
+#ifndef GB_NO_IDLE_SKIP
+  if (cpu->PC < from && from - cpu->PC <= IDLE_MAX_LEN)
+    idle_check(cpu);
+#else
+  UNUSED(cpu);
+  UNUSED(from);
+#endif
+}
+
 static inline u16 read16(registers_t *cpu, u16 addy) {
   uint8_t lo = read8(cpu, addy);
   uint8_t hi = read8(cpu, addy + 1);
@@ -89,7 +276,13 @@ static inline void write16(registers_t *cpu, u16 addy, u16 val) {
 u8 fetch8(registers_t *cpu) {
   uint16_t pc = cpu->PC;
   TICK(cpu, 4);
-  uint8_t op = read8(cpu, pc);
+  uint8_t op;
+  if (cpu->fetch_ptr) {
+    dma_wait(cpu, pc);
+    op = *cpu->fetch_ptr++;
+  } else {
+    op = read8(cpu, pc);
+  }
 
   if (cpu->halt_bug) {
       cpu->halt_bug = false;
@@ -100,6 +293,17 @@ u8 fetch8(registers_t *cpu) {
 }
 
 u16 fetch16(registers_t *cpu) {
+  if (cpu->fetch_ptr) {
+    TICK(cpu, 4);
+    dma_wait(cpu, cpu->PC);
+    uint8_t lo = cpu->fetch_ptr[0];
+    TICK(cpu, 4);
+    dma_wait(cpu, cpu->PC + 1);
+    uint8_t hi = cpu->fetch_ptr[1];
+    cpu->fetch_ptr += 2;
+    cpu->PC += 2;
+    return (u16)((hi << 8) | lo);
+  }
   TICK(cpu, 4); 
   uint8_t lo = read8(cpu, cpu->PC);
   TICK(cpu, 4);  
@@ -206,22 +410,19 @@ static inline void write_reg16(registers_t *cpu, int reg ,u16 val) {
 
 // increments and decrements
 
-static inline void inc_r(registers_t *cpu) {
-  u8 op = read8(cpu, cpu->PC - 1);
-  int reg = (op >> 3) & 7;
+static inline void inc_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_dst;
   u8 v = read_reg8(cpu, reg);
   u8 res = v + 1;
   write_reg8(cpu, reg, res);
 
-  cpu->F.Z = (res == 0);
-  cpu->F.N = 0;
-  cpu->F.H = ((v & 0x0F) == 0x0F); 
+  cpu->F.C = lf_c(cpu);  // the only flag INC leaves alone
+  flags_set(cpu, LF_INC, v, 1, res);
 }
 
 
-static inline void inc_rr(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 4) & 3;
+static inline void inc_rr(registers_t *cpu, const instr_t *in) {
+  int reg = in->rr;
 
   u16 val = read_reg16(cpu, reg);
   val++;
@@ -230,9 +431,8 @@ static inline void inc_rr(registers_t *cpu) {
 }
 
 
-static inline void dec_rr(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 4) & 3;
+static inline void dec_rr(registers_t *cpu, const instr_t *in) {
+  int reg = in->rr;
 
   u16 val = read_reg16(cpu, reg);
   
@@ -241,62 +441,63 @@ static inline void dec_rr(registers_t *cpu) {
   TICK(cpu, 4);
 }
 
-static inline void dec_r(registers_t *cpu) {
-  u8 op = read8(cpu, cpu->PC - 1);
-  int reg = (op >> 3) & 7;
+static inline void dec_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_dst;
   u8 v = read_reg8(cpu, reg);
   u8 res = v - 1;
   write_reg8(cpu, reg, res);
 
-  cpu->F.Z = (res == 0);
-  cpu->F.N = 1;
-  cpu->F.H = ((v & 0x0F) == 0x00); 
+  cpu->F.C = lf_c(cpu);
+  flags_set(cpu, LF_DEC, v, 1, res);
 }
 
 // loads
-static inline void ld_r_immediate(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 3) & 7;
+static inline void ld_r_immediate(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_dst;
   u8 val = fetch8(cpu); 
   write_reg8(cpu, reg, val);
 }
 
-static inline void ld_rr_immediate(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 4) & 3;
+static inline void ld_rr_immediate(registers_t *cpu, const instr_t *in) {
+  int reg = in->rr;
   u16 val = fetch16(cpu); 
   write_reg16(cpu, reg, val);
 }
 
-static inline void ld_bc_a(registers_t *cpu) {
+static inline void ld_bc_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 bc = read_reg16(cpu, REG_BC);
   u8 a = read_reg8(cpu, REG_A);
   TICK(cpu, 4);
   write8(cpu, bc, a);
 }
 
-static inline void ld_a_bc(registers_t *cpu) {
+static inline void ld_a_bc(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 bc = read_reg16(cpu, REG_BC);
   TICK(cpu, 4);
   u8 val = read8(cpu, bc);
   write_reg8(cpu, REG_A, val);
 }
 
-static inline void ld_a_de(registers_t *cpu) {
+static inline void ld_a_de(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 de = read_reg16(cpu, REG_DE);
   TICK(cpu, 4);
   u8 val = read8(cpu, de);
   write_reg8(cpu, REG_A, val);
 }
 
-static inline void ld_de_a(registers_t *cpu) {
+static inline void ld_de_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 de = read_reg16(cpu, REG_DE);
   u8 a = read_reg8(cpu, REG_A);
   TICK(cpu, 4);
   write8(cpu, de, a);
 }
 
-static inline void ld_a16_sp(registers_t *cpu) {
+static inline void ld_a16_sp(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 nn = fetch16(cpu);
   TICK(cpu, 4);  
   write8(cpu, nn, cpu->SP & 0xFF);
@@ -304,7 +505,8 @@ static inline void ld_a16_sp(registers_t *cpu) {
   write8(cpu, nn + 1, cpu->SP >> 8);
 }
 
-static inline void ld_hlp_a(registers_t *cpu) {
+static inline void ld_hlp_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 a = read_reg8(cpu, REG_A);
   u16 hl = read_reg16(cpu, REG_HL);
   
@@ -314,7 +516,8 @@ static inline void ld_hlp_a(registers_t *cpu) {
   write_reg16(cpu, REG_HL, hl);
 }
 
-static inline void ld_hlm_a(registers_t *cpu) {
+static inline void ld_hlm_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 a = read_reg8(cpu, REG_A);
   u16 hl = read_reg16(cpu, REG_HL);
   
@@ -324,7 +527,8 @@ static inline void ld_hlm_a(registers_t *cpu) {
   write_reg16(cpu, REG_HL, hl);
 }
 
-static inline void ld_a_hlp(registers_t *cpu) {
+static inline void ld_a_hlp(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 hl_addy = read_reg16(cpu, REG_HL);
   
   TICK(cpu, 4);
@@ -333,7 +537,8 @@ static inline void ld_a_hlp(registers_t *cpu) {
   write_reg16(cpu, REG_HL, hl_addy + 1);
 }
 
-static inline void ld_a_hlm(registers_t *cpu) {
+static inline void ld_a_hlm(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 hl_addy = read_reg16(cpu, REG_HL);
   
   
@@ -343,17 +548,17 @@ static inline void ld_a_hlm(registers_t *cpu) {
   write_reg16(cpu, REG_HL, hl_addy - 1);
 }
 
-static inline void ld_r_r(registers_t *cpu) {
+static inline void ld_r_r(registers_t *cpu, const instr_t *in) {
   //0b01xxxyyy
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int x = (opcode >> 3) & 7;
-  int y = opcode & 7;
+  int x = in->r_dst;
+  int y = in->r_src;
 
   u8 src = read_reg8(cpu, y);
   write_reg8(cpu, x, src);
 }
 
-static inline void halt(registers_t *cpu) {
+static inline void halt(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   const u8 pending = (cpu->bus->IF & cpu->bus->IE) & 0x1F;
 
   if (cpu->IME) {
@@ -371,10 +576,12 @@ static inline void halt(registers_t *cpu) {
 }
 
 // rotates
-static inline void rlca(registers_t *cpu) {
+static inline void rlca(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int reg = read_reg8(cpu, REG_A);
   u8 msb = (reg >> 7) & 1;
   reg = (reg << 1) | msb;
+  flags_drop(cpu);
   cpu->F.Z = 0;
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -382,10 +589,12 @@ static inline void rlca(registers_t *cpu) {
   write_reg8(cpu, REG_A, reg);
 }
 
-static inline void rra(registers_t *cpu) {
+static inline void rra(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int reg = read_reg8(cpu, REG_A); 
   u8 lsb = reg & 1;
-  int old_c = cpu->F.C;
+  int old_c = lf_c(cpu);
+  flags_drop(cpu);
 
   reg = (old_c << 7) | (reg >> 1);
   cpu->F.Z = 0;
@@ -395,10 +604,12 @@ static inline void rra(registers_t *cpu) {
   write_reg8(cpu, REG_A, reg);
 }
 
-static inline void rla(registers_t *cpu) {
+static inline void rla(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int reg = read_reg8(cpu, REG_A);
   u8 msb = (reg >> 7) & 1;
-  int old_c = cpu->F.C;
+  int old_c = lf_c(cpu);
+  flags_drop(cpu);
   reg = (reg << 1) | old_c;
   cpu->F.Z = 0;
   SET_N(cpu, 0);
@@ -407,10 +618,12 @@ static inline void rla(registers_t *cpu) {
   write_reg8(cpu, REG_A, reg);
 }
 
-static inline void rrca(registers_t *cpu) {
+static inline void rrca(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int reg = read_reg8(cpu, REG_A);
   u8 lsb = reg & 1;
   reg = (reg >> 1) | (reg << 7);
+  flags_drop(cpu);
   cpu->F.Z = 0;
   SET_N(cpu, 0); 
   SET_H(cpu, 0);
@@ -420,13 +633,13 @@ static inline void rrca(registers_t *cpu) {
 
 
 // arithmetic
-static inline void add_hl_rr(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 4) & 3;
+static inline void add_hl_rr(registers_t *cpu, const instr_t *in) {
+  int reg = in->rr;
   u16 valHL = read_reg16(cpu, REG_HL);
   u16 valREG = read_reg16(cpu, reg);
   
   uint32_t result = valHL + valREG;
+  flags_sync(cpu);
   SET_N(cpu, 0);
   SET_H(cpu, ((valREG & 0x0FFF) + (valHL & 0x0FFF)) > 0x0FFF);
   SET_C(cpu, result > 0xFFFF);
@@ -434,116 +647,107 @@ static inline void add_hl_rr(registers_t *cpu) {
   TICK(cpu, 4);
 }
 
-static inline void add_r_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void add_r_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
   u16 result = a + r;
 
-  SET_Z(cpu, (result & 0xFF));
-  SET_N(cpu, 0);
-  SET_H(cpu, ((a & 0x0F) + (r & 0x0F)) > 0x0F);
-  SET_C(cpu, (result > 0xFF));
+  flags_set(cpu, LF_ADD, a, r, result);
   write_reg8(cpu, REG_A, (u8)result);
 }
 
-static inline void sub_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void sub_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
   u16 result = a - r;
 
-  SET_N(cpu, 1);
-  SET_Z(cpu, (result & 0xFF));
-  SET_H(cpu, (a & 0x0F) < (r & 0x0F));
-  SET_C(cpu, (a < r));
+  flags_set(cpu, LF_SUB, a, r, result);
   write_reg8(cpu, REG_A, result);
 }
 
-static inline void sbc_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int idx = opcode & 7;           
+static inline void sbc_r(registers_t *cpu, const instr_t *in) {
+  int idx = in->r_src;           
   u8 b = read_reg8(cpu, idx);     
-  u8 a = cpu->A, c = cpu->F.C;
+  u8 a = cpu->A, c = lf_c(cpu);
   u16 res = (u16)a - b - c;
 
-  SET_Z(cpu, (u8)res);
-  SET_N(cpu, 1);
-  SET_H(cpu, ((a ^ b ^ res) & 0x10) != 0);
-  SET_C(cpu, res > 0xFF);
+  flags_set(cpu, LF_SUB, a, b, res);
 
   cpu->A = (u8)res;
 }
 
 
-static inline void sbc_a_u8(registers_t *cpu) { 
+static inline void sbc_a_u8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
-  u16 result = a - imm - cpu->F.C;
+  u16 result = a - imm - lf_c(cpu);
 
-  SET_Z(cpu, (result & 0xFF));  
-  SET_N(cpu, 1);                
-  SET_H(cpu, ((a & 0x0F) < ((imm & 0x0F) + cpu->F.C))); 
-  SET_C(cpu, (a < (imm + cpu->F.C))); 
+  flags_set(cpu, LF_SUB, a, imm, result);
 
   write_reg8(cpu, REG_A, (u8)result);
 }
 
-static inline void adc_r(registers_t *cpu) {
+static inline void adc_r(registers_t *cpu, const instr_t *in) {
 
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+  int reg = in->r_src;
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
-  u16 result = a + r + cpu->F.C;
+  u16 result = a + r + lf_c(cpu);
 
-  SET_Z(cpu, (u8)result);
-  SET_N(cpu, 0);
-  SET_H(cpu, ((a & 0x0F) + (r & 0x0F) + cpu->F.C) > 0x0F);
-  SET_C(cpu, (result > 0xFF));
+  flags_set(cpu, LF_ADD, a, r, result);
   
   write_reg8(cpu, REG_A, (u8)result);
 }
 
-static inline void adc_u8(registers_t *cpu) {
+static inline void adc_u8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
-  u16 result = imm + a + cpu->F.C;
+  u16 result = imm + a + lf_c(cpu);
 
-  SET_Z(cpu, (result & 0xFF));
-  SET_N(cpu, 0);
-  SET_H(cpu, ((a & 0x0F) + (imm & 0x0F) + cpu->F.C) > 0x0F);
-  SET_C(cpu, (result > 0xFF));
+  flags_set(cpu, LF_ADD, a, imm, result);
   
   write_reg8(cpu, REG_A, (u8)result);
 }
 
 // weird shit
-static inline void nop(registers_t *cpu) {
+static inline void nop(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  UNUSED(cpu);
 }
 
-static inline void illegal_op(registers_t *cpu) {
+static inline void illegal_op(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  UNUSED(cpu);
 }
 
-static inline void stop(registers_t *cpu) {
+static inline void stop(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  sched_sync(cpu->bus);
+  sched_invalidate(&cpu->bus->sched);
   cpu->bus->timers.DIV = 0;
   cpu->bus->timers.div_count = 0;
 
   cpu->stopped = true;
 }
 
-static inline void cpl(registers_t *cpu) { 
+static inline void cpl(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 a = read_reg8(cpu, REG_A);
   write_reg8(cpu, REG_A, ~a);
 
+  flags_sync(cpu);
   SET_N(cpu, 1);
   SET_H(cpu, 1);
 }
 
-static inline void daa(registers_t *cpu) {
+static inline void daa(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  flags_sync(cpu);
   uint8_t a = cpu->A;
   uint8_t corr = 0;
   uint8_t newC = cpu->F.C;  
@@ -565,157 +769,175 @@ static inline void daa(registers_t *cpu) {
   SET_C(cpu, newC);
 }
 
-static inline void scf(registers_t *cpu) {
+static inline void scf(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  flags_sync(cpu);
   SET_C(cpu, 1);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
 }
 
-static inline void cp_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void cp_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
   u16 result = a - r;
 
-  SET_N(cpu, 1);
-  SET_Z(cpu, (result & 0xFF));
-  SET_H(cpu, (a & 0x0F) < (r & 0x0F));
-  SET_C(cpu, (a < r));
+  flags_set(cpu, LF_SUB, a, r, result);
 }
 
 
 // jumps
-static inline void jr_e(registers_t *cpu) {
+static inline void jr_e(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int8_t offset = (int8_t)fetch8(cpu);
+  u16 from = cpu->PC;
   cpu->PC += offset;
   TICK(cpu, 4);
+  idle_branch(cpu, from);
 }
 
 
-static inline void jr_nz(registers_t *cpu) {
+static inline void jr_nz(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int8_t offset = (int8_t)fetch8(cpu);
-  if (!cpu->F.Z) {
+  if (!lf_z(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC += offset;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jr_z(registers_t *cpu) {
+static inline void jr_z(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int8_t offset = (int8_t)fetch8(cpu);
-  if (cpu->F.Z) {
+  if (lf_z(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC += offset;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jr_nc(registers_t *cpu) {
+static inline void jr_nc(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int8_t offset = (int8_t)fetch8(cpu);
-  if (!cpu->F.C) {
+  if (!lf_c(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC += offset;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jr_c(registers_t *cpu) {
+static inline void jr_c(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int8_t offset = (int8_t)fetch8(cpu);
-  if (cpu->F.C) {
+  if (lf_c(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC += offset;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jp_nz_a16(registers_t *cpu) {
+static inline void jp_nz_a16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 next = fetch16(cpu);
   
-  if (!cpu->F.Z) {
+  if (!lf_z(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC = next;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jp_nc_a16(registers_t *cpu) {
+static inline void jp_nc_a16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 next = fetch16(cpu);
   
-  if (!cpu->F.C) {
+  if (!lf_c(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC = next;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jp_c_a16(registers_t *cpu) {
+static inline void jp_c_a16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 next = fetch16(cpu);
   
-  if (cpu->F.C) {
+  if (lf_c(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC = next;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jp_z_a16(registers_t *cpu) {
+static inline void jp_z_a16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 next = fetch16(cpu);
   
-  if (cpu->F.Z) {
+  if (lf_z(cpu)) {
+    u16 from = cpu->PC;
     cpu->PC = next;
     TICK(cpu, 4);
+    idle_branch(cpu, from);
   } 
 }
 
-static inline void jp_a16(registers_t *cpu) {
+static inline void jp_a16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 next = fetch16(cpu);
+  u16 from = cpu->PC;
   cpu->PC = next;
   TICK(cpu, 4);
+  idle_branch(cpu, from);
 }
 
-static inline void ccf(registers_t *cpu) {
+static inline void ccf(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  flags_sync(cpu);
   SET_C(cpu, !cpu->F.C);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
 }
 
 //bit ops
-static inline void and_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void and_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
 
   u8 result = a & r;
-  SET_Z(cpu, result);
-  SET_N(cpu, 0);
-  SET_H(cpu, 1);
-  SET_C(cpu, 0);
+  flags_set(cpu, LF_AND, a, r, result);
 
   write_reg8(cpu, REG_A, result);
 }
 
-static inline void xor_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void xor_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
 
   u8 result = a ^ r;
-  SET_Z(cpu, result);
-  SET_N(cpu, 0);
-  SET_H(cpu, 0);
-  SET_C(cpu, 0);
+  flags_set(cpu, LF_OR, a, r, result);
 
   write_reg8(cpu, REG_A, result);
 }
 
-static inline void or_r(registers_t *cpu) { /* untested */
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void or_r(registers_t *cpu, const instr_t *in) { /* untested */
+  int reg = in->r_src;
   u8 a = read_reg8(cpu, REG_A);
   u8 r = read_reg8(cpu, reg);
 
   u8 result = a | r;
-  SET_Z(cpu, result);
-  SET_N(cpu, 0);
-  SET_H(cpu, 0);
-  SET_C(cpu, 0);
+  flags_set(cpu, LF_OR, a, r, result);
 
   write_reg8(cpu, REG_A, result);
 }
@@ -728,39 +950,44 @@ static inline u16 pop(registers_t *cpu) {
   return (u16)((msb << 8) | lsb);
 }
 
-static inline void ret_nz(registers_t *cpu) {
+static inline void ret_nz(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   TICK(cpu, 4);
-  if (!cpu->F.Z) {
+  if (!lf_z(cpu)) {
     cpu->PC = pop(cpu);
     TICK(cpu, 4);
   }
 }
 
-static inline void ret_nc(registers_t *cpu) {
+static inline void ret_nc(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   TICK(cpu, 4);
-  if (!cpu->F.C) {
+  if (!lf_c(cpu)) {
     cpu->PC = pop(cpu);
     TICK(cpu, 4);
   }
 }
 
-static inline void ret_z(registers_t *cpu) {
+static inline void ret_z(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   TICK(cpu, 4);
-  if (cpu->F.Z) {
+  if (lf_z(cpu)) {
     cpu->PC = pop(cpu);
     TICK(cpu, 4);
   }
 }
 
-static inline void ret_c(registers_t *cpu) {
+static inline void ret_c(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   TICK(cpu, 4);
-  if (cpu->F.C) {
+  if (lf_c(cpu)) {
     cpu->PC = pop(cpu);
     TICK(cpu, 4);
   }
 }
 
-static inline void ret(registers_t *cpu) {
+static inline void ret(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
     cpu->PC = pop(cpu);
     TICK(cpu, 4);
 }
@@ -775,95 +1002,93 @@ static inline void push(registers_t *cpu, u16 val) {
   write8(cpu, cpu->SP, (u8)(val & 0xFF));
 }
 
-static inline void pop_rr(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 4) & 3;
+static inline void pop_rr(registers_t *cpu, const instr_t *in) {
+  int reg = in->rr;
   write_reg16(cpu, reg, pop(cpu));
 }
 
-static inline void push_rr(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = (opcode >> 4) & 3;
+static inline void push_rr(registers_t *cpu, const instr_t *in) {
+  int reg = in->rr;
   push(cpu, read_reg16(cpu, reg));
   TICK(cpu, 4);
 }
 
-static inline void call_nz(registers_t *cpu) {
+static inline void call_nz(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
  u16 next = fetch16(cpu);
 
- if (!cpu->F.Z) {
+ if (!lf_z(cpu)) {
    push(cpu, cpu->PC);
    cpu->PC = next;
    TICK(cpu, 4);
  } 
 }
 
-static inline void call_nc(registers_t *cpu) {
+static inline void call_nc(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
  u16 next = fetch16(cpu);
 
- if (!cpu->F.C) {
+ if (!lf_c(cpu)) {
    push(cpu, cpu->PC);
    cpu->PC = next;
    TICK(cpu, 4);
  } 
 }
 
-static inline void call_c(registers_t *cpu) {
+static inline void call_c(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
  u16 next = fetch16(cpu);
 
- if (cpu->F.C) {
+ if (lf_c(cpu)) {
    push(cpu, cpu->PC);
    cpu->PC = next;
    TICK(cpu, 4);
  }
 }
 
-static inline void call_z(registers_t *cpu) {
+static inline void call_z(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
  u16 next = fetch16(cpu);
 
- if (cpu->F.Z) {
+ if (lf_z(cpu)) {
    push(cpu, cpu->PC);
    cpu->PC = next;
    TICK(cpu, 4);
  } 
 }
 
-static inline void call_u16(registers_t *cpu) {
+static inline void call_u16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
    u16 next = fetch16(cpu);
    push(cpu, cpu->PC);
    cpu->PC = next;
    TICK(cpu, 4);
 }
 
-static inline void add_a_imm(registers_t *cpu) {
+static inline void add_a_imm(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
   u16 result = a + imm;
 
 
-  SET_Z(cpu, (u8)result);
-  SET_N(cpu, 0);
-  SET_H(cpu, ((a & 0x0F) + (imm & 0x0F)) > 0x0F);
-  SET_C(cpu, (result > 0xFF));
+  flags_set(cpu, LF_ADD, a, imm, result);
   write_reg8(cpu, REG_A, (u8)result);
 }
 
-static inline void sub_a_imm(registers_t *cpu) {
+static inline void sub_a_imm(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
   u16 result = a - imm;
 
-  SET_Z(cpu, (u8)result);                       
-  SET_N(cpu, 1);                                
-  SET_H(cpu, (a & 0x0F) < (imm & 0x0F));        
-  SET_C(cpu, a < imm); 
+  flags_set(cpu, LF_SUB, a, imm, result);
 
   write_reg8(cpu, REG_A, (u8)result);
 }
 
-static inline void rst(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  u8 n = (opcode >> 3) & 7;
+static inline void rst(registers_t *cpu, const instr_t *in) {
+  u8 n = in->r_dst;
 
   u16 addr = n << 3;
   
@@ -871,73 +1096,72 @@ static inline void rst(registers_t *cpu) {
   
   // if RST 0xFF = NOP
   if (dest_code == 0xFF && addr < 0x0100) {
-    static int rst_warn_count = 0;
-    if (rst_warn_count < 10) {
-      write_log("[RST] WARNING: RST $%02X at PC=%04X jumping to %04X which "
-                "contains 0xFF \n",
-                opcode, cpu->PC - 1, addr);
-
-      write_log("[RST] Treating as NOP to prevent infinite loop\n");
-      rst_warn_count++;
-    }
+    LOG_FIRST(10, LOG_CPU, LOG_WARN,
+              "[RST] WARNING: RST $%02X at PC=%04X jumping to %04X which "
+              "contains 0xFF, treating as NOP to prevent infinite loop\n",
+              in->opcode, cpu->PC - 1, addr);
     TICK(cpu, 12);
     return;
   }
 
-  write_log(
+  LOG(LOG_CPU, LOG_TRACE,
       "[RST] Executing RST $%02X at PC=%04X, jumping to %04X (code=%02X)\n",
-      opcode, cpu->PC - 1, addr, dest_code);
+      in->opcode, cpu->PC - 1, addr, dest_code);
 
   push(cpu, cpu->PC);
   cpu->PC = addr;
   TICK(cpu, 4);
 }
 
-void prefix(registers_t *cpu) {
+void prefix(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 opcode = fetch8(cpu);
   if (!cb_ops[opcode]) {
     printf("Non existent prefixed opcode\n");
   } else {
-    cb_ops[opcode](cpu);
+    cb_ops[opcode](cpu, &decode_table[0x100 | opcode]);
   }
 }
 
-static inline void reti(registers_t *cpu) {
+static inline void reti(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   cpu->IME = 1;
   cpu->PC = pop(cpu);
   TICK(cpu, 4);
 }
 
-static inline void ldh_u8_a(registers_t *cpu) {
+static inline void ldh_u8_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u16 addy = 0xFF00 + imm;
   TICK(cpu, 4);
   write8(cpu, addy, read_reg8(cpu, REG_A));
 }
 
-static inline void ldh_c_a(registers_t *cpu) {
+static inline void ldh_c_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 addy = 0xFF00 + read_reg8(cpu, REG_C);
   TICK(cpu, 4);
   write8(cpu, addy, read_reg8(cpu, REG_A));
 }
 
-static inline void and_a_imm(registers_t *cpu) {
+static inline void and_a_imm(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
   u8 result = a & imm;
   write_reg8(cpu, REG_A, result);
 
-  SET_Z(cpu, result);
-  SET_N(cpu, 0);
-  SET_H(cpu, 1);
-  SET_C(cpu, 0);
+  flags_set(cpu, LF_AND, a, imm, result);
 }
 
-static inline void add_sp_n8(registers_t *cpu) {
+static inline void add_sp_n8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
     int8_t imm = (int8_t)fetch8(cpu);
     u16 sp = cpu->SP;
     u16 result = sp + imm;
 
+    flags_drop(cpu);
     cpu->F.Z = 0;
     cpu->F.N = 0;
 
@@ -951,30 +1175,31 @@ static inline void add_sp_n8(registers_t *cpu) {
     TICK(cpu, 8);
 }
 
-static inline void jp_hl(registers_t *cpu) {
+static inline void jp_hl(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   cpu->PC = cpu->HL;
 }
 
-static inline void ld_a16_a(registers_t *cpu) {
+static inline void ld_a16_a(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 imm = fetch16(cpu);
   TICK(cpu, 4);
   write8(cpu, imm, read_reg8(cpu, REG_A));
 }
 
-static inline void xor_a_u8(registers_t *cpu) {
+static inline void xor_a_u8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
   u8 result = a ^ imm;
 
   write_reg8(cpu, REG_A, result);
 
-  SET_Z(cpu, result);
-  SET_N(cpu, 0);
-  SET_H(cpu, 0);
-  SET_C(cpu, 0);
+  flags_set(cpu, LF_OR, a, imm, result);
 }
 
-static inline void ldh_a_u8(registers_t *cpu) {
+static inline void ldh_a_u8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u16 addr = 0xFF00 + imm;
   TICK(cpu, 4);
@@ -982,7 +1207,8 @@ static inline void ldh_a_u8(registers_t *cpu) {
   write_reg8(cpu, REG_A, val);
 }
 
-static inline void pop_af(registers_t *cpu) {
+static inline void pop_af(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   TICK(cpu, 4);  
   u8 lsb = read8(cpu, cpu->SP++);
   TICK(cpu, 4);  
@@ -990,37 +1216,40 @@ static inline void pop_af(registers_t *cpu) {
 
   cpu->A = msb;
 
+  flags_drop(cpu);
   cpu->F.Z = (lsb >> 7) & 1;
   cpu->F.N = (lsb >> 6) & 1;
   cpu->F.H = (lsb >> 5) & 1;
   cpu->F.C = (lsb >> 4) & 1;
 }
 
-static inline void ldh_a_c(registers_t *cpu) {
+static inline void ldh_a_c(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 addy = 0xFF00 + read_reg8(cpu, REG_C);
   TICK(cpu, 4);
   uint8_t val = read8(cpu, addy);
   write_reg8(cpu, REG_A, val);
 }
 
-static inline void di(registers_t *cpu) {
+static inline void di(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   cpu->IME = false;
 }
 
-static inline void or_a_u8(registers_t *cpu) {
+static inline void or_a_u8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
   u8 result = a | imm;
   
   write_reg8(cpu, REG_A, result);
 
-  SET_Z(cpu, result);
-  SET_N(cpu, 0);
-  SET_H(cpu, 0);
-  SET_C(cpu, 0);
+  flags_set(cpu, LF_OR, a, imm, result);
 }
 
-static inline void push_af(registers_t *cpu) {
+static inline void push_af(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
+  flags_sync(cpu);
   u8 f = (cpu->F.Z << 7) |
          (cpu->F.N << 6) |
          (cpu->F.H << 5) |
@@ -1035,11 +1264,13 @@ static inline void push_af(registers_t *cpu) {
   TICK(cpu, 4);
 }
 
-static inline void ld_hl_sp_e8(registers_t *cpu) {
+static inline void ld_hl_sp_e8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   int8_t offset = (int8_t)fetch8(cpu);
   u16 sp = cpu->SP;
   u16 result = sp + offset;
 
+  flags_drop(cpu);
   cpu->F.Z = 0;
   cpu->F.N = 0;
 
@@ -1052,43 +1283,44 @@ static inline void ld_hl_sp_e8(registers_t *cpu) {
   TICK(cpu, 4);
 }
 
-static inline void ld_sp_hl(registers_t *cpu) {
+static inline void ld_sp_hl(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   cpu->SP = cpu->HL;
   TICK(cpu, 4);
 }
 
-static inline void ld_a_a16(registers_t *cpu) {
+static inline void ld_a_a16(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u16 addr = fetch16(cpu);           
   TICK(cpu, 4);
   u8 val = read8(cpu, addr);
   write_reg8(cpu, REG_A, val);      
 }
 
-static inline void ei(registers_t *cpu) {
+static inline void ei(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   cpu->ime_pending = true;
 }
 
-static inline void cp_a_u8(registers_t *cpu) {
+static inline void cp_a_u8(registers_t *cpu, const instr_t *in) {
+  UNUSED(in);
   u8 imm = fetch8(cpu);
   u8 a = read_reg8(cpu, REG_A);
   u16 result = a - imm;
 
-  SET_Z(cpu, (result & 0xFF));               
-  SET_N(cpu, 1);                             
-  SET_H(cpu, (a & 0x0F) < (imm & 0x0F));     
-  SET_C(cpu, a < imm);
+  flags_set(cpu, LF_SUB, a, imm, result);
 }
 
 
 // $CB PREFIX 
-static inline void rlc_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void rlc_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   u8 carry = (val >> 7) & 1;
   val = (val << 1) | carry;
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1097,14 +1329,14 @@ static inline void rlc_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void rrc_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void rrc_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   u8 carry = val & 1;
   val = (val >> 1) | (carry << 7);
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1113,15 +1345,15 @@ static inline void rrc_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void rl_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void rl_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
-  u8 old_c = cpu->F.C;
+  u8 old_c = lf_c(cpu);
   u8 new_c = (val >> 7) & 1;
   val = (val << 1) | old_c;
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1130,15 +1362,15 @@ static inline void rl_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void rr_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void rr_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
-  u8 old_c = cpu->F.C;
+  u8 old_c = lf_c(cpu);
   u8 new_c = val & 1;
   val = (val >> 1) | (old_c << 7);
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1147,14 +1379,14 @@ static inline void rr_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void sla_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void sla_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   u8 new_c = (val >> 7) & 1;
   val <<= 1;
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1163,15 +1395,15 @@ static inline void sla_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void sra_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void sra_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   u8 carry = val & 1;
   u8 msb = val & 0x80;
   val = (val >> 1) | msb;
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1180,13 +1412,13 @@ static inline void sra_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void swap_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void swap_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   val = (val << 4) | (val >> 4);
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1195,14 +1427,14 @@ static inline void swap_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void srl_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int reg = opcode & 7;
+static inline void srl_r(registers_t *cpu, const instr_t *in) {
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   u8 carry = val & 1;
   val >>= 1;
 
+  flags_drop(cpu);
   SET_Z(cpu, val);
   SET_N(cpu, 0);
   SET_H(cpu, 0);
@@ -1211,33 +1443,32 @@ static inline void srl_r(registers_t *cpu) {
   write_reg8(cpu, reg, val);
 }
 
-static inline void bit_n_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int bit = (opcode >> 3) & 7;
-  int reg = opcode & 7;
+static inline void bit_n_r(registers_t *cpu, const instr_t *in) {
+  int bit = in->r_dst;
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   bool zero = (val & (1 << bit));
 
+  cpu->F.C = lf_c(cpu);
+  flags_drop(cpu);
   SET_Z(cpu, zero);
   SET_N(cpu, 0);
   SET_H(cpu, 1);
 }
 
-static inline void res_n_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int bit = (opcode >> 3) & 7;
-  int reg = opcode & 7;
+static inline void res_n_r(registers_t *cpu, const instr_t *in) {
+  int bit = in->r_dst;
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   val &= ~(1 << bit);
   write_reg8(cpu, reg, val);
 }
 
-static inline void set_n_r(registers_t *cpu) {
-  u8 opcode = read8(cpu, cpu->PC - 1);
-  int bit = (opcode >> 3) & 7;
-  int reg = opcode & 7;
+static inline void set_n_r(registers_t *cpu, const instr_t *in) {
+  int bit = in->r_dst;
+  int reg = in->r_src;
 
   u8 val = read_reg8(cpu, reg);
   val |= (1 << bit);
@@ -1246,7 +1477,7 @@ static inline void set_n_r(registers_t *cpu) {
 
 
 
-void (*opcodes[256])(registers_t *cpu) = {
+void (*opcodes[256])(registers_t *cpu, const instr_t *in) = {
   nop, ld_rr_immediate, ld_bc_a, inc_rr, inc_r, dec_r, ld_r_immediate, rlca,
   ld_a16_sp, add_hl_rr, ld_a_bc, dec_rr, inc_r, dec_r, ld_r_immediate, rrca,
   stop, ld_rr_immediate, ld_de_a, inc_rr, inc_r, dec_r, ld_r_immediate, rla,
@@ -1283,7 +1514,7 @@ void (*opcodes[256])(registers_t *cpu) = {
   ld_hl_sp_e8, ld_sp_hl, ld_a_a16, ei, illegal_op, illegal_op, cp_a_u8, rst
 };
 
-void (*cb_ops[256])(registers_t *cpu) = {
+void (*cb_ops[256])(registers_t *cpu, const instr_t *in) = {
   rlc_r, rlc_r, rlc_r, rlc_r, rlc_r, rlc_r, rlc_r, rlc_r, 
   rrc_r, rrc_r, rrc_r, rrc_r, rrc_r, rrc_r, rrc_r, rrc_r, 
   rl_r, rl_r, rl_r, rl_r, rl_r, rl_r, rl_r, rl_r, 
@@ -1322,9 +1553,144 @@ void (*cb_ops[256])(registers_t *cpu) = {
 
 
 
+// immediate bytes per base opcode ($CB counts its second byte)
+static const u8 imm_lengths[256] = {
+  0,2,0,0,0,0,1,0, 2,0,0,0,0,0,1,0,
+  0,2,0,0,0,0,1,0, 1,0,0,0,0,0,1,0,
+  1,2,0,0,0,0,1,0, 1,0,0,0,0,0,1,0,
+  1,2,0,0,0,0,1,0, 1,0,0,0,0,0,1,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+  0,0,2,2,2,0,1,0, 0,0,2,1,2,2,1,0,
+  0,0,2,0,2,0,1,0, 0,0,2,0,2,0,1,0,
+  1,0,0,0,0,0,1,0, 1,0,2,0,0,0,1,0,
+  1,0,0,0,0,0,1,0, 1,0,2,0,0,0,1,0,
+};
+
+// base T-cycles per opcode, conditional branches counted as not taken
+static const u8 base_cycles[256] = {
+   4,12, 8, 8, 4, 4, 8, 4, 20, 8, 8, 8, 4, 4, 8, 4,
+   4,12, 8, 8, 4, 4, 8, 4, 12, 8, 8, 8, 4, 4, 8, 4,
+   8,12, 8, 8, 4, 4, 8, 4,  8, 8, 8, 8, 4, 4, 8, 4,
+   8,12, 8, 8,12,12,12, 4,  8, 8, 8, 8, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   8, 8, 8, 8, 8, 8, 4, 8,  4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   4, 4, 4, 4, 4, 4, 8, 4,  4, 4, 4, 4, 4, 4, 8, 4,
+   8,12,12,16,12,16, 8,16,  8,16,12, 4,12,24, 8,16,
+   8,12,12, 4,12,16, 8,16,  8,16,12, 4,12, 4, 8,16,
+  12,12, 8, 4, 4,16, 8,16, 16, 4,16, 4, 4, 4, 8,16,
+  12,12, 8, 4, 4,16, 8,16, 12, 8,16, 4, 4, 4, 8,16,
+};
+
+// Every distinct handler in opcodes[] / cb_ops[]. The threaded core gets one
+// label per entry, and decode_table stores the entry index in instr_t.handler.
+#define CPU_HANDLERS(X)                                                       \
+  X(nop) X(ld_rr_immediate) X(ld_bc_a) X(inc_rr) X(inc_r) X(dec_r)            \
+  X(ld_r_immediate) X(rlca) X(ld_a16_sp) X(add_hl_rr) X(ld_a_bc) X(dec_rr)    \
+  X(rrca) X(stop) X(ld_de_a) X(rla) X(jr_e) X(ld_a_de) X(rra) X(jr_nz)        \
+  X(ld_hlp_a) X(daa) X(jr_z) X(ld_a_hlp) X(cpl) X(jr_nc) X(ld_hlm_a) X(scf)   \
+  X(jr_c) X(ld_a_hlm) X(ccf) X(ld_r_r) X(halt) X(add_r_r) X(adc_r) X(sub_r)   \
+  X(sbc_r) X(and_r) X(xor_r) X(or_r) X(cp_r) X(ret_nz) X(pop_rr)             \
+  X(jp_nz_a16) X(jp_a16) X(call_nz) X(push_rr) X(add_a_imm) X(rst) X(ret_z)   \
+  X(ret) X(jp_z_a16) X(call_z) X(call_u16) X(adc_u8) X(ret_nc) X(jp_nc_a16)   \
+  X(illegal_op) X(call_nc) X(sub_a_imm) X(ret_c) X(reti) X(jp_c_a16)          \
+  X(call_c) X(sbc_a_u8) X(ldh_u8_a) X(ldh_c_a) X(and_a_imm) X(add_sp_n8)      \
+  X(jp_hl) X(ld_a16_a) X(xor_a_u8) X(ldh_a_u8) X(pop_af) X(ldh_a_c) X(di)     \
+  X(or_a_u8) X(push_af) X(ld_hl_sp_e8) X(ld_sp_hl) X(ld_a_a16) X(ei)          \
+  X(cp_a_u8)
+
+#define CB_HANDLERS(X)                                                        \
+  X(rlc_r) X(rrc_r) X(rl_r) X(rr_r) X(sla_r) X(sra_r) X(swap_r) X(srl_r)      \
+  X(bit_n_r) X(res_n_r) X(set_n_r)
+
+#define HANDLER_ENUM(name) H_##name,
+#define HANDLER_FN(name) name,
+
+// H_prefix and H_fallback are handled by the cores themselves; an opcode
+// whose handler is not in the lists above falls back to the table.
+enum { CPU_HANDLERS(HANDLER_ENUM) H_prefix, H_fallback };
+enum { CB_HANDLERS(HANDLER_ENUM) H_cb_fallback };
+
+static void build_decode_table(void) {
+  static bool built = false;
+  if (built) return;
+
+  static void (*const handler_fns[])(registers_t *, const instr_t *) = {
+    CPU_HANDLERS(HANDLER_FN)
+  };
+  static void (*const cb_handler_fns[])(registers_t *, const instr_t *) = {
+    CB_HANDLERS(HANDLER_FN)
+  };
+  const int n_handlers = sizeof(handler_fns) / sizeof(handler_fns[0]);
+  const int n_cb_handlers = sizeof(cb_handler_fns) / sizeof(cb_handler_fns[0]);
+
+  for (int i = 0; i < 512; i++) {
+    u8 op = (u8)i;
+    instr_t *in = &decode_table[i];
+    in->opcode = op;
+    in->r_dst = (op >> 3) & 7;
+    in->r_src = op & 7;
+    in->rr = (op >> 4) & 3;
+    if (i < 0x100) {
+      in->imm_len = imm_lengths[op];
+      in->cycles = base_cycles[op];
+      in->handler = H_fallback;
+      in->flags = 0;
+      if (opcodes[op] == prefix) in->handler = H_prefix;
+      for (int h = 0; h < n_handlers; h++) {
+        if (handler_fns[h] == opcodes[op]) {
+          in->handler = (u8)h;
+          break;
+        }
+      }
+      switch (in->handler) {
+        case H_jr_e: case H_jr_nz: case H_jr_z: case H_jr_nc: case H_jr_c:
+        case H_jp_a16: case H_jp_nz_a16: case H_jp_z_a16: case H_jp_nc_a16:
+        case H_jp_c_a16: case H_jp_hl:
+        case H_call_u16: case H_call_nz: case H_call_z: case H_call_nc:
+        case H_call_c:
+        case H_ret: case H_ret_nz: case H_ret_z: case H_ret_nc: case H_ret_c:
+        case H_reti: case H_rst: case H_halt: case H_stop: case H_illegal_op:
+        case H_fallback:
+          in->flags |= INSTR_BRANCH;
+          break;
+      }
+    } else {
+      // $CB ops: 8 cycles, (HL) operand adds a read (BIT) or read+write
+      in->imm_len = 0;
+      if (in->r_src != REG_HLm) in->cycles = 8;
+      else in->cycles = ((op & 0xC0) == 0x40) ? 12 : 16;
+      in->handler = H_cb_fallback;
+      for (int h = 0; h < n_cb_handlers; h++) {
+        if (cb_handler_fns[h] == cb_ops[op]) {
+          in->handler = (u8)h;
+          break;
+        }
+      }
+    }
+  }
+  built = true;
+}
+
+const instr_t *cpu_decode(u16 index) {
+  build_decode_table();
+  return &decode_table[index & 0x1FF];
+}
+
 void cpu_go(registers_t *cpu) {
     u8 opcode = fetch8(cpu);
-    if (opcodes[opcode]) opcodes[opcode](cpu);
+    if (opcodes[opcode]) opcodes[opcode](cpu, &decode_table[opcode]);
     else {
       exit(1);
     } 
@@ -1337,10 +1703,12 @@ void cpu_go(registers_t *cpu) {
 
 
 void RESET_CPU(registers_t *cpu) {
+    build_decode_table();
     memset(cpu, 0, sizeof(registers_t));
     cpu->SP = 0xFFFE;
     cpu->PC = 0x0000;
     cpu->IME = 0;
+    cpu->breakpoint = -1;
 }
 
 void load_rom(registers_t *cpu, const char *path) {
@@ -1356,13 +1724,36 @@ static inline bool irq_pending(registers_t* c) {
     return ((c->bus->IF & c->bus->IE) & 0x1F) != 0;
 }
 
-void helper(registers_t *cpu) {
+// Halted with nothing pending: IF can only change at the scheduler's next
+// deadline (serial and joypad need the CPU or the frontend to run), so jump
+// straight to the 4-cycle slot that reaches it. Returns the slots skipped;
+// the caller's TICK(4) then runs the deadline itself.
+static inline unsigned long halt_skip(registers_t *cpu) {
+  const Sched_t *s = &cpu->bus->sched;
+  if (cpu->stopped || s->next <= s->time + 4)
+    return 0;
+
+  unsigned long gap = s->next - s->time;
+  if (gap > SKIP_MAX)
+    gap = SKIP_MAX;  // LCD and timer off: give the frontend a turn
+  unsigned long slots = (gap - 1) / 4;
+  cpu->cycle += slots * 4;
+  cpu->bus->sched.time += slots * 4;
+  return slots;
+}
+
+// Everything helper() does before fetching an opcode. Returns false when
+// this step was spent halted or dispatching an interrupt instead.
+static inline bool step_begin(registers_t *cpu) {
   if (cpu->halt) {
-    static int halt_count = 0;
-    halt_count++;
-    if (halt_count == 10000) {
-      fprintf(stderr, "[HALT] CPU halted at PC=%04X IME=%d IF=%02X IE=%02X pending=%d\n",
-              cpu->PC, cpu->IME, cpu->bus->IF, cpu->bus->IE, irq_pending(cpu));
+    cpu->idle.dirty = true;
+    static unsigned long halt_count = 0;
+    unsigned long skipped = 1;
+    if (!irq_pending(cpu))
+      skipped += halt_skip(cpu);
+    if (LOG_ON(LOG_CPU, LOG_DEBUG) && (halt_count += skipped) >= 10000) {
+      write_log("[HALT] CPU halted at PC=%04X IME=%d IF=%02X IE=%02X pending=%d\n",
+                cpu->PC, cpu->IME, cpu->bus->IF, cpu->bus->IE, irq_pending(cpu));
       halt_count = 0;
     }
     TICK(cpu, 4);
@@ -1371,39 +1762,628 @@ void helper(registers_t *cpu) {
       halt_count = 0;
       if (cpu->IME) {
 	uint8_t ticks = handle_interrupts(cpu);
-	if (ticks) {TICK(cpu, ticks); return;}
+	if (ticks) {TICK(cpu, ticks); return false;}
       }
     }
-    return;
+    return false;
   }
 
   if (cpu->IME && irq_pending(cpu)) {
+    cpu->idle.dirty = true;
     uint8_t ticks = handle_interrupts(cpu);
-    if (ticks) {TICK(cpu, ticks); return;}
+    if (ticks) {TICK(cpu, ticks); return false;}
   }
 
   // Log transition from boot ROM to game
-  static bool was_in_bootrom = true;
-  bool in_bootrom = (cpu->PC < 0x0100) && cpu->bus->bootrom_enabled;
-  if (was_in_bootrom && !in_bootrom) {
-    write_log("[CPU] Transitioned from boot ROM to game code at PC=%04X\n",
-              cpu->PC);
+  if (LOG_ON(LOG_BOOT, LOG_DEBUG)) {
+    static bool was_in_bootrom = true;
+    bool in_bootrom = (cpu->PC < 0x0100) && cpu->bus->bootrom_enabled;
+    if (was_in_bootrom && !in_bootrom) {
+      write_log("[CPU] Transitioned from boot ROM to game code at PC=%04X\n",
+                cpu->PC);
+    }
+    was_in_bootrom = in_bootrom;
   }
-  was_in_bootrom = in_bootrom;
+  if (cpu->trace)
+    trace_step(cpu->trace, cpu);
+  return true;
+}
+
+static inline void step_end(registers_t *cpu) {
+  if (cpu->ime_pending) {
+    cpu->IME = 1;
+    cpu->ime_pending = false;
+  }
+}
+
+void helper(registers_t *cpu) {
+  if (!step_begin(cpu))
+    return;
 
   uint8_t opcode = fetch8(cpu);
   
   if (!opcodes[opcode]) {
-    write_log("[ERROR] no handler for opcode %02X at PC=%04X\n", opcode,
-              cpu->PC - 1);
+    LOG(LOG_CPU, LOG_ERROR, "[ERROR] no handler for opcode %02X at PC=%04X\n",
+        opcode, cpu->PC - 1);
     return;
   }
 
-opcodes[opcode](cpu);
+  opcodes[opcode](cpu, &decode_table[opcode]);
+  step_end(cpu);
+}
+
+// Batch limits shared by the cores: a step budget, a cycle to stop at and
+// cpu->breakpoint. The breakpoint is checked before every step but the
+// first, so a batch can resume from the PC it stopped on.
+#define RUN_MORE(cpu, done, steps, until, bp)                 \
+  ((done) < (steps) && (cpu)->cycle < (until) &&              \
+   ((done) == 0 || (cpu)->PC != (bp)))
+
+static unsigned long run_table(registers_t *cpu, unsigned long steps,
+                               unsigned long until) {
+  const int bp = cpu->breakpoint;
+  unsigned long done;
+  for (done = 0; RUN_MORE(cpu, done, steps, until, bp); done++)
+    helper(cpu);
+  return done;
+}
+
+unsigned long cpu_run_table(registers_t *cpu, unsigned long steps) {
+  return run_table(cpu, steps, RUN_FOREVER);
+}
+
+#if defined(__GNUC__) && !defined(GB_NO_COMPUTED_GOTO)
+#define CPU_COMPUTED_GOTO 1
+#else
+#define CPU_COMPUTED_GOTO 0
+#endif
+
+// Same steps as helper(), but in one function so the static inline handlers
+// are inlined and each opcode gets its own dispatch site. Uses GCC's labels
+// as values when available and a plain switch otherwise.
+static unsigned long run_threaded(registers_t *cpu, unsigned long steps,
+                                  unsigned long until) {
+#if CPU_COMPUTED_GOTO
+#define HANDLER_LABEL(name) &&L_##name,
+  static const void *const labels[] = {
+    CPU_HANDLERS(HANDLER_LABEL) &&L_prefix, &&L_fallback
+  };
+  static const void *const cb_labels[] = {
+    CB_HANDLERS(HANDLER_LABEL) &&L_cb_fallback
+  };
+#undef HANDLER_LABEL
+#endif
+  const int bp = cpu->breakpoint;
+  unsigned long done;
+
+  for (done = 0; RUN_MORE(cpu, done, steps, until, bp); done++) {
+    if (!step_begin(cpu))
+      continue;
+
+    const instr_t *in = &decode_table[fetch8(cpu)];
+
+#if CPU_COMPUTED_GOTO
+    goto *labels[in->handler];
+
+#define HANDLER_BODY(name) L_##name: name(cpu, in); goto next;
+    CPU_HANDLERS(HANDLER_BODY)
+  L_prefix:
+    in = &decode_table[0x100 | fetch8(cpu)];
+    goto *cb_labels[in->handler];
+    CB_HANDLERS(HANDLER_BODY)
+#undef HANDLER_BODY
+  L_fallback:
+    opcodes[in->opcode](cpu, in);
+    goto next;
+  L_cb_fallback:
+    cb_ops[in->opcode](cpu, in);
+    goto next;
+#else
+#define HANDLER_CASE(name) case H_##name: name(cpu, in); break;
+    switch (in->handler) {
+      CPU_HANDLERS(HANDLER_CASE)
+      case H_prefix:
+        in = &decode_table[0x100 | fetch8(cpu)];
+        switch (in->handler) {
+          CB_HANDLERS(HANDLER_CASE)
+          default: cb_ops[in->opcode](cpu, in); break;
+        }
+        break;
+      default:
+        opcodes[in->opcode](cpu, in);
+        break;
+    }
+#undef HANDLER_CASE
+#endif
 
-  if (cpu->ime_pending) {
-    cpu->IME = 1;
-    cpu->ime_pending = false;
+#if CPU_COMPUTED_GOTO
+  next:
+#endif
+    step_end(cpu);
+  }
+  return done;
+}
+
+unsigned long cpu_run_threaded(registers_t *cpu, unsigned long steps) {
+  return run_threaded(cpu, steps, RUN_FOREVER);
+}
+
+static inline void jit_regs_load(jit_regs_t *r, const registers_t *cpu) {
+  r->a = cpu->A;
+  r->f = cpu_flags_byte(cpu);
+  r->b = cpu->B;
+  r->c = cpu->C;
+  r->d = cpu->D;
+  r->e = cpu->E;
+  r->h = cpu->H;
+  r->l = cpu->L;
+  r->sp = cpu->SP;
+  r->pc = cpu->PC;
+}
+
+static inline void jit_regs_store(registers_t *cpu, const jit_regs_t *r) {
+  cpu->A = (u8)r->a;
+  flags_drop(cpu);
+  cpu->F.Z = (r->f >> 7) & 1;
+  cpu->F.N = (r->f >> 6) & 1;
+  cpu->F.H = (r->f >> 5) & 1;
+  cpu->F.C = (r->f >> 4) & 1;
+  cpu->B = (u8)r->b;
+  cpu->C = (u8)r->c;
+  cpu->D = (u8)r->d;
+  cpu->E = (u8)r->e;
+  cpu->H = (u8)r->h;
+  cpu->L = (u8)r->l;
+  cpu->SP = (u16)r->sp;
+}
+
+static inline void jit_bind(jit_regs_t *r, void *ctx,
+                            const u8 *const *read_map, u8 *const *write_map,
+                            uint32_t (*rd)(jit_regs_t *, uint32_t, uint32_t),
+                            uint32_t (*wr)(jit_regs_t *, uint32_t, uint32_t,
+                                           uint32_t)) {
+  r->cycles = r->synced = r->ran = r->stop = r->dirty = 0;
+  r->read_map = read_map;
+  r->write_map = write_map;
+  r->read = rd;
+  r->write = wr;
+  r->ctx = ctx;
+}
+
+// Slow path of compiled code: tick what the run has spent up to the access,
+// then go through read8()/write8() like the interpreter.
+static uint32_t jit_read(jit_regs_t *r, uint32_t addy, uint32_t at) {
+  registers_t *cpu = r->ctx;
+  TICK(cpu, at - r->synced);
+  r->synced = at;
+  return read8(cpu, (u16)addy);
+}
+
+static uint32_t jit_write(jit_regs_t *r, uint32_t addy, uint32_t val,
+                          uint32_t at) {
+  registers_t *cpu = r->ctx;
+  TICK(cpu, at - r->synced);
+  r->synced = at;
+  write8(cpu, (u16)addy, (u8)val);
+  return jit_write_ends_run(addy);
+}
+
+// How many ops of the run at op can go native. helper() stops before an op
+// at a pending interrupt, the end of the batch or the breakpoint; IF only
+// moves at a scheduler deadline or through a store that ends the run, so a
+// run that is over before the next deadline sees none of that but the
+// batch limits. 0 leaves the op to the interpreter.
+static int native_len(registers_t *cpu, const block_op_t *op,
+                      unsigned long budget, unsigned long until, int bp) {
+  const Sched_t *s = &cpu->bus->sched;
+  if (cpu->stopped || cpu->ime_pending || cpu->halt_bug || s->next <= s->time ||
+      (cpu->ppu && cpu->ppu->dma_active))
+    return 0;
+
+  unsigned long room = s->next - s->time;
+  if (op->native_cycles < room && op->native_len <= budget && bp < 0 &&
+      (until == RUN_FOREVER || cpu->cycle + op->native_cycles <= until))
+    return op->native_len;
+
+  unsigned long t = 0;
+  u16 pc = cpu->PC;
+  int k = 0;
+  while (k < op->native_len && (unsigned long)k < budget) {
+    if (k && (pc == bp || cpu->cycle + t >= until))
+      break;
+    t += jit_op_cycles(&op[k]);
+    if (t >= room)
+      break;
+    pc += op[k].len;
+    k++;
   }
+  return k;
+}
+
+// address after the first ran ops of a run that starts at pc
+static inline u16 run_end(const block_op_t *op, int ran, u16 pc) {
+  for (int i = 0; i < ran; i++)
+    pc += op[i].len;
+  return pc;
+}
+
+// PC after a native call that ran r->ran ops ending at `end`
+static inline u16 native_pc(const block_op_t *op, const jit_regs_t *r,
+                            u16 end) {
+  return (op[r->ran - 1].in->flags & INSTR_BRANCH) ? (u16)r->pc : end;
+}
+
+// Runs k ops of the run starting at op natively (its step_begin() has
+// already happened) and ticks the cycles the call-outs haven't. Returns the
+// ops run: fewer than k after a store that ends the run.
+static int run_native(registers_t *cpu, const block_op_t *op, int k) {
+  jit_regs_t r;
+  jit_regs_load(&r, cpu);
+  jit_bind(&r, cpu, cpu->bus->read_map, cpu->bus->write_map, jit_read,
+           jit_write);
+  op->native(&r, (uint32_t)k);
+  TICK(cpu, r.cycles - r.synced);
+  jit_regs_store(cpu, &r);
+  if (r.dirty)
+    cpu->idle.dirty = true;
+
+  int ran = (int)r.ran;
+  u16 from = run_end(op, ran, cpu->PC);
+  cpu->PC = native_pc(op, &r, from);
+  switch (op[ran - 1].in->handler) {
+    case H_jr_e: case H_jr_nz: case H_jr_z: case H_jr_nc: case H_jr_c:
+    case H_jp_a16: case H_jp_nz_a16: case H_jp_z_a16: case H_jp_nc_a16:
+    case H_jp_c_a16:
+      idle_branch(cpu, from);
+      break;
+  }
+  cpu->jit->native_ops += ran;
+  return ran;
+}
+
+// JIT_VERIFY: the RAM a run can touch as it was before the interpreter ran
+// it, and the slow-path accesses the interpreter made. The run is then
+// replayed natively against the copy and both end states are compared.
+#define SHADOW_SLOTS (2 * (0xFE - 0x80))
+typedef struct jit_shadow {
+  const u8 *read_map[256];      // the bus's, RAM pages pointing at mem[]
+  u8 *write_map[256];
+  int slot[256];                // mem[] read_map[page] points at, -1 = none
+  const u8 *live[SHADOW_SLOTS]; // page each slot is a copy of
+  u8 mem[SHADOW_SLOTS][256];
+  int slots;
+  u8 hram[0x7F];
+  bus_log_t log;
+  unsigned long time;           // sched.time when the run started
+  int next;                     // log entries the native run has matched
+  bool bad;                     // a call-out didn't match the log
+} jit_shadow_t;
+
+static int shadow_slot(jit_shadow_t *sh, const u8 *live) {
+  for (int s = 0; s < sh->slots; s++)
+    if (sh->live[s] == live)
+      return s;
+  sh->live[sh->slots] = live;
+  memcpy(sh->mem[sh->slots], live, 256);
+  return sh->slots++;
+}
+
+// Copies the RAM behind the page maps and starts logging; false if the
+// scratch can't be allocated
+static bool shadow_begin(registers_t *cpu) {
+  jit_shadow_t *sh = cpu->jit->shadow;
+  Bus_t *bus = cpu->bus;
+  if (!sh) {
+    sh = cpu->jit->shadow = malloc(sizeof(*sh));
+    if (!sh)
+      return false;
+  }
+
+  memcpy(sh->read_map, bus->read_map, sizeof(sh->read_map));
+  memcpy(sh->write_map, bus->write_map, sizeof(sh->write_map));
+  sh->slots = 0;
+  for (int p = 0; p < 256; p++) {
+    sh->slot[p] = -1;
+    if (p < 0x80 || p > 0xFD)
+      continue;
+    if (bus->read_map[p]) {
+      sh->slot[p] = shadow_slot(sh, bus->read_map[p]);
+      sh->read_map[p] = sh->mem[sh->slot[p]];
+    }
+    if (bus->write_map[p])
+      sh->write_map[p] = sh->mem[shadow_slot(sh, bus->write_map[p])];
+  }
+  memcpy(sh->hram, bus->hram, sizeof(sh->hram));
+  sh->log.n = 0;
+  sh->log.overflow = false;
+  sh->time = bus->sched.time;
+  sh->next = 0;
+  sh->bad = false;
+  bus->log = &sh->log;
+  return true;
+}
+
+// the interpreter's next slow-path access, if it is this one
+static const bus_access_t *shadow_match(jit_shadow_t *sh, uint32_t addy,
+                                        bool write, uint32_t at) {
+  if (sh->next == sh->log.n) {
+    sh->bad = true;
+    return NULL;
+  }
+  const bus_access_t *e = &sh->log.at[sh->next++];
+  if (e->addy != addy || e->write != write || e->time - sh->time != at)
+    sh->bad = true;
+  return e;
+}
+
+static uint32_t jit_verify_read(jit_regs_t *r, uint32_t addy, uint32_t at) {
+  jit_shadow_t *sh = r->ctx;
+  const bus_access_t *e = shadow_match(sh, addy, false, at);
+  if (addy >= 0xFF80 && addy <= 0xFFFE)
+    return sh->hram[addy - 0xFF80];
+  return e ? e->val : 0xFF;
+}
+
+static uint32_t jit_verify_write(jit_regs_t *r, uint32_t addy, uint32_t val,
+                                 uint32_t at) {
+  jit_shadow_t *sh = r->ctx;
+  const bus_access_t *e = shadow_match(sh, addy, true, at);
+  if (e && e->val != (u8)val)
+    sh->bad = true;
+  if (addy >= 0xFF80 && addy <= 0xFFFE)
+    sh->hram[addy - 0xFF80] = (u8)val;
+  else if (sh->slot[addy >> 8] >= 0)
+    sh->mem[sh->slot[addy >> 8]][addy & 0xFF] = (u8)val;
+  return jit_write_ends_run(addy);
+}
+
+// true if the accesses logged from `from` on include a store that ends a
+// native run (or the log overflowed)
+static bool shadow_ends_run(const jit_shadow_t *sh, int from) {
+  if (sh->log.overflow)
+    return true;
+  for (int i = from; i < sh->log.n; i++)
+    if (sh->log.at[i].write && jit_write_ends_run(sh->log.at[i].addy))
+      return true;
+  return false;
+}
+
+// Replays the k ops the interpreter just ran from seg through the native
+// code and compares registers, PC, cycles, the slow-path accesses and RAM.
+// A mismatching run loses its native entry.
+static void jit_check(registers_t *cpu, const block_t *b, block_op_t *seg,
+                      int k, const jit_regs_t *before,
+                      const jit_regs_t *want) {
+  jit_shadow_t *sh = cpu->jit->shadow;
+  cpu->bus->log = NULL;
+  if (!k || sh->log.overflow)
+    return;
+
+  jit_regs_t got = *before;
+  jit_bind(&got, sh, sh->read_map, sh->write_map, jit_verify_read,
+           jit_verify_write);
+  seg->native(&got, (uint32_t)k);
+  cpu->jit->checked++;
+  if (got.ran == (uint32_t)k)
+    got.pc = native_pc(seg, &got, run_end(seg, k, (u16)before->pc));
+
+  bool mem_ok = memcmp(sh->hram, cpu->bus->hram, sizeof(sh->hram)) == 0;
+  for (int s = 0; s < sh->slots && mem_ok; s++)
+    mem_ok = memcmp(sh->mem[s], sh->live[s], 256) == 0;
+  bool bus_ok = !sh->bad && sh->next == sh->log.n;
+  if (memcmp(&got, want, offsetof(jit_regs_t, synced)) == 0 &&
+      got.ran == (uint32_t)k && bus_ok && mem_ok)
+    return;
+
+  u16 pc = b->pc;
+  for (const block_op_t *op = b->ops; op != seg; op++)
+    pc += op->len;
+
+  cpu->jit->mismatches++;
+  fprintf(stderr,
+          "[JIT] mismatch at %02X:%04X (%d of %d ops, first %02X)%s%s\n"
+          "      native A=%02X F=%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%04X"
+          " PC=%04X cycles=%u ran=%u\n"
+          "      interp A=%02X F=%02X BC=%02X%02X DE=%02X%02X HL=%02X%02X SP=%04X"
+          " PC=%04X cycles=%u\n",
+          (unsigned)b->bank, pc, k, seg->native_len, seg->bytes[0],
+          bus_ok ? "" : ", bus accesses differ",
+          mem_ok ? "" : ", RAM differs",
+          got.a, got.f, got.b, got.c, got.d, got.e, got.h, got.l, got.sp,
+          got.pc, got.cycles, got.ran,
+          want->a, want->f, want->b, want->c, want->d, want->e, want->h,
+          want->l, want->sp, want->pc, want->cycles);
+  seg->native = NULL;
+  seg->native_len = 0;
+}
+
+// Runs a cached block until it ends, an interrupt/HALT takes over, the
+// step budget runs out, or a write invalidates the code it came from.
+// Immediates come from the block through cpu->fetch_ptr; every bus access
+// and TICK still happens exactly as it does in helper().
+static unsigned long run_block(registers_t *cpu, block_t *b,
+                               unsigned long steps, unsigned long until) {
+  const int bp = cpu->breakpoint;
+  uint32_t gen = *b->gen;
+  unsigned long n = 0;
+  bool verify = cpu->jit && cpu->jit->mode == JIT_VERIFY;
+  block_op_t *seg = NULL;  // run being verified
+  int seg_end = 0, seg_k = 0;
+  unsigned long seg_cycle = 0, seg_skipped = 0;
+  jit_regs_t seg_in, seg_out;
+
+  for (int i = 0; i < b->count && RUN_MORE(cpu, n, steps, until, bp); i++) {
+    block_op_t *op = &b->ops[i];
+    n++;
+    if (!step_begin(cpu))
+      break;
+
+    // traced runs stay in the interpreter: one record per instruction
+    if (op->native && !seg && !cpu->trace) {
+      int k = native_len(cpu, op, steps - n + 1, until, bp);
+      if (k && !verify) {
+        int ran = run_native(cpu, op, k);
+        n += ran - 1;
+        i += ran - 1;
+        if (*b->gen != gen)
+          break;
+        continue;
+      }
+      if (k && shadow_begin(cpu)) {
+        seg = op;
+        seg_end = i + k;
+        seg_k = 0;
+        seg_cycle = cpu->cycle;
+        seg_skipped = cpu->idle.skipped;
+        jit_regs_load(&seg_in, cpu);
+      }
+    }
+    int logged = seg ? cpu->jit->shadow->log.n : 0;
+
+    u8 opcode = op->bytes[0];
+    TICK(cpu, 4);
+    dma_wait(cpu, cpu->PC);
+    cpu->PC++;
+
+    if (!opcodes[opcode]) {
+      LOG(LOG_CPU, LOG_ERROR, "[ERROR] no handler for opcode %02X at PC=%04X\n",
+          opcode, cpu->PC - 1);
+      break;
+    }
+
+    cpu->fetch_ptr = &op->bytes[1];
+    opcodes[opcode](cpu, op->in);
+    cpu->fetch_ptr = NULL;
+    step_end(cpu);
+
+    if (seg) {
+      seg_k++;
+      jit_regs_load(&seg_out, cpu);
+      seg_out.cycles = (uint32_t)(cpu->cycle - seg_cycle -
+                                  (cpu->idle.skipped - seg_skipped));
+      if (i + 1 == seg_end || shadow_ends_run(cpu->jit->shadow, logged)) {
+        jit_check(cpu, b, seg, seg_k, &seg_in, &seg_out);
+        seg = NULL;
+      }
+    }
+
+    if (*b->gen != gen || cpu->halt)
+      break;
+  }
+
+  if (seg)
+    jit_check(cpu, b, seg, seg_k, &seg_in, &seg_out);
+  return n;
+}
+
+static unsigned long run_blocks(registers_t *cpu, unsigned long steps,
+                                unsigned long until) {
+  const int bp = cpu->breakpoint;
+  unsigned long done = 0;
+
+  while (RUN_MORE(cpu, done, steps, until, bp)) {
+    block_t *b = NULL;
+    if (!cpu->halt && !cpu->halt_bug)
+      b = block_lookup(cpu->blocks, cpu->bus, cpu->PC);
+    if (!b) {
+      helper(cpu);
+      done++;
+      continue;
+    }
+    if (cpu->jit && !b->jitted && b->bank != BLOCK_BANK_RAM &&
+        ++b->runs >= JIT_HOT_THRESHOLD)
+      jit_compile_block(cpu->jit, cpu->blocks, b);
+    done += run_block(cpu, b, steps - done, until);
+  }
+  return done;
 }
 
+unsigned long cpu_run_blocks(registers_t *cpu, unsigned long steps) {
+  return run_blocks(cpu, steps, RUN_FOREVER);
+}
+
+bool cpu_enable_block_cache(registers_t *cpu, bool enable) {
+  if (!enable) {
+    cpu_enable_jit(cpu, JIT_OFF);
+    block_cache_free(cpu->blocks);
+    cpu->blocks = NULL;
+    return true;
+  }
+  if (cpu->blocks)
+    return true;
+  build_decode_table();
+  cpu->blocks = block_cache_new();
+  if (!cpu->blocks) {
+    fprintf(stderr, "[CPU] block cache allocation failed\n");
+    return false;
+  }
+  return true;
+}
+
+bool cpu_enable_jit(registers_t *cpu, int mode) {
+  if (mode == JIT_OFF) {
+    if (cpu->jit && cpu->blocks)
+      jit_flush(cpu->jit, cpu->blocks);
+    jit_free(cpu->jit);
+    cpu->jit = NULL;
+    return true;
+  }
+  if (!cpu_enable_block_cache(cpu, true))
+    return false;
+  if (!cpu->jit) {
+    cpu->jit = jit_new(mode);
+    if (!cpu->jit)
+      return false;  // interpreter (block cache) only
+  }
+  cpu->jit->mode = mode;
+  return true;
+}
+
+static unsigned long run_batch(registers_t *cpu, unsigned long steps,
+                               unsigned long until) {
+  unsigned long ran;
+  if (cpu->blocks)
+    ran = run_blocks(cpu, steps, until);
+  else
+#ifdef GB_THREADED_CORE
+    ran = run_threaded(cpu, steps, until);
+#else
+    ran = run_table(cpu, steps, until);
+#endif
+  // leave LY/STAT/DIV current for the frontend
+  sched_sync(cpu->bus);
+  return ran;
+}
+
+unsigned long cpu_run(registers_t *cpu, unsigned long steps) {
+  return run_batch(cpu, steps, RUN_FOREVER);
+}
+
+gb_status_t gb_run_cycles(registers_t *cpu, unsigned long cycles) {
+  unsigned long until = cpu->cycle + cycles;
+  run_batch(cpu, RUN_FOREVER, until);
+  if (cpu->stopped)
+    return GB_STOPPED;
+  if (cpu->cycle < until && cpu->PC == cpu->breakpoint)
+    return GB_BREAKPOINT;
+  return GB_CYCLES_DONE;
+}
+
+// Cycles until the PPU next enters VBlank (sets frame_ready); a frame's
+// worth when the LCD is off so the frontend keeps polling.
+static unsigned long cycles_to_vblank(const Ppu_t *d) {
+  if (!(d->LCDC & LCDC_ENABLE))
+    return FRAME_CYCLES;
+  unsigned long lines = d->LY < 144 ? 143 - d->LY : 153 - d->LY + 144;
+  return lines * 456 + (456 - d->cycles_in_line);
+}
+
+gb_status_t gb_run_frame(registers_t *cpu) {
+  if (cpu->stopped)
+    return GB_STOPPED;
+  sched_sync(cpu->bus);
+  gb_status_t st = gb_run_cycles(cpu, cycles_to_vblank(cpu->ppu));
+  if (st == GB_CYCLES_DONE && cpu->ppu->frame_ready)
+    return GB_FRAME_DONE;
+  return st;
+}
@@ -5,8 +5,6 @@
 #include "timers.h"
 #include "ppu.h"
 
-uint8_t read_byte_bus(Bus_t *bus, uint16_t addy);
-
 #define GET_FLAG(num) ( (uint8_t)(1u << ( ((num)-0x40) / 8)) )
 
 #define IF_ADDY 0xFF0F
@@ -17,17 +15,13 @@ uint8_t read_byte_bus(Bus_t *bus, uint16_t addy);
 static inline void push_16(registers_t *cpu, u16 val) {
   cpu->SP--;
   cpu->cycle += 4;
-  if (!cpu->stopped) {
-    tick_timers(&cpu->bus->timers, 4, &cpu->bus->IF);
-    display_cycle(cpu->ppu, cpu->bus, 4);
-  }
+  if (!cpu->stopped)
+    sched_tick(cpu->bus, &cpu->bus->sched, 4);
   write_byte_bus(cpu->bus, cpu->SP, (u8)(val >> 8));
   cpu->SP--;
   cpu->cycle += 4;
-  if (!cpu->stopped) {
-    tick_timers(&cpu->bus->timers, 4, &cpu->bus->IF);
-    display_cycle(cpu->ppu, cpu->bus, 4);
-  }
+  if (!cpu->stopped)
+    sched_tick(cpu->bus, &cpu->bus->sched, 4);
   write_byte_bus(cpu->bus, cpu->SP, (u8)(val & 0xFF));
 }
 
@@ -66,6 +60,17 @@ void set_IME(registers_t *cpu, bool val) {
   cpu->IME = val;
 }
 
+static const char *int_name(interrupt_source interrupt) {
+  switch (interrupt) {
+    case INT_VBLANK: return "VBLANK";
+    case INT_STAT: return "STAT";
+    case INT_TIMER: return "TIMER";
+    case INT_SERIAL: return "SERIAL";
+    case INT_JOYPAD: return "JOYPAD";
+  }
+  return "UNKNOWN";
+}
+
 static inline void handle_interrupt(registers_t *cpu, interrupt_source interrupt) {
   cpu->halt = false;
   cpu->IME = 0;
@@ -77,17 +82,12 @@ static inline void handle_interrupt(registers_t *cpu, interrupt_source interrupt
   cpu->PC = (uint16_t)interrupt;
   
   // Debug: check what code is at the interrupt handler
-  uint8_t handler_code = read_byte_bus(cpu->bus, cpu->PC);
-  
-  const char *int_name = "UNKNOWN";
-  if (interrupt == 0x40) int_name = "VBLANK";
-  else if (interrupt == 0x48) int_name = "STAT";
-  else if (interrupt == 0x50) int_name = "TIMER";
-  else if (interrupt == 0x58) int_name = "SERIAL";
-  else if (interrupt == 0x60) int_name = "JOYPAD";
-  
-  write_log("[INT] Handling %s interrupt | old PC=%04X -> handler=%04X (code=%02X) | IF=%02X IE=%02X IME=%d\n",
-            int_name, old_pc, cpu->PC, handler_code, cpu->bus->IF, cpu->bus->IE, cpu->IME);
+  if (LOG_ON(LOG_INT, LOG_DEBUG)) {
+    uint8_t handler_code = read_byte_bus(cpu->bus, cpu->PC);
+    write_log("[INT] Handling %s interrupt | old PC=%04X -> handler=%04X (code=%02X) | IF=%02X IE=%02X IME=%d\n",
+              int_name(interrupt), old_pc, cpu->PC, handler_code,
+              cpu->bus->IF, cpu->bus->IE, cpu->IME);
+  }
 }
 
 u8 handle_interrupts(registers_t *cpu) {
@@ -96,24 +96,14 @@ u8 handle_interrupts(registers_t *cpu) {
       cpu->halt = false;
 
       if (!cpu->IME) {
-        const char *int_name = "UNKNOWN";
-        if (i == 0x40)
-          int_name = "VBLANK";
-        else if (i == 0x48)
-          int_name = "STAT";
-        else if (i == 0x50)
-          int_name = "TIMER";
-        else if (i == 0x58)
-          int_name = "SERIAL";
-        else if (i == 0x60)
-          int_name = "JOYPAD";
-
-        static int suppressed_count = 0;
-        if (i == INT_JOYPAD || suppressed_count < 10) {
-          write_log("[INT] %s interrupt pending but IME=0 (IF=%02X IE=%02X PC=%04X)\n",
-                    int_name, cpu->bus->IF, cpu->bus->IE, cpu->PC);
-          if (i != INT_JOYPAD)
-            suppressed_count++;
+        if (LOG_ON(LOG_INT, LOG_DEBUG)) {
+          static int suppressed_count = 0;
+          if (i == INT_JOYPAD || suppressed_count < 10) {
+            write_log("[INT] %s interrupt pending but IME=0 (IF=%02X IE=%02X PC=%04X)\n",
+                      int_name(i), cpu->bus->IF, cpu->bus->IE, cpu->PC);
+            if (i != INT_JOYPAD)
+              suppressed_count++;
+          }
         }
         return 0;
       }
@@ -0,0 +1,1046 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_NATIVE 1
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#else
+#define JIT_NATIVE 0
+#endif
+
+// JR/JP/CALL/RET, conditional or not: compiled as the last op of a run
+static bool tail_op(u8 o) {
+  switch (o) {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:  // jr
+    case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:  // jp
+    case 0xE9:                                              // jp hl
+    case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:  // call
+    case 0xC9: case 0xC0: case 0xC8: case 0xD0: case 0xD8:  // ret
+      return true;
+  }
+  return false;
+}
+
+// Which ops can be compiled: everything with a fixed cycle count that
+// doesn't touch IME, HALT or STOP. Matches the handlers in cpu.c's
+// opcodes[]/cb_ops[].
+bool jit_supported(const block_op_t *op) {
+  u8 o = op->bytes[0];
+  u8 dst = (o >> 3) & 7;
+
+  if (o == 0xCB)
+    return op->len == 2;
+  if (tail_op(o))
+    return true;
+  switch (o) {
+    case 0x00: case 0x07: case 0x0F: case 0x17: case 0x1F:
+    case 0x2F: case 0x37: case 0x3F: case 0xF9:
+    case 0x02: case 0x12: case 0x0A: case 0x1A:  // ld (bc/de),a and back
+    case 0x22: case 0x32: case 0x2A: case 0x3A:  // ld (hl+/-),a and back
+    case 0x34: case 0x35: case 0x36:             // inc/dec/ld (hl)
+    case 0x08:                                   // ld (a16),sp
+    case 0xE0: case 0xF0: case 0xE2: case 0xF2:  // ldh
+    case 0xEA: case 0xFA:                        // ld (a16),a and back
+    case 0xC1: case 0xD1: case 0xE1: case 0xF1:  // pop
+    case 0xC5: case 0xD5: case 0xE5: case 0xF5:  // push
+      return true;
+  }
+  if ((o & 0xCF) == 0x01 || (o & 0xCF) == 0x03 || (o & 0xCF) == 0x0B ||
+      (o & 0xCF) == 0x09)
+    return true;  // ld rr,d16 / inc rr / dec rr / add hl,rr
+  if (o < 0x40 && ((o & 7) == 4 || (o & 7) == 5 || (o & 7) == 6))
+    return dst != 6;  // inc r / dec r / ld r,d8
+  if (o >= 0x40 && o < 0x80)
+    return o != 0x76;  // ld r,r / ld r,(hl) / ld (hl),r
+  if (o >= 0x80 && o < 0xC0)
+    return true;  // alu a,r / alu a,(hl)
+  if (o >= 0xC0 && (o & 7) == 6)
+    return true;  // alu a,d8
+  return false;
+}
+
+int jit_op_cycles(const block_op_t *op) {
+  switch (op->bytes[0]) {
+    case 0xCB:
+      return cpu_decode(0x100 | op->bytes[1])->cycles;
+    case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+      return op->in->cycles + 4;
+    case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+    case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+      return op->in->cycles + 12;
+  }
+  return op->in->cycles;
+}
+
+#if JIT_NATIVE
+
+// host registers
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// SM83 registers pinned for the whole run: A r8, B-L r9-r14, SP r15, F ebx.
+// eax/ecx/edx/ebp are scratch, esi counts the ops left, rdi -> jit_regs_t.
+#define H_A R8
+#define H_SP R15
+#define H_F EBX
+static const int host_reg[8] = { R9, R10, R11, R12, R13, R14, -1, R8 };
+
+// x86 opcodes / ModRM extensions used below
+#define X_ADD 0x01
+#define X_OR 0x09
+#define X_AND 0x21
+#define X_SUB 0x29
+#define X_XOR 0x31
+#define X_MOV 0x89
+#define X_TEST 0x85
+#define G_ADD 0
+#define G_OR 1
+#define G_AND 4
+#define G_SUB 5
+#define G_XOR 6
+#define S_SHL 4
+#define S_SHR 5
+#define CC_Z 0x4
+#define CC_NZ 0x5
+
+typedef struct {
+  u8 *p;
+  u8 *end;
+  bool overflow;
+  int cyc;      // T-cycles from the start of the run to the current op
+  bool stores;  // the current op stores through the write call-out
+} emit_t;
+
+static void emit8(emit_t *e, u8 v) {
+  if (e->p < e->end) *e->p++ = v;
+  else e->overflow = true;
+}
+
+static void emit32(emit_t *e, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    emit8(e, (u8)(v >> (8 * i)));
+}
+
+static void rex(emit_t *e, int reg, int rm, bool byte_op) {
+  u8 r = 0x40 | ((reg >> 3) << 2) | (rm >> 3);
+  if (r != 0x40 || byte_op)
+    emit8(e, r);
+}
+
+// op dst, src (32-bit, r/m32 <- r32 form)
+static void op_rr(emit_t *e, u8 op, int dst, int src) {
+  rex(e, src, dst, false);
+  emit8(e, op);
+  emit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// group-1 op dst, imm32
+static void op_ri(emit_t *e, int ext, int dst, uint32_t imm) {
+  rex(e, 0, dst, false);
+  emit8(e, 0x81);
+  emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+  emit32(e, imm);
+}
+
+static void mov_ri(emit_t *e, int dst, uint32_t imm) {
+  rex(e, 0, dst, false);
+  emit8(e, 0xB8 + (dst & 7));
+  emit32(e, imm);
+}
+
+static void shift_ri(emit_t *e, int ext, int dst, u8 n) {
+  rex(e, 0, dst, false);
+  emit8(e, 0xC1);
+  emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+  emit8(e, n);
+}
+
+// dst = condition ? 1 : 0
+static void setcc(emit_t *e, u8 cc, int dst) {
+  rex(e, 0, dst, true);
+  emit8(e, 0x0F);
+  emit8(e, 0x90 | cc);
+  emit8(e, 0xC0 | (dst & 7));
+  rex(e, dst, dst, true);  // movzx dst, dst8
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  emit8(e, 0xC0 | ((dst & 7) << 3) | (dst & 7));
+}
+
+// op reg, [rdi + disp] (32-bit) / mov reg64, [rdi + disp]
+static void state_rm(emit_t *e, u8 op, int reg, u8 disp) {
+  rex(e, reg, EDI, false);
+  emit8(e, op);
+  emit8(e, 0x40 | ((reg & 7) << 3) | EDI);
+  emit8(e, disp);
+}
+
+static void load_state(emit_t *e, int reg, u8 disp) {
+  state_rm(e, 0x8B, reg, disp);
+}
+
+static void store_state(emit_t *e, int reg, u8 disp) {
+  state_rm(e, 0x89, reg, disp);
+}
+
+static void load_ptr(emit_t *e, int reg, u8 disp) {
+  emit8(e, 0x48 | ((reg >> 3) << 2));
+  emit8(e, 0x8B);
+  emit8(e, 0x40 | ((reg & 7) << 3) | EDI);
+  emit8(e, disp);
+}
+
+// mov dword [rdi + disp], imm
+static void set_state(emit_t *e, u8 disp, uint32_t imm) {
+  emit8(e, 0xC7);
+  emit8(e, 0x40 | EDI);
+  emit8(e, disp);
+  emit32(e, imm);
+}
+
+static void test_ri(emit_t *e, int reg, uint32_t imm) {
+  rex(e, 0, reg, false);
+  emit8(e, 0xF7);
+  emit8(e, 0xC0 | (reg & 7));
+  emit32(e, imm);
+}
+
+// forward jcc / jmp with a rel32 that land() fills in
+static u8 *jump(emit_t *e, int cc) {
+  if (cc < 0) {
+    emit8(e, 0xE9);
+  } else {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+  }
+  u8 *rel = e->p;
+  emit32(e, 0);
+  return rel;
+}
+
+static void land(emit_t *e, u8 *rel) {
+  if (e->overflow)
+    return;
+  int32_t d = (int32_t)(e->p - (rel + 4));
+  memcpy(rel, &d, 4);
+}
+
+static void jump_back(emit_t *e, const u8 *to) {
+  emit8(e, 0xE9);
+  emit32(e, (uint32_t)(int32_t)(to - (e->p + 4)));
+}
+
+static void push_reg(emit_t *e, int reg) {
+  if (reg >= 8) emit8(e, 0x41);
+  emit8(e, 0x50 + (reg & 7));
+}
+
+static void pop_reg(emit_t *e, int reg) {
+  if (reg >= 8) emit8(e, 0x41);
+  emit8(e, 0x58 + (reg & 7));
+}
+
+#define STATE(field) ((u8)offsetof(jit_regs_t, field))
+
+static const struct { int reg; u8 disp; } pinned[] = {
+  { H_A, STATE(a) }, { H_F, STATE(f) }, { R9, STATE(b) }, { R10, STATE(c) },
+  { R11, STATE(d) }, { R12, STATE(e) }, { R13, STATE(h) }, { R14, STATE(l) },
+  { H_SP, STATE(sp) },
+};
+#define N_PINNED (int)(sizeof(pinned) / sizeof(pinned[0]))
+static const int saved[] = { EBX, EBP, R12, R13, R14, R15 };
+#define N_SAVED (int)(sizeof(saved) / sizeof(saved[0]))
+
+// 16-bit pair (0 BC, 1 DE, 2 HL, 3 SP) <-> scratch register
+static void pair_get(emit_t *e, int dst, int rr) {
+  if (rr == 3) {
+    op_rr(e, X_MOV, dst, H_SP);
+    return;
+  }
+  op_rr(e, X_MOV, dst, host_reg[rr * 2]);
+  shift_ri(e, S_SHL, dst, 8);
+  op_rr(e, X_OR, dst, host_reg[rr * 2 + 1]);
+}
+
+static void pair_set(emit_t *e, int rr, int src) {
+  if (rr == 3) {
+    op_rr(e, X_MOV, H_SP, src);
+    op_ri(e, G_AND, H_SP, 0xFFFF);
+    return;
+  }
+  int hi = host_reg[rr * 2], lo = host_reg[rr * 2 + 1];
+  op_rr(e, X_MOV, lo, src);
+  op_ri(e, G_AND, lo, 0xFF);
+  op_rr(e, X_MOV, hi, src);
+  shift_ri(e, S_SHR, hi, 8);
+  op_ri(e, G_AND, hi, 0xFF);
+}
+
+// pinned registers the SysV ABI lets a callee clobber (A, B, C, D)
+static void spill(emit_t *e, bool reload) {
+  for (int i = 0; i < N_PINNED; i++) {
+    int reg = pinned[i].reg;
+    if (reg < R8 || reg > R11)
+      continue;
+    if (reload)
+      load_state(e, reg, pinned[i].disp);
+    else
+      store_state(e, reg, pinned[i].disp);
+  }
+}
+
+// Call read/write in jit_regs_t for the address in edx (value in ecx for a
+// write). A write's result is or'ed into stop, a read's is left in eax.
+static void call_out(emit_t *e, u8 fn, int at, bool write) {
+  spill(e, false);
+  emit8(e, 0x57);  // push rdi
+  emit8(e, 0x56);  // push rsi
+  op_rr(e, X_MOV, ESI, EDX);
+  if (write)
+    op_rr(e, X_MOV, EDX, ECX);
+  mov_ri(e, write ? ECX : EDX, (uint32_t)at);
+  emit8(e, 0xFF);  // call [rdi + fn]
+  emit8(e, 0x50 | EDI);
+  emit8(e, fn);
+  emit8(e, 0x5E);  // pop rsi
+  emit8(e, 0x5F);  // pop rdi
+  if (write) {
+    state_rm(e, 0x09, EAX, STATE(stop));  // or [rdi + stop], eax
+    e->stores = true;
+  }
+  spill(e, true);
+}
+
+// eax = byte at edx: read_map[edx >> 8], or the read call-out when the page
+// is NULL. `at` is the cycle of the access. Clobbers ecx, edx.
+static void mem_read(emit_t *e, int at) {
+  op_rr(e, X_MOV, EAX, EDX);
+  shift_ri(e, S_SHR, EAX, 8);
+  load_ptr(e, ECX, STATE(read_map));
+  emit8(e, 0x48);  // mov rcx, [rcx + rax*8]
+  emit8(e, 0x8B);
+  emit8(e, 0x0C);
+  emit8(e, 0xC1);
+  emit8(e, 0x48);  // test rcx, rcx
+  emit8(e, 0x85);
+  emit8(e, 0xC9);
+  u8 *slow = jump(e, CC_Z);
+  emit8(e, 0x0F);  // movzx eax, dl
+  emit8(e, 0xB6);
+  emit8(e, 0xC2);
+  emit8(e, 0x0F);  // movzx eax, byte [rcx + rax]
+  emit8(e, 0xB6);
+  emit8(e, 0x04);
+  emit8(e, 0x01);
+  u8 *done = jump(e, -1);
+  land(e, slow);
+  call_out(e, STATE(read), at, false);
+  land(e, done);
+}
+
+// byte at edx = cl, through write_map or the write call-out.
+// Clobbers eax, ecx, edx, ebp.
+static void mem_write(emit_t *e, int at) {
+  op_rr(e, X_MOV, EAX, EDX);
+  shift_ri(e, S_SHR, EAX, 8);
+  load_ptr(e, EBP, STATE(write_map));
+  emit8(e, 0x48);  // mov rax, [rbp + rax*8]
+  emit8(e, 0x8B);
+  emit8(e, 0x44);
+  emit8(e, 0xC5);
+  emit8(e, 0x00);
+  emit8(e, 0x48);  // test rax, rax
+  emit8(e, 0x85);
+  emit8(e, 0xC0);
+  u8 *slow = jump(e, CC_Z);
+  emit8(e, 0x0F);  // movzx ebp, dl
+  emit8(e, 0xB6);
+  emit8(e, 0xEA);
+  emit8(e, 0x88);  // mov [rax + rbp], cl
+  emit8(e, 0x0C);
+  emit8(e, 0x28);
+  set_state(e, STATE(dirty), 1);
+  u8 *done = jump(e, -1);
+  land(e, slow);
+  call_out(e, STATE(write), at, true);
+  land(e, done);
+}
+
+// F |= (res == 0) << 7; clobbers eax
+static void set_z(emit_t *e, int res) {
+  op_rr(e, X_TEST, res, res);
+  setcc(e, CC_Z, EAX);
+  shift_ri(e, S_SHL, EAX, 7);
+  op_rr(e, X_OR, H_F, EAX);
+}
+
+// ebp = old carry (0/1)
+static void old_carry(emit_t *e) {
+  op_rr(e, X_MOV, EBP, H_F);
+  shift_ri(e, S_SHR, EBP, 4);
+  op_ri(e, G_AND, EBP, 1);
+}
+
+// A op= ecx, for the 8 ALU ops in 0x80-0xBF order
+static void emit_alu8(emit_t *e, int kind) {
+  bool sub = (kind == 2 || kind == 3 || kind == 7);
+  bool carry = (kind == 1 || kind == 3);
+
+  op_rr(e, X_MOV, EAX, H_A);
+  op_rr(e, X_MOV, EDX, EAX);
+
+  if (kind == 4 || kind == 5 || kind == 6) {  // and / xor / or
+    op_rr(e, kind == 4 ? X_AND : kind == 5 ? X_XOR : X_OR, EDX, ECX);
+    mov_ri(e, H_F, kind == 4 ? 0x20 : 0x00);
+    set_z(e, EDX);
+    op_rr(e, X_MOV, H_A, EDX);
+    return;
+  }
+
+  op_rr(e, sub ? X_SUB : X_ADD, EDX, ECX);
+  if (carry) {
+    old_carry(e);
+    op_rr(e, sub ? X_SUB : X_ADD, EDX, EBP);
+  }
+  // H: carry/borrow into bit 4 -> F bit 5
+  op_rr(e, X_MOV, EBP, EAX);
+  op_rr(e, X_XOR, EBP, ECX);
+  op_rr(e, X_XOR, EBP, EDX);
+  op_ri(e, G_AND, EBP, 0x10);
+  shift_ri(e, S_SHL, EBP, 1);
+  // C: bit 8 of the 32-bit result -> F bit 4
+  op_rr(e, X_MOV, ECX, EDX);
+  shift_ri(e, S_SHR, ECX, 4);
+  op_ri(e, G_AND, ECX, 0x10);
+  op_rr(e, X_OR, EBP, ECX);
+  if (sub)
+    op_ri(e, G_OR, EBP, 0x40);
+  op_ri(e, G_AND, EDX, 0xFF);
+  op_rr(e, X_MOV, H_F, EBP);
+  set_z(e, EDX);
+  if (kind != 7)
+    op_rr(e, X_MOV, H_A, EDX);
+}
+
+// $CB rotate/shift/swap on eax -> result edx, new carry (0/1) ecx
+static void emit_cb_shift(emit_t *e, int kind) {
+  switch (kind) {
+    case 0:  // rlc
+    case 2:  // rl
+    case 4:  // sla
+      op_rr(e, X_MOV, ECX, EAX);
+      shift_ri(e, S_SHR, ECX, 7);
+      op_rr(e, X_MOV, EDX, EAX);
+      shift_ri(e, S_SHL, EDX, 1);
+      if (kind == 0) op_rr(e, X_OR, EDX, ECX);
+      if (kind == 2) {
+        old_carry(e);
+        op_rr(e, X_OR, EDX, EBP);
+      }
+      op_ri(e, G_AND, EDX, 0xFF);
+      break;
+    case 1:  // rrc
+    case 3:  // rr
+    case 5:  // sra
+    case 7:  // srl
+      op_rr(e, X_MOV, ECX, EAX);
+      op_ri(e, G_AND, ECX, 1);
+      op_rr(e, X_MOV, EDX, EAX);
+      shift_ri(e, S_SHR, EDX, 1);
+      if (kind == 1) {
+        op_rr(e, X_MOV, EBP, ECX);
+        shift_ri(e, S_SHL, EBP, 7);
+        op_rr(e, X_OR, EDX, EBP);
+      } else if (kind == 3) {
+        old_carry(e);
+        shift_ri(e, S_SHL, EBP, 7);
+        op_rr(e, X_OR, EDX, EBP);
+      } else if (kind == 5) {
+        op_rr(e, X_MOV, EBP, EAX);
+        op_ri(e, G_AND, EBP, 0x80);
+        op_rr(e, X_OR, EDX, EBP);
+      }
+      break;
+    case 6:  // swap
+      mov_ri(e, ECX, 0);
+      op_rr(e, X_MOV, EDX, EAX);
+      shift_ri(e, S_SHL, EDX, 4);
+      op_rr(e, X_MOV, EBP, EAX);
+      shift_ri(e, S_SHR, EBP, 4);
+      op_rr(e, X_OR, EDX, EBP);
+      op_ri(e, G_AND, EDX, 0xFF);
+      break;
+  }
+}
+
+static void emit_cb(emit_t *e, u8 o) {
+  int r = host_reg[o & 7];
+  int bit = (o >> 3) & 7;
+
+  switch (o >> 6) {
+    case 0:
+      op_rr(e, X_MOV, EAX, r);
+      emit_cb_shift(e, bit);
+      op_rr(e, X_MOV, r, EDX);
+      op_rr(e, X_MOV, H_F, ECX);
+      shift_ri(e, S_SHL, H_F, 4);
+      set_z(e, EDX);
+      break;
+    case 1:  // bit: Z = !(r & mask), N = 0, H = 1, C kept
+      op_ri(e, G_AND, H_F, 0x10);
+      op_ri(e, G_OR, H_F, 0x20);
+      op_rr(e, X_MOV, EDX, r);
+      op_ri(e, G_AND, EDX, 1u << bit);
+      set_z(e, EDX);
+      break;
+    case 2:
+      op_ri(e, G_AND, r, 0xFF & ~(1u << bit));
+      break;
+    case 3:
+      op_ri(e, G_OR, r, 1u << bit);
+      break;
+  }
+}
+
+// inc r / dec r: H from the carry/borrow into bit 4, C kept
+static void emit_incdec(emit_t *e, int r, bool dec) {
+  op_rr(e, X_MOV, EAX, r);
+  op_rr(e, X_MOV, EDX, EAX);
+  op_ri(e, dec ? G_SUB : G_ADD, EDX, 1);
+  op_rr(e, X_MOV, EBP, EAX);
+  op_rr(e, X_XOR, EBP, EDX);
+  op_ri(e, G_AND, EBP, 0x10);
+  shift_ri(e, S_SHL, EBP, 1);
+  if (dec) op_ri(e, G_OR, EBP, 0x40);
+  op_ri(e, G_AND, EDX, 0xFF);
+  op_rr(e, X_MOV, r, EDX);
+  op_ri(e, G_AND, H_F, 0x10);
+  op_rr(e, X_OR, H_F, EBP);
+  set_z(e, EDX);
+}
+
+static void emit_reg_op(emit_t *e, const block_op_t *op) {
+  u8 o = op->bytes[0];
+  int dst = (o >> 3) & 7, src = o & 7, rr = (o >> 4) & 3;
+  u16 imm16 = (u16)(op->bytes[1] | (op->bytes[2] << 8));
+
+  switch (o) {
+    case 0x00:
+      return;
+    case 0xCB:
+      emit_cb(e, op->bytes[1]);
+      return;
+    case 0x07:  // rlca / rrca / rla / rra: Z, N, H cleared
+    case 0x0F:
+    case 0x17:
+    case 0x1F:
+      op_rr(e, X_MOV, EAX, H_A);
+      emit_cb_shift(e, (o >> 3) & 3);
+      op_rr(e, X_MOV, H_A, EDX);
+      op_rr(e, X_MOV, H_F, ECX);
+      shift_ri(e, S_SHL, H_F, 4);
+      return;
+    case 0x2F:  // cpl
+      op_ri(e, G_XOR, H_A, 0xFF);
+      op_ri(e, G_OR, H_F, 0x60);
+      return;
+    case 0x37:  // scf
+      op_ri(e, G_AND, H_F, 0x80);
+      op_ri(e, G_OR, H_F, 0x10);
+      return;
+    case 0x3F:  // ccf
+      op_ri(e, G_AND, H_F, 0x90);
+      op_ri(e, G_XOR, H_F, 0x10);
+      return;
+    case 0xF9:  // ld sp,hl
+      pair_get(e, EDX, 2);
+      op_rr(e, X_MOV, H_SP, EDX);
+      return;
+  }
+
+  switch (o & 0xCF) {
+    case 0x01:  // ld rr,d16
+      mov_ri(e, EDX, imm16);
+      pair_set(e, rr, EDX);
+      return;
+    case 0x03:  // inc rr / dec rr
+    case 0x0B:
+      pair_get(e, EDX, rr);
+      op_ri(e, (o & 0x08) ? G_SUB : G_ADD, EDX, 1);
+      pair_set(e, rr, EDX);
+      return;
+    case 0x09: {  // add hl,rr: N = 0, H from bit 11, C from bit 15, Z kept
+      pair_get(e, EAX, 2);
+      pair_get(e, ECX, rr);
+      op_rr(e, X_MOV, EDX, EAX);
+      op_rr(e, X_ADD, EDX, ECX);
+      op_rr(e, X_MOV, EBP, EAX);
+      op_rr(e, X_XOR, EBP, ECX);
+      op_rr(e, X_XOR, EBP, EDX);
+      op_ri(e, G_AND, EBP, 0x1000);
+      shift_ri(e, S_SHR, EBP, 7);
+      op_rr(e, X_MOV, ECX, EDX);
+      shift_ri(e, S_SHR, ECX, 12);
+      op_ri(e, G_AND, ECX, 0x10);
+      op_rr(e, X_OR, EBP, ECX);
+      op_ri(e, G_AND, H_F, 0x80);
+      op_rr(e, X_OR, H_F, EBP);
+      pair_set(e, 2, EDX);
+      return;
+    }
+  }
+
+  if (o < 0x40) {
+    int r = host_reg[dst];
+    if ((o & 7) == 6) {  // ld r,d8
+      mov_ri(e, r, op->bytes[1]);
+      return;
+    }
+    emit_incdec(e, r, (o & 7) == 5);
+    return;
+  }
+
+  if (o < 0x80) {  // ld r,r
+    if (dst != src)
+      op_rr(e, X_MOV, host_reg[dst], host_reg[src]);
+    return;
+  }
+
+  if (o < 0xC0) {
+    op_rr(e, X_MOV, ECX, host_reg[src]);
+    emit_alu8(e, dst);
+    return;
+  }
+
+  mov_ri(e, ECX, op->bytes[1]);  // alu a,d8
+  emit_alu8(e, dst);
+}
+
+static void sp_step(emit_t *e, int delta) {
+  op_ri(e, delta < 0 ? G_SUB : G_ADD, H_SP, 1);
+  op_ri(e, G_AND, H_SP, 0xFFFF);
+}
+
+static void hl_step(emit_t *e, int delta) {
+  pair_get(e, EDX, 2);
+  op_ri(e, delta < 0 ? G_SUB : G_ADD, EDX, 1);
+  pair_set(e, 2, EDX);
+}
+
+// Ops that touch memory; `t` is the cycle after their fetches, and each
+// access comes 4 cycles after the one before, as in cpu.c's handlers.
+// False if op is register-only.
+static bool emit_mem_op(emit_t *e, const block_op_t *op, int t) {
+  u8 o = op->bytes[0];
+  int dst = (o >> 3) & 7, src = o & 7, rr = (o >> 4) & 3;
+  u16 imm16 = (u16)(op->bytes[1] | (op->bytes[2] << 8));
+
+  switch (o) {
+    case 0x02:  // ld (bc),a / ld (de),a
+    case 0x12:
+      pair_get(e, EDX, rr);
+      op_rr(e, X_MOV, ECX, H_A);
+      mem_write(e, t + 4);
+      return true;
+    case 0x0A:  // ld a,(bc) / ld a,(de)
+    case 0x1A:
+      pair_get(e, EDX, rr);
+      mem_read(e, t + 4);
+      op_rr(e, X_MOV, H_A, EAX);
+      return true;
+    case 0x22:  // ld (hl+),a / ld (hl-),a
+    case 0x32:
+      pair_get(e, EDX, 2);
+      op_rr(e, X_MOV, ECX, H_A);
+      mem_write(e, t + 4);
+      hl_step(e, o == 0x22 ? 1 : -1);
+      return true;
+    case 0x2A:  // ld a,(hl+) / ld a,(hl-)
+    case 0x3A:
+      pair_get(e, EDX, 2);
+      mem_read(e, t + 4);
+      op_rr(e, X_MOV, H_A, EAX);
+      hl_step(e, o == 0x2A ? 1 : -1);
+      return true;
+    case 0x34:  // inc (hl) / dec (hl)
+    case 0x35:
+      pair_get(e, EDX, 2);
+      mem_read(e, t + 4);
+      op_rr(e, X_MOV, ECX, EAX);
+      emit_incdec(e, ECX, o == 0x35);
+      pair_get(e, EDX, 2);
+      mem_write(e, t + 8);
+      return true;
+    case 0x36:  // ld (hl),d8
+      pair_get(e, EDX, 2);
+      mov_ri(e, ECX, op->bytes[1]);
+      mem_write(e, t + 4);
+      return true;
+    case 0x08:  // ld (a16),sp
+      mov_ri(e, EDX, imm16);
+      op_rr(e, X_MOV, ECX, H_SP);
+      op_ri(e, G_AND, ECX, 0xFF);
+      mem_write(e, t + 4);
+      mov_ri(e, EDX, (u16)(imm16 + 1));
+      op_rr(e, X_MOV, ECX, H_SP);
+      shift_ri(e, S_SHR, ECX, 8);
+      mem_write(e, t + 8);
+      return true;
+    case 0xE0:  // ldh (a8),a / ld (a16),a / ld (c),a
+    case 0xEA:
+    case 0xE2:
+      if (o == 0xE2) {
+        op_rr(e, X_MOV, EDX, host_reg[1]);
+        op_ri(e, G_OR, EDX, 0xFF00);
+      } else {
+        mov_ri(e, EDX, o == 0xE0 ? 0xFF00u | op->bytes[1] : imm16);
+      }
+      op_rr(e, X_MOV, ECX, H_A);
+      mem_write(e, t + 4);
+      return true;
+    case 0xF0:  // ldh a,(a8) / ld a,(a16) / ld a,(c)
+    case 0xFA:
+    case 0xF2:
+      if (o == 0xF2) {
+        op_rr(e, X_MOV, EDX, host_reg[1]);
+        op_ri(e, G_OR, EDX, 0xFF00);
+      } else {
+        mov_ri(e, EDX, o == 0xF0 ? 0xFF00u | op->bytes[1] : imm16);
+      }
+      mem_read(e, t + 4);
+      op_rr(e, X_MOV, H_A, EAX);
+      return true;
+    case 0xC1:  // pop rr (af: the low nibble of F reads as 0)
+    case 0xD1:
+    case 0xE1:
+    case 0xF1:
+      op_rr(e, X_MOV, EDX, H_SP);
+      mem_read(e, t + 4);
+      if (rr == 3) {
+        op_ri(e, G_AND, EAX, 0xF0);
+        op_rr(e, X_MOV, H_F, EAX);
+      } else {
+        op_rr(e, X_MOV, host_reg[rr * 2 + 1], EAX);
+      }
+      sp_step(e, 1);
+      op_rr(e, X_MOV, EDX, H_SP);
+      mem_read(e, t + 8);
+      op_rr(e, X_MOV, rr == 3 ? H_A : host_reg[rr * 2], EAX);
+      sp_step(e, 1);
+      return true;
+    case 0xC5:  // push rr
+    case 0xD5:
+    case 0xE5:
+    case 0xF5:
+      sp_step(e, -1);
+      op_rr(e, X_MOV, EDX, H_SP);
+      op_rr(e, X_MOV, ECX, rr == 3 ? H_A : host_reg[rr * 2]);
+      mem_write(e, t + 4);
+      sp_step(e, -1);
+      op_rr(e, X_MOV, EDX, H_SP);
+      op_rr(e, X_MOV, ECX, rr == 3 ? H_F : host_reg[rr * 2 + 1]);
+      mem_write(e, t + 8);
+      return true;
+  }
+
+  if (o >= 0x40 && o < 0x80 && src == 6) {  // ld r,(hl)
+    pair_get(e, EDX, 2);
+    mem_read(e, t + 4);
+    op_rr(e, X_MOV, host_reg[dst], EAX);
+    return true;
+  }
+  if (o >= 0x40 && o < 0x80 && dst == 6) {  // ld (hl),r
+    pair_get(e, EDX, 2);
+    op_rr(e, X_MOV, ECX, host_reg[src]);
+    mem_write(e, t + 4);
+    return true;
+  }
+  if (o >= 0x80 && o < 0xC0 && src == 6) {  // alu a,(hl)
+    pair_get(e, EDX, 2);
+    mem_read(e, t + 4);
+    op_rr(e, X_MOV, ECX, EAX);
+    emit_alu8(e, dst);
+    return true;
+  }
+
+  if (o != 0xCB || (op->bytes[1] & 7) != 6)
+    return false;
+  // $CB op on (hl): read, then written back unless it's BIT
+  u8 cb = op->bytes[1];
+  int bit = (cb >> 3) & 7;
+  pair_get(e, EDX, 2);
+  mem_read(e, t + 4);
+  switch (cb >> 6) {
+    case 0:
+      emit_cb_shift(e, bit);
+      op_rr(e, X_MOV, H_F, ECX);
+      shift_ri(e, S_SHL, H_F, 4);
+      set_z(e, EDX);
+      op_rr(e, X_MOV, ECX, EDX);
+      break;
+    case 1:
+      op_ri(e, G_AND, H_F, 0x10);
+      op_ri(e, G_OR, H_F, 0x20);
+      op_rr(e, X_MOV, EDX, EAX);
+      op_ri(e, G_AND, EDX, 1u << bit);
+      set_z(e, EDX);
+      return true;
+    case 2:
+      op_ri(e, G_AND, EAX, 0xFF & ~(1u << bit));
+      op_rr(e, X_MOV, ECX, EAX);
+      break;
+    case 3:
+      op_ri(e, G_OR, EAX, 1u << bit);
+      op_rr(e, X_MOV, ECX, EAX);
+      break;
+  }
+  pair_get(e, EDX, 2);
+  mem_write(e, t + 8);
+  return true;
+}
+
+static void emit_op(emit_t *e, const block_op_t *op) {
+  if (!emit_mem_op(e, op, e->cyc + op->len * 4))
+    emit_reg_op(e, op);
+  e->cyc += jit_op_cycles(op);
+}
+
+// One way out of the run: the cycles and ops it took, then the shared exit
+static void leave(emit_t *e, int cycles, int ran, const u8 *exit) {
+  set_state(e, STATE(cycles), (uint32_t)cycles);
+  set_state(e, STATE(ran), (uint32_t)ran);
+  jump_back(e, exit);
+}
+
+// jumps to the returned rel32 when SM83 condition cc (NZ Z NC C) is false
+static u8 *unless(emit_t *e, int cc) {
+  test_ri(e, H_F, cc < 2 ? 0x80 : 0x10);
+  return jump(e, (cc & 1) ? CC_Z : CC_NZ);
+}
+
+// The JR/JP/CALL/RET ending the run at pc, with both ways out
+static void emit_tail(emit_t *e, const block_op_t *op, u16 pc, int ran,
+                      const u8 *exit) {
+  u8 o = op->bytes[0];
+  u16 next = (u16)(pc + op->len);
+  u16 target = (u16)(op->bytes[1] | (op->bytes[2] << 8));
+  int t = e->cyc + op->len * 4;
+  bool cond = (o & 0xE7) == 0x20 || (o & 0xE7) == 0xC2 ||
+              (o & 0xE7) == 0xC4 || (o & 0xE7) == 0xC0;
+  u8 *skip = NULL;
+
+  if (o == 0xE9) {  // jp hl
+    pair_get(e, EDX, 2);
+    store_state(e, EDX, STATE(pc));
+    leave(e, t, ran, exit);
+    return;
+  }
+  if (o == 0xC9 || (o & 0xE7) == 0xC0) {  // ret / ret cc
+    if (cond) {
+      t += 4;
+      skip = unless(e, (o >> 3) & 3);
+    }
+    op_rr(e, X_MOV, EDX, H_SP);
+    mem_read(e, t + 4);
+    op_rr(e, X_MOV, EBP, EAX);
+    sp_step(e, 1);
+    op_rr(e, X_MOV, EDX, H_SP);
+    mem_read(e, t + 8);
+    sp_step(e, 1);
+    shift_ri(e, S_SHL, EAX, 8);
+    op_rr(e, X_OR, EAX, EBP);
+    store_state(e, EAX, STATE(pc));
+    leave(e, t + 12, ran, exit);
+  } else {
+    if (o == 0x18 || (o & 0xE7) == 0x20)
+      target = (u16)(next + (int8_t)op->bytes[1]);
+    if (cond)
+      skip = unless(e, (o >> 3) & 3);
+    int taken = t + 4;
+    if (o == 0xCD || (o & 0xE7) == 0xC4) {  // call: push the return address
+      sp_step(e, -1);
+      op_rr(e, X_MOV, EDX, H_SP);
+      mov_ri(e, ECX, next >> 8);
+      mem_write(e, t + 4);
+      sp_step(e, -1);
+      op_rr(e, X_MOV, EDX, H_SP);
+      mov_ri(e, ECX, next & 0xFF);
+      mem_write(e, t + 8);
+      taken = t + 12;
+    }
+    set_state(e, STATE(pc), target);
+    leave(e, taken, ran, exit);
+  }
+
+  if (skip) {
+    land(e, skip);
+    set_state(e, STATE(pc), next);
+    leave(e, t, ran, exit);
+  }
+}
+
+// void fn(jit_regs_t *regs, uint32_t count): runs at most count ops of the
+// run at pc. The shared exit is emitted first so every way out of the run
+// is a jump back to it.
+static jit_fn_t emit_run(jit_t *jit, const block_op_t *ops, int len, u16 pc) {
+  emit_t e = { jit->code + jit->used, jit->code + JIT_CODE_SIZE, false, 0,
+               false };
+
+  u8 *exit = e.p;
+  for (int i = 0; i < N_PINNED; i++)
+    store_state(&e, pinned[i].reg, pinned[i].disp);
+  emit8(&e, 0x5F);  // pop rdi
+  for (int i = N_SAVED - 1; i >= 0; i--)
+    pop_reg(&e, saved[i]);
+  emit8(&e, 0xC3);
+
+  u8 *start = e.p;
+  for (int i = 0; i < N_SAVED; i++)
+    push_reg(&e, saved[i]);
+  emit8(&e, 0x57);  // push rdi: also keeps the call-outs' stack aligned
+  for (int i = 0; i < N_PINNED; i++)
+    load_state(&e, pinned[i].reg, pinned[i].disp);
+
+  for (int i = 0; i < len; i++) {
+    const block_op_t *op = &ops[i];
+    if (tail_op(op->bytes[0])) {  // a branch always ends the block
+      emit_tail(&e, op, pc, i + 1, exit);
+      break;
+    }
+    e.stores = false;
+    emit_op(&e, op);
+    pc += op->len;
+
+    // out after this op: count reached, or a store that ends the run
+    u8 *stop = NULL, *more = NULL;
+    if (i + 1 < len) {
+      if (e.stores) {
+        emit8(&e, 0x83);  // cmp dword [rdi + stop], 0
+        emit8(&e, 0x40 | (7 << 3) | EDI);
+        emit8(&e, STATE(stop));
+        emit8(&e, 0x00);
+        stop = jump(&e, CC_NZ);
+      }
+      emit8(&e, 0xFF);  // dec esi
+      emit8(&e, 0xCE);
+      more = jump(&e, CC_NZ);
+    }
+    if (stop)
+      land(&e, stop);
+    leave(&e, e.cyc, i + 1, exit);
+    if (more)
+      land(&e, more);
+  }
+
+  if (e.overflow)
+    return NULL;
+  jit->used = (size_t)(e.p - jit->code);
+
+  jit_fn_t fn;
+  void *p = start;
+  memcpy(&fn, &p, sizeof(fn));
+  return fn;
+}
+
+jit_t *jit_new(int mode) {
+  jit_t *jit = calloc(1, sizeof(jit_t));
+  if (!jit) return NULL;
+  void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    fprintf(stderr, "[JIT] can't map %u bytes of code memory\n",
+            JIT_CODE_SIZE);
+    free(jit);
+    return NULL;
+  }
+  jit->code = code;
+  jit->mode = mode;
+  return jit;
+}
+
+void jit_free(jit_t *jit) {
+  if (!jit) return;
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit->shadow);
+  free(jit);
+}
+
+void jit_compile_block(jit_t *jit, block_cache_t *bc, block_t *b) {
+  b->jitted = true;
+  if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+    return;
+
+  u16 pc = b->pc;
+  for (int i = 0; i < b->count;) {
+    int len = 0, cycles = 0;
+    u16 next = pc;
+    while (i + len < b->count && jit_supported(&b->ops[i + len])) {
+      cycles += jit_op_cycles(&b->ops[i + len]);
+      next += b->ops[i + len].len;
+      len++;
+    }
+
+    if (len >= JIT_MIN_OPS) {
+      jit_fn_t fn = emit_run(jit, &b->ops[i], len, pc);
+      if (!fn) {
+        // arena full: start over, this block gets compiled again once hot
+        mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+        jit_flush(jit, bc);
+        return;
+      }
+      b->ops[i].native = fn;
+      b->ops[i].native_len = (u8)len;
+      b->ops[i].native_cycles = (u16)cycles;
+      jit->segments++;
+    }
+    if (!len)
+      next += b->ops[i].len;
+    i += len ? len : 1;
+    pc = next;
+  }
+  mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+}
+
+#else  // !JIT_NATIVE
+
+jit_t *jit_new(int mode) {
+  (void)mode;
+  fprintf(stderr, "[JIT] not supported on this host, using the interpreter\n");
+  return NULL;
+}
+
+void jit_free(jit_t *jit) {
+  if (jit)
+    free(jit->shadow);
+  free(jit);
+}
+
+void jit_compile_block(jit_t *jit, block_cache_t *bc, block_t *b) {
+  (void)jit;
+  (void)bc;
+  b->jitted = true;
+}
+
+#endif
+
+void jit_flush(jit_t *jit, block_cache_t *bc) {
+  for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++) {
+    block_t *b = &bc->entries[i];
+    b->runs = 0;
+    b->jitted = false;
+    for (int j = 0; j < b->count; j++) {
+      b->ops[j].native = NULL;
+      b->ops[j].native_len = 0;
+      b->ops[j].native_cycles = 0;
+    }
+  }
+  jit->used = 0;
+  jit->flushes++;
+}
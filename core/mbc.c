@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <time.h>
 #include "mbc.h"
+#include "logging.h"
 
 static const uint32_t MBC3_SECONDS_PER_DAY = 24u * 60u * 60u;
 static const uint16_t MBC3_DAY_MAX = 512u;
@@ -20,6 +21,7 @@ static void mbc3_rtc_set_components(Cartridge_t *cart,
                                     uint8_t hours,
                                     uint8_t minutes,
                                     uint8_t seconds);
+static const mapper_t *mapper_for(mbc_t type);
 
 
 mbc_t get_cartridge_type(uint8_t type) {
@@ -30,6 +32,9 @@ mbc_t get_cartridge_type(uint8_t type) {
     case 0x02:
     case 0x03:
       return MBC_1;
+    case 0x05:
+    case 0x06:
+      return MBC_2;
     case 0x0F:
     case 0x10:
     case 0x11:
@@ -39,6 +44,9 @@ mbc_t get_cartridge_type(uint8_t type) {
     case 0x19:
     case 0x1A:
     case 0x1B:
+    case 0x1C:  // + rumble
+    case 0x1D:
+    case 0x1E:
       return MBC_5;
     default: return MBC_0;
   }
@@ -128,6 +136,7 @@ Cartridge_t *load_cart(const char *path) {
   cart->rom_size = file_size;
 
   cart->type = get_cartridge_type(cart_type);
+  cart->rumble = cart_type >= 0x1C && cart_type <= 0x1E;
   
   cart->rom_banks = (uint16_t)(cart->rom_size / 0x4000);
   if (cart->rom_banks == 0) {
@@ -140,6 +149,8 @@ Cartridge_t *load_cart(const char *path) {
 }
 
   cart->ram_size = get_cartridge_ram_size(ram_size_code);
+  if (cart->type == MBC_2)
+    cart->ram_size = 512;  // built in, the header says none
   if (cart->ram_size) {
     cart->ram = (uint8_t*)calloc(1, cart->ram_size);
     cart->ram_banks = (uint8_t)(cart->ram_size / 0x2000);
@@ -160,6 +171,9 @@ Cartridge_t *load_cart(const char *path) {
   cart->rtc_latch_prev = 0;
   cart->rtc_last_update = time(NULL);
   if (cart->rtc_last_update == (time_t)-1) cart->rtc_last_update = 0;
+
+  cart->mapper = mapper_for(cart->type);
+  cart->mapper->map(cart);
   fprintf(stderr,
     "[cart] type=%d (hdr=%02X)  rom_banks=%u  file=%zu bytes  "
     "rom_code=%02X  ram_code=%02X  ram_banks=%u\n",
@@ -177,24 +191,47 @@ void free_cart(Cartridge_t *cart) {
   free(cart);
 }
 
-static inline uint8_t read_mbc0(Cartridge_t *cart, uint16_t addy) {
-  if (addy < 0x8000) {
-    return (addy < cart->rom_size) ? cart->rom[addy] : 0xFF;
-  }
+/* ------------- bank windows ------------- */
 
-  if (addy >= 0xA000 && addy <= 0xBFFF) {
-    if (!cart->ram || cart->ram_size == 0) return 0xFF;
-    size_t offset = (size_t)(addy - 0xA000);
-    return (offset < cart->ram_size) ? cart->ram[offset] : 0xFF;
-  }
-  return 0xFF;
+// Point ROM window `slot` (0 = 0000-3FFF, 1 = 4000-7FFF) at `bank`. A bank
+// past the end of the image leaves the window NULL and cart_read() goes
+// through read_mbc_bytes(), which warns and returns 0xFF.
+static void map_rom(Cartridge_t *cart, int slot, uint32_t bank) {
+  size_t base = (size_t)bank * 0x4000u;
+  cart->rom_window_bank[slot] = bank;
+  cart->rom_window[slot] =
+    (base + 0x4000u <= cart->rom_size) ? cart->rom + base : NULL;
 }
 
-static inline void write_mbc0(Cartridge_t *cart, uint16_t addy, uint8_t val) {
-  if (addy >= 0xA000 && addy <= 0xBFFF && cart->ram && cart->ram_size) {
-    size_t offset = (size_t)(addy - 0xA000);
-    cart->ram[offset] = val;
-  }
+// RAM window at A000, only for a fully backed 8KB bank
+static void map_ram(Cartridge_t *cart, bool enabled, uint32_t bank) {
+  cart->ram_window = NULL;
+  if (!enabled || !cart->ram)
+    return;
+  bank %= (cart->ram_banks ? cart->ram_banks : 1);
+  size_t base = (size_t)bank * 0x2000u;
+  if (base + 0x2000u <= cart->ram_size)
+    cart->ram_window = cart->ram + base;
+}
+
+// A000-BFFF accesses without a RAM window (2KB carts) land here
+static uint8_t ram_bank_read(const Cartridge_t *cart, uint32_t bank,
+                             uint16_t addy) {
+  if (!cart->ram)
+    return 0xFF;
+  bank %= (cart->ram_banks ? cart->ram_banks : 1);
+  size_t off = (size_t)bank * 0x2000u + (addy - 0xA000);
+  return (off < cart->ram_size) ? cart->ram[off] : 0xFF;
+}
+
+static void ram_bank_write(Cartridge_t *cart, uint32_t bank, uint16_t addy,
+                           uint8_t val) {
+  if (!cart->ram)
+    return;
+  bank %= (cart->ram_banks ? cart->ram_banks : 1);
+  size_t off = (size_t)bank * 0x2000u + (addy - 0xA000);
+  if (off < cart->ram_size)
+    cart->ram[off] = val;
 }
 
 static inline uint8_t read_mbc_bytes(Cartridge_t *cart, uint32_t bank_num, uint16_t addy) {
@@ -207,13 +244,9 @@ static inline uint8_t read_mbc_bytes(Cartridge_t *cart, uint32_t bank_num, uint1
     return cart->rom[offset];
   }
 
-  static int warn_count = 0;
-  if (warn_count < 16) {
-    fprintf(stderr,
-      "[MBC] ROM read OOB: bank=%u addy=%04X offset=%u size=%zu\n",
-      bank_num, addy, offset, cart->rom_size);
-    warn_count++;
-  }
+  LOG_FIRST(16, LOG_MBC, LOG_WARN,
+            "[MBC] ROM read OOB: bank=%u addy=%04X offset=%u size=%zu\n",
+            bank_num, addy, offset, cart->rom_size);
   return 0xFF;
 }
 
@@ -299,60 +332,61 @@ static void mbc3_rtc_tick(Cartridge_t *cart) {
   mbc3_rtc_update_regs(cart);
 }
 
+
+/* --------------- MBC0 --------------- */
+
+static void mbc0_write_reg(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  (void)cart; (void)addy; (void)val;
+}
+
+static void mbc0_map(Cartridge_t *cart) {
+  map_rom(cart, 0, 0);
+  map_rom(cart, 1, 1);
+  map_ram(cart, true, 0);
+}
+
+static uint8_t mbc0_ram_read(Cartridge_t *cart, uint16_t addy) {
+  return ram_bank_read(cart, 0, addy);
+}
+
+static void mbc0_ram_write(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  ram_bank_write(cart, 0, addy, val);
+}
+
 /* --------------- MBC1 --------------- */
 
-uint8_t read_mbc1(Cartridge_t *cart, uint16_t addy) {
+static uint32_t mbc1_rom_bank(const Cartridge_t *cart, uint16_t addy) {
   bool large_rom = (cart->rom_banks >= 32); 
 
   if (addy < 0x4000) {
     if (cart->mode == 1 && large_rom) {
       uint32_t bank = ((uint32_t)(cart->ram_bank & 0x03)) << 5;
       if (bank >= cart->rom_banks) bank %= cart->rom_banks;
-      return read_mbc_bytes(cart, bank, addy);
+      return bank;
     }
-    return read_mbc_bytes(cart, 0, addy);
-}
-
-
-  if (addy >= 0x4000 && addy <= 0x7FFF) {  
-    uint32_t low5 = (uint32_t)(cart->rom_bank & 0x1F);
-    uint32_t hi2  = (large_rom && cart->mode == 0)
-                      ? (uint32_t)(cart->ram_bank & 0x03)
-                      : 0;
-    uint32_t bank = (hi2 << 5) | low5;
+    return 0;
+  }
 
-    if (bank >= cart->rom_banks) bank %= cart->rom_banks;
-    if ((bank & 0x1F) == 0) bank |= 1;          
+  uint32_t low5 = (uint32_t)(cart->rom_bank & 0x1F);
+  uint32_t hi2  = (large_rom && cart->mode == 0)
+                    ? (uint32_t)(cart->ram_bank & 0x03)
+                    : 0;
+  uint32_t bank = (hi2 << 5) | low5;
 
-    static int log_cnt = 0;
-    if (log_cnt < 32) {
-      fprintf(stderr, "[MBC1] ROM read bank=%u pc_bank=%u hi=%u mode=%u\n",
-              bank, cart->rom_bank & 0x1F, hi2, cart->mode);
-      log_cnt++;
-    }
-    return read_mbc_bytes(cart, bank, addy);
+  if (bank >= cart->rom_banks) bank %= cart->rom_banks;
+  if ((bank & 0x1F) == 0) bank |= 1;          
+  return bank;
 }
 
-  if (addy >= 0xA000 && addy <= 0xBFFF) {
-    if (!cart->ram || !cart->ram_enable) return 0xFF;
-    uint32_t bank = (cart->mode == 1) ? (uint32_t)(cart->ram_bank & 0x03) : 0;
-    bank %= (cart->ram_banks ? cart->ram_banks : 1);
-    size_t off = bank * 0x2000u + (addy - 0xA000);
-    return (off < cart->ram_size) ? cart->ram[off] : 0xFF;
-  }
-
-  return 0xFF;
+static uint32_t mbc1_ram_bank(const Cartridge_t *cart) {
+  return (cart->mode == 1) ? (uint32_t)(cart->ram_bank & 0x03) : 0;
 }
 
-void write_mbc1(Cartridge_t *cart, uint16_t addy, uint8_t val) {
-  bool large_rom = (cart->rom_banks >= 32); // larger than 1MB
+static void mbc1_write_reg(Cartridge_t *cart, uint16_t addy, uint8_t val) {
   if (addy < 0x2000) {
     cart->ram_enable = ((val & 0x0F) == 0xA);
-    static int log_cnt = 0;
-    if (log_cnt < 16) {
-      fprintf(stderr, "[MBC1] RAM enable <= %d (val=%02X)\n", cart->ram_enable, val);
-      log_cnt++;
-    }
+    LOG_FIRST(16, LOG_MBC, LOG_DEBUG, "[MBC1] RAM enable <= %d (val=%02X)\n",
+              cart->ram_enable, val);
     return; 
   }
 
@@ -360,84 +394,91 @@ void write_mbc1(Cartridge_t *cart, uint16_t addy, uint8_t val) {
     uint8_t low5 = val & 0x1F;
     if (low5 == 0) low5 = 1;                  
     cart->rom_bank = (cart->rom_bank & ~0x1F) | low5;
-    static int log_cnt = 0;
-    if (log_cnt < 32) {
-      fprintf(stderr, "[MBC1] ROM bank low set -> %u (val=%02X)\n",
+    LOG_FIRST(32, LOG_MBC, LOG_DEBUG,
+              "[MBC1] ROM bank low set -> %u (val=%02X)\n",
               cart->rom_bank & 0x1F, val);
-      log_cnt++;
-    }
     return;
     }
   
   if (addy >= 0x4000 && addy <= 0x5FFF) {
     cart->ram_bank = (val & 0x03);
-    static int log_cnt = 0;
-    if (log_cnt < 32) {
-      fprintf(stderr, "[MBC1] RAM/ROM high bits set -> %u (val=%02X)\n",
+    LOG_FIRST(32, LOG_MBC, LOG_DEBUG,
+              "[MBC1] RAM/ROM high bits set -> %u (val=%02X)\n",
               cart->ram_bank & 0x03, val);
-      log_cnt++;
-    }
     return;
   }
 
   if (addy >= 0x6000 && addy <= 0x7FFF) {
     cart->mode = (val & 0x01);
-    static int log_cnt = 0;
-    if (log_cnt < 16) {
-      fprintf(stderr, "[MBC1] MODE set -> %u (val=%02X)\n", cart->mode, val);
-      log_cnt++;
-    }
-    return;
+    LOG_FIRST(16, LOG_MBC, LOG_DEBUG, "[MBC1] MODE set -> %u (val=%02X)\n",
+              cart->mode, val);
   }
+}
 
-  if (addy >= 0xA000 && addy <= 0xBFFF) {
-    if (!cart->ram || !cart->ram_enable) 
-      return;
+static void mbc1_map(Cartridge_t *cart) {
+  map_rom(cart, 0, mbc1_rom_bank(cart, 0x0000));
+  map_rom(cart, 1, mbc1_rom_bank(cart, 0x4000));
+  map_ram(cart, cart->ram_enable, mbc1_ram_bank(cart));
+}
+
+static uint8_t mbc1_ram_read(Cartridge_t *cart, uint16_t addy) {
+  if (!cart->ram_enable)
+    return 0xFF;
+  return ram_bank_read(cart, mbc1_ram_bank(cart), addy);
+}
 
-    uint32_t bank = (cart->mode == 1) ? (uint32_t)(cart->ram_bank & 0x03) : 0;
-    bank %= (cart->ram_banks ? cart->ram_banks : 1);
+static void mbc1_ram_write(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  if (cart->ram_enable)
+    ram_bank_write(cart, mbc1_ram_bank(cart), addy, val);
+}
+
+/* -------------- MBC2 ------------------- */
+// 16 ROM banks and 512 x 4 bits of RAM inside the MBC, echoed over
+// A000-BFFF. In 0000-3FFF address bit 8 picks the register: clear is RAM
+// enable, set is the ROM bank.
 
-    size_t off = bank * 0x2000u + (addy - 0xA000);
-    if (off < cart->ram_size) cart->ram[off] = val;
+static void mbc2_write_reg(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  if (addy >= 0x4000)
+    return;
+  if (addy & 0x0100) {
+    uint8_t bank = val & 0x0F;
+    cart->rom_bank = bank ? bank : 1;
+  } else {
+    cart->ram_enable = ((val & 0x0F) == 0x0A);
   }
 }
 
+static void mbc2_map(Cartridge_t *cart) {
+  map_rom(cart, 0, 0);
+  map_rom(cart, 1, cart->rom_bank % cart->rom_banks);
+  cart->ram_window = NULL;  // nibble RAM, always through mbc2_ram_*
+}
+
+static uint8_t mbc2_ram_read(Cartridge_t *cart, uint16_t addy) {
+  if (!cart->ram_enable || !cart->ram)
+    return 0xFF;
+  return 0xF0 | cart->ram[(addy - 0xA000) & 0x1FF];
+}
+
+static void mbc2_ram_write(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  if (cart->ram_enable && cart->ram)
+    cart->ram[(addy - 0xA000) & 0x1FF] = val & 0x0F;
+}
+
 /* -------------- MBC3 ------------------- */
-uint8_t read_mbc3(Cartridge_t* cart, uint16_t addy) {
-  if (addy < 0x4000) {
-    return read_mbc_bytes(cart, 0, addy);
-  } else if (addy >= 0x4000 && addy <= 0x7FFF) {
-    uint32_t bank = cart->rom_bank & 0x7F;
-    if (cart->rom_banks) {
-      bank %= cart->rom_banks;
-      if (bank == 0 && cart->rom_banks > 1) bank = 1;
-    }
-    return read_mbc_bytes(cart, bank, addy);
-  } else if (addy >= 0xA000 && addy <= 0xBFFF) {
-    if (!cart->ram_enable)
-      return 0xFF;
-
-    if (cart->ram_bank <= 3 && cart->ram) {
-      uint8_t bank = cart->ram_bank;
-      uint16_t effective = cart->ram_banks ? cart->ram_banks : 1;
-      bank %= effective;
-      size_t off = ((size_t)bank * 0x2000u) + (addy - 0xA000);
-      if (off < cart->ram_size)
-	return cart->ram[off];
-      return 0xFF;
-    } else if (cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C) {
-      uint8_t index = (uint8_t)(cart->ram_bank - 0x08);
-      if (!cart->rtc_latched) {
-	mbc3_rtc_tick(cart);
-	return cart->rtc_regs[index];
-      }
-      return cart->rtc_latched_regs[index];
-    }
+static uint32_t mbc3_rom_bank(const Cartridge_t *cart, uint16_t addy) {
+  if (addy < 0x4000)
+    return 0;
+
+  uint32_t bank = cart->rom_bank & 0x7F;
+  if (cart->rom_banks) {
+    bank %= cart->rom_banks;
+    if (bank == 0 && cart->rom_banks > 1) bank = 1;
   }
-  return 0xFF;
-} 
+  return bank;
+}
 
-void write_mbc3(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+static void mbc3_write_reg(Cartridge_t *cart, uint16_t addy, uint8_t val) {
   if (addy < 0x2000) {
     cart->ram_enable = ((val & 0x0F) == 0x0A);
     return;
@@ -450,7 +491,7 @@ void write_mbc3(Cartridge_t *cart, uint16_t addy, uint8_t val) {
       if (bank == 0 && cart->rom_banks > 1) bank = 1;
       if (cart->rom_banks == 1) bank = 0;
     }
-    cart->rom_bank = (uint8_t)bank;
+    cart->rom_bank = bank;
     return;
   }
 
@@ -469,86 +510,150 @@ void write_mbc3(Cartridge_t *cart, uint16_t addy, uint8_t val) {
       cart->rtc_latched = false;
     }
     cart->rtc_latch_prev = latch_val;
-    return;
   }
+}
+
+static void mbc3_map(Cartridge_t *cart) {
+  map_rom(cart, 0, 0);
+  map_rom(cart, 1, mbc3_rom_bank(cart, 0x4000));
+  map_ram(cart, cart->ram_enable && cart->ram_bank <= 3, cart->ram_bank);
+}
 
-  if (addy >= 0xA000 && addy <= 0xBFFF && cart->ram_enable) {
-    if (cart->ram_bank <= 3 && cart->ram) {
-      uint8_t bank = cart->ram_bank;
-      uint16_t effective = cart->ram_banks ? cart->ram_banks : 1;
-      bank %= effective;
-      size_t off = ((size_t)bank * 0x2000u) + (addy - 0xA000);
-      if (off < cart->ram_size)
-	cart->ram[off] = val;
-    } else if (cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C) {
+static uint8_t mbc3_ram_read(Cartridge_t* cart, uint16_t addy) {
+  if (!cart->ram_enable)
+    return 0xFF;
+
+  if (cart->ram_bank <= 3) {
+    return ram_bank_read(cart, cart->ram_bank, addy);
+  } else if (cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C) {
+    uint8_t index = (uint8_t)(cart->ram_bank - 0x08);
+    if (!cart->rtc_latched) {
       mbc3_rtc_tick(cart);
+      return cart->rtc_regs[index];
+    }
+    return cart->rtc_latched_regs[index];
+  }
+  return 0xFF;
+} 
 
-      uint16_t days;
-      uint8_t hours, minutes, seconds;
-      mbc3_rtc_get_components(cart, &days, &hours, &minutes, &seconds);
-
-      switch (cart->ram_bank) {
-	case 0x08:
-	  seconds = (uint8_t)(val % 60u);
-	  break;
-	case 0x09:
-	  minutes = (uint8_t)(val % 60u);
-	  break;
-	case 0x0A:
-	  hours = (uint8_t)(val % 24u);
-	  break;
-	case 0x0B:
-	  days = (uint16_t)((days & 0x100u) | val);
-	  days %= MBC3_DAY_MAX;
-	  break;
-	case 0x0C: {
-	  uint16_t new_days = (uint16_t)(((uint16_t)(val & 0x01u) << 8) | (days & 0xFFu));
-	  days = new_days % MBC3_DAY_MAX;
-
-	  bool halt = (val & 0x40u) != 0;
-	  if (cart->rtc_halt != halt) {
-	    cart->rtc_last_update = time(NULL);
-	    if (cart->rtc_last_update == (time_t)-1) cart->rtc_last_update = 0;
-	  }
-	  cart->rtc_halt = halt;
-	  cart->rtc_day_carry = (val & 0x80u) != 0;
-	  break;
+static void mbc3_ram_write(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  if (!cart->ram_enable)
+    return;
+  if (cart->ram_bank <= 3) {
+    ram_bank_write(cart, cart->ram_bank, addy, val);
+  } else if (cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C) {
+    mbc3_rtc_tick(cart);
+
+    uint16_t days;
+    uint8_t hours, minutes, seconds;
+    mbc3_rtc_get_components(cart, &days, &hours, &minutes, &seconds);
+
+    switch (cart->ram_bank) {
+      case 0x08:
+	seconds = (uint8_t)(val % 60u);
+	break;
+      case 0x09:
+	minutes = (uint8_t)(val % 60u);
+	break;
+      case 0x0A:
+	hours = (uint8_t)(val % 24u);
+	break;
+      case 0x0B:
+	days = (uint16_t)((days & 0x100u) | val);
+	days %= MBC3_DAY_MAX;
+	break;
+      case 0x0C: {
+	uint16_t new_days = (uint16_t)(((uint16_t)(val & 0x01u) << 8) | (days & 0xFFu));
+	days = new_days % MBC3_DAY_MAX;
+
+	bool halt = (val & 0x40u) != 0;
+	if (cart->rtc_halt != halt) {
+	  cart->rtc_last_update = time(NULL);
+	  if (cart->rtc_last_update == (time_t)-1) cart->rtc_last_update = 0;
 	}
-	default:
-	  break;
+	cart->rtc_halt = halt;
+	cart->rtc_day_carry = (val & 0x80u) != 0;
+	break;
       }
-
-      mbc3_rtc_set_components(cart, days, hours, minutes, seconds);
+      default:
+	break;
     }
+
+    mbc3_rtc_set_components(cart, days, hours, minutes, seconds);
   }
 }
 
+/* -------------- MBC5 ------------------- */
+// 9-bit ROM bank (up to 8MB, bank 0 may be mapped at 4000), 16 RAM banks
+
+static void mbc5_write_reg(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  if (addy < 0x2000)
+    cart->ram_enable = ((val & 0x0F) == 0x0A);
+  else if (addy < 0x3000)
+    cart->rom_bank = (uint16_t)((cart->rom_bank & 0x100) | val);
+  else if (addy < 0x4000)
+    cart->rom_bank = (uint16_t)((cart->rom_bank & 0xFF) | ((val & 0x01) << 8));
+  else if (addy < 0x6000)
+    // on rumble carts bit 3 drives the motor, not the RAM bank
+    cart->ram_bank = val & (cart->rumble ? 0x07 : 0x0F);
+}
+
+static void mbc5_map(Cartridge_t *cart) {
+  map_rom(cart, 0, 0);
+  map_rom(cart, 1, cart->rom_bank % cart->rom_banks);
+  map_ram(cart, cart->ram_enable, cart->ram_bank);
+}
+
+static uint8_t mbc5_ram_read(Cartridge_t *cart, uint16_t addy) {
+  if (!cart->ram_enable)
+    return 0xFF;
+  return ram_bank_read(cart, cart->ram_bank, addy);
+}
+
+static void mbc5_ram_write(Cartridge_t *cart, uint16_t addy, uint8_t val) {
+  if (cart->ram_enable)
+    ram_bank_write(cart, cart->ram_bank, addy, val);
+}
+
+static const mapper_t mappers[] = {
+  [MBC_0] = { "MBC0", mbc0_write_reg, mbc0_map, mbc0_ram_read, mbc0_ram_write },
+  [MBC_1] = { "MBC1", mbc1_write_reg, mbc1_map, mbc1_ram_read, mbc1_ram_write },
+  [MBC_2] = { "MBC2", mbc2_write_reg, mbc2_map, mbc2_ram_read, mbc2_ram_write },
+  [MBC_3] = { "MBC3", mbc3_write_reg, mbc3_map, mbc3_ram_read, mbc3_ram_write },
+  [MBC_5] = { "MBC5", mbc5_write_reg, mbc5_map, mbc5_ram_read, mbc5_ram_write },
+};
 
+static const mapper_t *mapper_for(mbc_t type) {
+  return &mappers[type];
+}
 
 uint8_t cart_read(Cartridge_t *cart, uint16_t addy) {
-  switch (cart->type) {
-    case MBC_0:
-      return read_mbc0(cart, addy);
-    case MBC_1:
-      return read_mbc1(cart, addy);
-    case MBC_3:
-      return read_mbc3(cart, addy);
-    default:
-      return read_mbc0(cart, addy);
+  if (addy < 0x8000) {
+    int slot = addy >> 14;
+    const uint8_t *w = cart->rom_window[slot];
+    if (w)
+      return w[addy & 0x3FFF];
+    return read_mbc_bytes(cart, cart->rom_window_bank[slot], addy);
+  }
+  if (addy >= 0xA000 && addy <= 0xBFFF) {
+    if (cart->ram_window)
+      return cart->ram_window[addy - 0xA000];
+    return cart->mapper->ram_read(cart, addy);
   }
+  return 0xFF;
 }
 
 void cart_write(Cartridge_t *cart, uint16_t addy, uint8_t val) {
-  switch (cart->type) {
-    case MBC_0:
-      return write_mbc0(cart, addy, val);
-    case MBC_1:
-      return write_mbc1(cart, addy, val);
-    case MBC_3:
-      return write_mbc3(cart, addy, val);
-    default:
-      return write_mbc0(cart, addy, val);
-  } 
+  if (addy < 0x8000) {
+    cart->bank_gen++;
+    cart->mapper->write_reg(cart, addy, val);
+    cart->mapper->map(cart);
+    return;
+  }
+  if (addy >= 0xA000 && addy <= 0xBFFF) {
+    if (cart->ram_window)
+      cart->ram_window[addy - 0xA000] = val;
+    else
+      cart->mapper->ram_write(cart, addy, val);
+  }
 }
-
-
@@ -20,10 +20,72 @@ void init_bus(Bus_t* b) {
 
 int bus_load_rom(Bus_t *bus, const char *path) {
   bus->cartridge = load_cart(path);
+  bus_remap(bus);
   return bus->cartridge ? 0 : 1;
 }
 
-uint8_t read_byte_bus(Bus_t *bus, uint16_t addy) {
+static bool dma_locked(const Bus_t *b) {
+  return b->ppu && b->ppu->dma_active;
+}
+
+// ROM windows and the cart RAM window, after an MBC register write
+void bus_remap_cart(Bus_t *b) {
+  bool locked = dma_locked(b);
+  const uint8_t *lo = NULL, *hi = NULL;
+  uint8_t *ram = NULL;
+
+  if (b->cartridge && !locked) {
+    lo = cart_rom_window(b->cartridge, 0x0000, NULL);
+    hi = cart_rom_window(b->cartridge, 0x4000, NULL);
+    ram = cart_ram_window(b->cartridge);
+  }
+  for (int p = 0; p < 0x40; p++) {
+    b->read_map[p] = lo ? lo + p * 0x100 : NULL;
+    b->read_map[0x40 + p] = hi ? hi + p * 0x100 : NULL;
+  }
+  if (b->bootrom_enabled && b->bootrom && !locked)
+    b->read_map[0x00] = b->bootrom;
+
+  for (int p = 0; p < 0x20; p++) {
+    b->read_map[0xA0 + p] = ram ? ram + p * 0x100 : NULL;
+    b->write_map[0xA0 + p] = ram ? ram + p * 0x100 : NULL;
+  }
+}
+
+void bus_remap(Bus_t *b) {
+  bool locked = dma_locked(b);
+
+  // writes to ROM are MBC registers, VRAM writes sync the PPU first
+  for (int p = 0; p < 0xA0; p++)
+    b->write_map[p] = NULL;
+  for (int p = 0x80; p < 0xA0; p++)
+    b->read_map[p] = locked ? NULL : b->vram + (p - 0x80) * 0x100;
+
+  // WRAM and its echo up to FDFF; FE (OAM) and FF (I/O, HRAM) stay slow
+  for (int p = 0xC0; p < 0xFE; p++) {
+    int w = (p - 0xC0) & 0x1F;
+    uint8_t *mem = b->wram + w * 0x100;
+    b->read_map[p] = locked ? NULL : mem;
+    b->write_map[p] = (locked || b->code_watch[w]) ? NULL : mem;
+  }
+  b->read_map[0xFE] = b->read_map[0xFF] = NULL;
+  b->write_map[0xFE] = b->write_map[0xFF] = NULL;
+
+  bus_remap_cart(b);
+}
+
+// Called by the block cache when it caches code from the WRAM page at addy
+void bus_watch_code(Bus_t *b, uint16_t addy) {
+  int w = ((addy - 0xC000) >> 8) & 0x1F;
+  if (b->code_watch[w])
+    return;
+  b->code_watch[w] = true;
+  b->write_map[0xC0 + w] = NULL;
+  if (0xE0 + w < 0xFE)
+    b->write_map[0xE0 + w] = NULL;
+}
+
+static uint8_t read_slow(Bus_t *bus, uint16_t addy) {
   if (bus->ppu && bus->ppu->dma_active) {
     if (addy >= 0xFF80 && addy <= 0xFFFE) {
       return bus->hram[addy - 0xFF80];
@@ -58,6 +120,9 @@ uint8_t read_byte_bus(Bus_t *bus, uint16_t addy) {
   if (addy >= 0xFE00 && addy <= 0xFE9F) return bus->oam[addy - 0xFE00];
   if (addy >= 0xFEA0 && addy <= 0xFEFF) return 0xFF;
 
+  if (addy < 0xFF80)
+    sched_sync(bus);  // timer/PPU registers must be current
+
   switch(addy) {
     case 0xFF00: {
       // JOYP register: bits 7-6 always 1, bits 5-4 are selection, bits 3-0 are button states
@@ -113,19 +178,30 @@ uint8_t read_byte_bus(Bus_t *bus, uint16_t addy) {
   return 0xFF;
 }
 
-void write_byte_bus(Bus_t *bus, uint16_t addy, uint8_t val) {
+// store a register the PPU draws with, noting real changes
+static inline void ppu_reg(Ppu_t *d, uint8_t *reg, uint8_t val) {
+  if (*reg != val) {
+    *reg = val;
+    ppu_touch(d);
+  }
+}
+
+static void write_slow(Bus_t *bus, uint16_t addy, uint8_t val) {
   if (bus->ppu && bus->ppu->dma_active) {
     if (addy >= 0xFF80 && addy <= 0xFFFE) {
       bus->hram[addy - 0xFF80] = val;
+      bus->code_gen[CODE_GEN_HRAM]++;
     }
     return;
   }
 
   if (addy < 0x8000) {
     cart_write(bus->cartridge, addy, val);
+    bus_remap_cart(bus);
     return;
   };
   if (addy <= 0x9FFF) {
+    sched_sync(bus);  // lines not yet rendered must see the old tiles
     if (bus->ppu) {
       //fprintf(stderr, "[WRITE -> VRAM] ADDR=0x%04X VAL=0x%02X\n", addy, val);
       ppu_vram_write(bus->ppu, addy, val);
@@ -143,18 +219,30 @@ void write_byte_bus(Bus_t *bus, uint16_t addy, uint8_t val) {
   }
   if (addy >= 0xC000 && addy <= 0xDFFF) {
     bus->wram[addy - 0xC000] = val;
+    bus->code_gen[(addy - 0xC000) >> 8]++;
     return;
   }
   if (addy >= 0xE000 && addy <= 0xFDFF) {
     bus->wram[addy - 0xE000] = val;
+    bus->code_gen[(addy - 0xE000) >> 8]++;
     return;
   } 
   if (addy >= 0xFE00 && addy <= 0xFE9F) {
-   bus->oam[addy - 0xFE00] = val;
+   sched_sync(bus);
+   if (bus->ppu)
+     ppu_oam_write(bus->ppu, addy - 0xFE00, val);
+   else
+     bus->oam[addy - 0xFE00] = val;
    return;
   } 
   if (addy >= 0xFEA0 && addy <= 0xFEFF) return;
 
+  if (addy < 0xFF80) {
+    // catch up first, then let the next access pick new deadlines
+    sched_sync(bus);
+    sched_invalidate(&bus->sched);
+  }
+
   switch(addy) {
     case 0xFF00: 
       bus->JOYP = (bus->JOYP & 0xCF) | (val & 0x30);
@@ -181,6 +269,10 @@ void write_byte_bus(Bus_t *bus, uint16_t addy, uint8_t val) {
     case 0xFF40: {
       uint8_t old_lcdc = bus->ppu->LCDC;
       bus->ppu->LCDC = val;
+      if (old_lcdc != val)
+        ppu_touch(bus->ppu);
+      if ((old_lcdc ^ val) & 0x04)
+        bus->ppu->obj_dirty = true;  // sprite height
       
       bool was_enabled = (old_lcdc & 0x80) != 0;
       bool is_enabled = (val & 0x80) != 0;
@@ -188,58 +280,97 @@ void write_byte_bus(Bus_t *bus, uint16_t addy, uint8_t val) {
       if (!was_enabled && is_enabled) {
         bus->ppu->LY = 0;
         bus->ppu->cycles_in_line = 0;
+        bus->ppu->line_x = 0;
         bus->ppu->STAT = (bus->ppu->STAT & ~0x03) | 2; // Start in mode 2 (OAM scan)
       } else if (was_enabled && !is_enabled) {
         bus->ppu->LY = 0;
         bus->ppu->cycles_in_line = 0;
+        bus->ppu->line_x = 0;
         bus->ppu->STAT = (bus->ppu->STAT & ~0x03) | 0; // Mode 0
       }
       return;
     }
     case 0xFF41: bus->ppu->STAT = (val & 0x78) | (bus->ppu->STAT & 0x07); return;
-    case 0xFF42: bus->ppu->SCY = val; return;
-    case 0xFF43: bus->ppu->SCX = val; return;
+    case 0xFF42: ppu_reg(bus->ppu, &bus->ppu->SCY, val); return;
+    case 0xFF43: ppu_reg(bus->ppu, &bus->ppu->SCX, val); return;
     case 0xFF44: return; // LY is read only
     case 0xFF45: bus->ppu->LYC = val; return;
     case 0xFF46:
       bus->ppu->DMA = val;
       bus->ppu->dma_pending = true;
       return;
-    case 0xFF47: bus->ppu->BGP = val; return;
-    case 0xFF48: bus->ppu->OBP0 = val; return;
-    case 0xFF49: bus->ppu->OBP1 = val; return;
+    case 0xFF47:
+      ppu_reg(bus->ppu, &bus->ppu->BGP, val);
+      ppu_update_palettes(bus->ppu);
+      return;
+    case 0xFF48:
+      ppu_reg(bus->ppu, &bus->ppu->OBP0, val);
+      ppu_update_palettes(bus->ppu);
+      return;
+    case 0xFF49:
+      ppu_reg(bus->ppu, &bus->ppu->OBP1, val);
+      ppu_update_palettes(bus->ppu);
+      return;
     case 0xFF50:
       if (bus->bootrom_enabled) {
         bus->bootrom_enabled = false;
-        fprintf(stderr,
-                "[BOOT] bootrom disabled via write to 0xFF50, PC=%04X\n",
-                bus->ppu ? 0 : 0);
+        bus_remap_cart(bus);
+        LOG(LOG_BOOT, LOG_INFO, "[BOOT] bootrom disabled via write to 0xFF50\n");
       }
       return;
-    case 0xFF4A: bus->ppu->WY = val; return;
-    case 0xFF4B: bus->ppu->WX = val; return;
+    case 0xFF4A: ppu_reg(bus->ppu, &bus->ppu->WY, val); return;
+    case 0xFF4B: ppu_reg(bus->ppu, &bus->ppu->WX, val); return;
     default: break;
   }
 
   if (addy >= 0xFF80 && addy <= 0xFFFE) {
     bus->hram[addy - 0xFF80] = val; 
+    bus->code_gen[CODE_GEN_HRAM]++;
     return;
   }
   if (addy == 0xFFFF) {
     uint8_t old_IE = bus->IE;
     bus->IE = (val & 0x1F);
-    static int ie_write_count = 0;
-    if (ie_write_count < 20 || (old_IE & 0x10) != (bus->IE & 0x10)) {
-      const char *enabled = "";
-      if (bus->IE & 0x01) enabled = " VBLANK";
-      if (bus->IE & 0x02) enabled = " STAT";
-      if (bus->IE & 0x04) enabled = " TIMER";
-      if (bus->IE & 0x08) enabled = " SERIAL";
-      if (bus->IE & 0x10) enabled = " JOYPAD";
-      write_log("[IE WRITE] #%d | old=%02X new=%02X%s | IF=%02X\n",
-                ie_write_count, old_IE, bus->IE, enabled, bus->IF);
+    if (LOG_ON(LOG_INT, LOG_DEBUG)) {
+      static int ie_write_count = 0;
+      if (ie_write_count < 20 || (old_IE & 0x10) != (bus->IE & 0x10)) {
+        const char *enabled = "";
+        if (bus->IE & 0x01) enabled = " VBLANK";
+        if (bus->IE & 0x02) enabled = " STAT";
+        if (bus->IE & 0x04) enabled = " TIMER";
+        if (bus->IE & 0x08) enabled = " SERIAL";
+        if (bus->IE & 0x10) enabled = " JOYPAD";
+        write_log("[IE WRITE] #%d | old=%02X new=%02X%s | IF=%02X\n",
+                  ie_write_count, old_IE, bus->IE, enabled, bus->IF);
+      }
+      ie_write_count++; 
     }
-    ie_write_count++; 
     return;
   }
 }
+
+static void log_access(Bus_t *bus, uint16_t addy, uint8_t val, bool write) {
+  bus_log_t *l = bus->log;
+  if (l->n == BUS_LOG_MAX) {
+    l->overflow = true;
+    return;
+  }
+  l->at[l->n].time = bus->sched.time;
+  l->at[l->n].addy = addy;
+  l->at[l->n].val = val;
+  l->at[l->n].write = write;
+  l->n++;
+}
+
+uint8_t bus_read_slow(Bus_t *bus, uint16_t addy) {
+  uint8_t val = read_slow(bus, addy);
+  if (bus->log)
+    log_access(bus, addy, val, false);
+  return val;
+}
+
+void bus_write_slow(Bus_t *bus, uint16_t addy, uint8_t val) {
+  if (bus->log)
+    log_access(bus, addy, val, true);
+  write_slow(bus, addy, val);
+}
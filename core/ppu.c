@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "ppu.h"
+#include "ppu_thread.h"
 #include "memory.h"
 #include "mbc.h"
 #include "logging.h"
@@ -10,8 +11,18 @@
 uint32_t bw_palette[4] = {
     0xC4CFA1, 0x8B956D, 0x4D533C, 0x1F1F1F
 };
+static const uint32_t gray_palette[4] = {
+    0xFFFFFF, 0xAAAAAA, 0x555555, 0x000000
+};
+static const uint32_t dmg_palette[4] = {
+    0x9BBC0F, 0x8BAC0F, 0x306230, 0x0F380F
+};
+
+const uint32_t *const ppu_palettes[PPU_PALETTE_COUNT] = {
+    bw_palette, gray_palette, dmg_palette
+};
 
-void start_display(Ppu_t *display, Bus_t *bus, int scale) {
+void start_display(Ppu_t *display, Bus_t *bus) {
   memset(display, 0, sizeof(Ppu_t));
   display->bus = bus;
 
@@ -26,139 +37,191 @@ void start_display(Ppu_t *display, Bus_t *bus, int scale) {
   display->WY = 0;
   display->WX = 0;
 
-  for (int i = 0; i <= 3; i++) {
-    display->pallete[i] = bw_palette[i];
-  }
+  ppu_set_palette(display, bw_palette);
+  memset(display->tile_dirty, 0xFF, sizeof(display->tile_dirty));
+  display->obj_dirty = true;
+  display->compose = compose_best();
+  display->render = true;
+  display->pix_gen = 1;  // line_gen 0 = never drawn
+  display->frame_serial = 1;  // row_serial 0 = never drawn
+
+  display->fb_own = (uint32_t*)calloc(GB_WIDTH*GB_HEIGHT, 4);
+  ppu_set_target(display, NULL, 0);
+}
 
-  display->framebuffer = (uint32_t*)calloc(GB_WIDTH*GB_HEIGHT, 4);
-  display->temp_framebuffer = (uint32_t*)calloc(GB_WIDTH*GB_HEIGHT, 4);
-  display->background_buffer = (uint32_t*)calloc(256*256, 4);
-  if (scale <= 1) {
-    display->scaled_framebuffer = display->framebuffer;
+void ppu_set_target(Ppu_t *d, void *pixels, int pitch) {
+  if (pixels) {
+    d->framebuffer = pixels;
+    d->fb_pitch = pitch / (int)sizeof(uint32_t);
   } else {
-    display->scaled_framebuffer = (uint32_t*)calloc(GB_WIDTH*GB_HEIGHT, 4*scale*scale);
+    d->framebuffer = d->fb_own;
+    d->fb_pitch = GB_WIDTH;
   }
+  memset(d->row_valid, 0, sizeof(d->row_valid));
 }
 
-static void render_bg_scanline(Ppu_t *d) {
-  if (!(d->LCDC & 0x01))
-    return; // BG display enable
-
-  uint16_t tile_data_addr = (d->LCDC & 0x10) ? 0x8000 : 0x8800;
-  uint16_t bg_map_addr = (d->LCDC & 0x08) ? 0x9C00 : 0x9800;
+void ppu_swap_target(Ppu_t *d, void *pixels, int pitch, unsigned long held) {
+  uint32_t *to = pixels;
+  int to_pitch = pitch / (int)sizeof(uint32_t);
+  for (int y = 0; y < GB_HEIGHT; y++) {
+    if (d->row_valid[y] && d->row_serial[y] > held)
+      memcpy(to + y * to_pitch, d->framebuffer + y * d->fb_pitch,
+             GB_WIDTH * sizeof(uint32_t));
+  }
+  d->framebuffer = to;
+  d->fb_pitch = to_pitch;
+}
 
-  int y = (d->SCY + d->LY) & 0xFF;
+static void decode_tile(Ppu_t *d, int t) {
+  const uint8_t *src = d->bus->vram + t * 16;
+  for (int row = 0; row < 8; row++) {
+    uint8_t low = src[row * 2];
+    uint8_t high = src[row * 2 + 1];
+    for (int px = 0; px < 8; px++) {
+      int bit = 7 - px;
+      uint8_t color_id = ((high >> bit) & 1) << 1 | ((low >> bit) & 1);
+      d->tiles[t][row][px] = color_id;
+      d->tiles_flip[t][row][7 - px] = color_id;
+    }
+  }
+}
 
-  for (int x = 0; x < GB_WIDTH; x++) {
-    int scx = (d->SCX + x) & 0xFF;
-    uint16_t map_index = bg_map_addr + ((y / 8) * 32) + (scx / 8);
-    uint8_t tile_num = read_byte_bus(d->bus, map_index);
+static void refresh_tiles(Ppu_t *d) {
+  for (int w = 0; w < TILE_COUNT / 32; w++) {
+    uint32_t bits = d->tile_dirty[w];
+    if (!bits)
+      continue;
+    d->tile_dirty[w] = 0;
+    for (int i = 0; i < 32; i++) {
+      if (bits & (1u << i))
+        decode_tile(d, w * 32 + i);
+    }
+  }
+}
 
-    uint16_t tile_addr;
-    if (d->LCDC & 0x10)
-      tile_addr = tile_data_addr + (tile_num * 16);
-    else
-      tile_addr = tile_data_addr + ((int8_t)tile_num + 128) * 16;
+// tile number from a BG/window map -> tile cache index
+static inline int bg_tile(const Ppu_t *d, uint8_t tile_num) {
+  if (d->LCDC & 0x10)
+    return tile_num;
+  return 256 + (int8_t)tile_num;  // 8800 addressing, tile 0 at 9000
+}
 
-    int line = y % 8;
-    uint8_t low = read_byte_bus(d->bus, tile_addr + (line * 2));
-    uint8_t high = read_byte_bus(d->bus, tile_addr + (line * 2) + 1);
+// BG colour indices for pixels [x0, x1) of the line
+static void render_bg_span(Ppu_t *d, uint8_t *idx, int x0, int x1) {
+  uint16_t bg_map_addr = (d->LCDC & 0x08) ? 0x9C00 : 0x9800;
 
-    int bit = 7 - (scx % 8);
-    int color_id = ((high >> bit) & 1) << 1 | ((low >> bit) & 1);
+  int y = (d->SCY + d->LY) & 0xFF;
+  const uint8_t *map = d->bus->vram + (bg_map_addr - 0x8000) + (y / 8) * 32;
+  int line = y % 8;
 
-    uint32_t color = d->pallete[(d->BGP >> (color_id * 2)) & 3];
-    d->framebuffer[d->LY * GB_WIDTH + x] = 0xFF000000 | color;
+  // a tile row at a time: the first one is cut by SCX % 8
+  for (int x = x0; x < x1;) {
+    int scx = (d->SCX + x) & 0xFF;
+    const uint8_t *row = d->tiles[bg_tile(d, map[scx / 8])][line];
+    int n = 8 - scx % 8;
+    if (n > x1 - x)
+      n = x1 - x;
+    memcpy(idx + x, row + scx % 8, n);
+    x += n;
   }
 }
 
-static void render_window_scanline(Ppu_t *d) {
+// Window colour indices over idx in [x0, x1); returns the first window
+// pixel of the span, or x1 when the window isn't in it
+static int render_window_span(Ppu_t *d, uint8_t *idx, int x0, int x1) {
   if (!(d->LCDC & 0x20))
-    return;
+    return x1;
 
   if (d->WY > d->LY)
-    return;
+    return x1;
 
-  uint16_t tile_data_addr = (d->LCDC & 0x10) ? 0x8000 : 0x8800; uint16_t win_map_addr = (d->LCDC & 0x40) ? 0x9C00 : 0x9800;
+  // window X position (offset by 7)
+  int start = d->WX - 7;
+  if (start < x0)
+    start = x0;
+  if (start >= x1)
+    return x1;
+
+  uint16_t win_map_addr = (d->LCDC & 0x40) ? 0x9C00 : 0x9800;
   // window line counter (relative to WY)
   int win_y = d->LY - d->WY;
+  const uint8_t *map = d->bus->vram + (win_map_addr - 0x8000) + (win_y / 8) * 32;
+  int line = win_y % 8;
 
-  for (int x = 0; x < GB_WIDTH; x++) {
-    // window X position (offset by 7)
+  for (int x = start; x < x1;) {
     int win_x = x - (d->WX - 7);
+    const uint8_t *row = d->tiles[bg_tile(d, map[win_x / 8])][line];
+    int n = 8 - win_x % 8;
+    if (n > x1 - x)
+      n = x1 - x;
+    memcpy(idx + x, row + win_x % 8, n);
+    x += n;
+  }
+  return start;
+}
 
-    if (win_x < 0)
-      continue;
-
-    // get tile
-    uint16_t map_index = win_map_addr + ((win_y / 8) * 32) + (win_x / 8);
-    uint8_t tile_num = read_byte_bus(d->bus, map_index);
-
-    uint16_t tile_addr;
-    if (d->LCDC & 0x10)
-      tile_addr = tile_data_addr + (tile_num * 16);
-    else
-      tile_addr = tile_data_addr + ((int8_t)tile_num + 128) * 16;
-
-    int line = win_y % 8;
-    uint8_t low = read_byte_bus(d->bus, tile_addr + (line * 2));
-    uint8_t high = read_byte_bus(d->bus, tile_addr + (line * 2) + 1);
+// Per-line sprite lists for the whole frame from OAM: the first 10
+// sprites (in OAM order) covering a line, then sorted by X
+static void build_line_objs(Ppu_t *d) {
+  int sprite_height = (d->LCDC & 0x04) ? 16 : 8;
 
-    int bit = 7 - (win_x % 8);
-    int color_id = ((high >> bit) & 1) << 1 | ((low >> bit) & 1);
+  memset(d->line_obj_count, 0, sizeof(d->line_obj_count));
+  for (int i = 0; i < 40; i++) {
+    int top = d->bus->oam[i * 4] - 16;
+    for (int ly = top < 0 ? 0 : top;
+         ly < top + sprite_height && ly < GB_HEIGHT; ly++) {
+      uint8_t *n = &d->line_obj_count[ly];
+      if (*n < LINE_OBJS)
+        d->line_objs[ly][(*n)++] = (uint8_t)i;
+    }
+  }
 
-    uint32_t color = d->pallete[(d->BGP >> (color_id * 2)) & 3];
-    d->framebuffer[d->LY * GB_WIDTH + x] = 0xFF000000 | color;
+  // insertion sort by X, stable so equal X keeps OAM order
+  for (int ly = 0; ly < GB_HEIGHT; ly++) {
+    uint8_t *objs = d->line_objs[ly];
+    for (int k = 1; k < d->line_obj_count[ly]; k++) {
+      uint8_t obj = objs[k];
+      uint8_t x = d->bus->oam[obj * 4 + 1];
+      int j = k - 1;
+      for (; j >= 0 && d->bus->oam[objs[j] * 4 + 1] > x; j--)
+        objs[j + 1] = objs[j];
+      objs[j + 1] = obj;
+    }
   }
+  d->obj_dirty = false;
 }
 
-static void render_sprites_scanline(Ppu_t *d) {
+// Sprites onto pixels [x0, x1) of the framebuffer line. The first opaque
+// sprite pixel at an x wins it, even when BG priority then hides it.
+static void render_sprites_span(Ppu_t *d, uint32_t *out, int x0, int x1) {
   if (!(d->LCDC & 0x02))
     return; 
 
   if (d->dma_active)
     return;
 
-  int sprite_height = (d->LCDC & 0x04) ? 16 : 8;
-  int sprites_drawn = 0;
-  
-
-  for (int i = 39; i >= 0; i--) {
-    int oam_addr = i * 4;
-    uint8_t oam_y = d->bus->oam[oam_addr];
-    uint8_t oam_x = d->bus->oam[oam_addr + 1];
-    uint8_t tile_num = d->bus->oam[oam_addr + 2];
-    uint8_t attributes = d->bus->oam[oam_addr + 3];
+  if (d->obj_dirty)
+    build_line_objs(d);
 
-    //  Y=0 off screen, Y=16 top 
-    // Y >= 160 off screen
-    if (oam_y == 0 || oam_y >= 160) continue;
-    
-    int sprite_y = oam_y - 16;
-    int sprite_x = oam_x - 8;
+  int sprite_height = (d->LCDC & 0x04) ? 16 : 8;
+  uint8_t taken[GB_WIDTH];
+  memset(taken, 0, sizeof(taken));
 
-    int sprite_top = sprite_y;
-    int sprite_bottom = sprite_y + sprite_height;
-    
-    if (d->LY < sprite_top || d->LY >= sprite_bottom)
-      continue;
+  for (int k = 0; k < d->line_obj_count[d->LY]; k++) {
+    const uint8_t *oam = &d->bus->oam[d->line_objs[d->LY][k] * 4];
+    uint8_t tile_num = oam[2];
+    uint8_t attributes = oam[3];
 
-    if (sprites_drawn >= 10)
-      continue;
-    
-    sprites_drawn++;
+    int sprite_y = oam[0] - 16;
+    int sprite_x = oam[1] - 8;
 
-    int palette = (attributes & 0x10) ? d->OBP1 : d->OBP0;
+    const uint32_t *lut = d->obj_lut[(attributes & 0x10) ? 1 : 0];
     int flip_x = attributes & 0x20;
     int flip_y = attributes & 0x40;
     int priority = attributes & 0x80; 
 
     int line = d->LY - sprite_y;
     
-    if (line < 0 || line >= sprite_height) {
-      continue;
-    }
-    
     if (flip_y)
       line = sprite_height - 1 - line;
 
@@ -170,52 +233,119 @@ static void render_sprites_scanline(Ppu_t *d) {
       }
     }
 
-    uint16_t tile_addr = 0x8000 + (tile_num * 16) + (line * 2);
-    
-    uint8_t low = read_byte_bus(d->bus, tile_addr);
-    uint8_t high = read_byte_bus(d->bus, tile_addr + 1);
+    const uint8_t *row = flip_x ? d->tiles_flip[tile_num][line]
+                                : d->tiles[tile_num][line];
 
     for (int px = 0; px < 8; px++) {
       int screen_x = sprite_x + px;
 
-      if (screen_x < 0 || screen_x >= GB_WIDTH)
+      if (screen_x < x0 || screen_x >= x1)
         continue;
 
-      int bit = flip_x ? px : (7 - px);
-      int color_id = ((high >> bit) & 1) << 1 | ((low >> bit) & 1);
+      int color_id = row[px];
 
-      if (color_id == 0)
+      if (color_id == 0 || taken[screen_x])
         continue;
+      taken[screen_x] = 1;
 
-      int fb_index = d->LY * GB_WIDTH + screen_x;
-      if (priority) {
-        uint32_t bg_pixel = d->framebuffer[fb_index];
-        uint32_t bg_color = bg_pixel & 0x00FFFFFF;
-        uint32_t bg_color0 = d->pallete[0] & 0x00FFFFFF;
-        if (bg_color != bg_color0) {
-          continue; 
-        }
-      }
-      int shade = (palette >> (color_id * 2)) & 0x03;
-      uint32_t color = d->pallete[shade];
-      d->framebuffer[fb_index] = 0xFF000000 | color;
+      // behind BG/window colours 1-3, whatever BGP maps them to
+      if (priority && d->bg_index[screen_x] != 0)
+        continue;
+      out[screen_x] = lut[color_id];
     }
   }
 }
 
+void ppu_update_palettes(Ppu_t *d) {
+  for (int c = 0; c < 4; c++) {
+    d->bg_lut[c] = 0xFF000000 | d->pallete[(d->BGP >> (c * 2)) & 3];
+    d->obj_lut[0][c] = 0xFF000000 | d->pallete[(d->OBP0 >> (c * 2)) & 3];
+    d->obj_lut[1][c] = 0xFF000000 | d->pallete[(d->OBP1 >> (c * 2)) & 3];
+  }
+  d->blank = 0xFF000000 | d->pallete[0];
+}
+
+void ppu_set_palette(Ppu_t *d, const uint32_t colors[4]) {
+  memcpy(d->pallete, colors, sizeof(d->pallete));
+  ppu_update_palettes(d);
+  ppu_touch(d);
+  for (int c = 0; d->thread && c < 4; c++)
+    ppu_thread_write(d->thread, PPU_CMD_PALETTE, (uint16_t)c, colors[c]);
+}
+
+// Render pixels [x0, x1) of line LY into the framebuffer: BG/window colour
+// indices into bg_index, through bg_lut to ARGB (blank where BG and window
+// are off), then sprites. A line drawn in several spans picks up register
+// writes made between them.
+void ppu_render_span(Ppu_t *d, int x0, int x1) {
+  uint8_t *idx = d->bg_index;
+  uint32_t *out = d->framebuffer + d->LY * d->fb_pitch;
+  int from = x1;  // first pixel with BG or window on
+
+  refresh_tiles(d);
+  if (d->LCDC & 0x01) {
+    render_bg_span(d, idx, x0, x1);
+    from = x0;
+  }
+  int win = render_window_span(d, idx, x0, x1);
+  if (win < from)
+    from = win;
+
+  memset(idx + x0, 0, from - x0);
+  for (int x = x0; x < from; x++)
+    out[x] = d->blank;
+  d->compose->argb(out + from, idx + from, d->bg_lut, x1 - from);
+  render_sprites_span(d, out, x0, x1);
+}
+
+void ppu_render_line(Ppu_t *d) {
+  ppu_render_span(d, 0, GB_WIDTH);
+  d->row_valid[d->LY] = false;
+}
+
+// Pixels of a visible line that are out by cycles_in_line: none during OAM
+// scan, then spread evenly over the 172 cycles of mode 3. Skipped when the
+// row already holds them (nothing drawn has changed since); redrawing a row
+// the target lost doesn't count as a change. Spans drawn while OAM DMA
+// hides the sprites are never reused.
+static void catch_up_line(Ppu_t *d) {
+  int x = (d->cycles_in_line - 80) * GB_WIDTH / 172;
+  if (x > GB_WIDTH)
+    x = GB_WIDTH;
+  if (x <= d->line_x)
+    return;
+  if (d->line_x == 0)
+    d->line_start_gen = d->pix_gen;
+  if (d->dma_active)
+    d->line_start_gen = 0;
+  bool same = d->line_gen[d->LY] == d->pix_gen && !d->dma_active;
+  if (d->thread && (!same || !d->row_valid[d->LY]))
+    ppu_thread_span(d->thread, d, d->line_x, x);
+  else if (!same || !d->row_valid[d->LY]) {
+    ppu_render_span(d, d->line_x, x);
+    d->row_serial[d->LY] = d->frame_serial;
+  }
+  if (!same)
+    d->frame_changed = true;
+  d->line_x = (uint8_t)x;
+  if (x == GB_WIDTH) {
+    d->line_gen[d->LY] = d->pix_gen == d->line_start_gen ? d->pix_gen : 0;
+    d->row_valid[d->LY] = true;
+  }
+}
+
 void display_cycle(Ppu_t *d, Bus_t *b, int cycles) {
   if (!(d->LCDC & LCDC_ENABLE))
     return;
   // fprintf(stderr, "[LCDC=%02X SCX=%02X SCY=%02X]\n", d->LCDC, d->SCX,
   // d->SCY);
 
-  d->cycles_in_line += cycles;
-
   if (d->dma_pending) {
     d->dma_pending = false;
     d->dma_active = true;
     d->dma_counter = 0;
     d->dma_source = ((uint16_t)d->DMA) << 8;
+    bus_remap(b);  // CPU sees only HRAM until it ends
   }
   static int dma_cycle_counter = 0;
   
@@ -245,7 +375,7 @@ void display_cycle(Ppu_t *d, Bus_t *b, int cycles) {
         byte = 0xFF;
       }
       
-      b->oam[d->dma_counter] = byte;
+      ppu_oam_write(d, d->dma_counter, byte);
       d->dma_counter++;
     }
     
@@ -253,71 +383,122 @@ void display_cycle(Ppu_t *d, Bus_t *b, int cycles) {
       d->dma_active = false;
       d->dma_counter = 0;
       dma_cycle_counter = 0;
+      d->obj_dirty = true;
+      bus_remap(b);
     }
   } else {
     dma_cycle_counter = 0;
   }
 
-  if (d->cycles_in_line >= 456) {
-    d->cycles_in_line -= 456;
-    d->LY++;
-    if (d->LY == 0) {
-    }
-    if (d->LY < 144) {
-      uint32_t bg_color = d->pallete[0]; 
-      for (int x = 0; x < GB_WIDTH; x++) {
-        d->framebuffer[d->LY * GB_WIDTH + x] = 0xFF000000 | bg_color;
+  // Catch up in steps that stop at each mode edge (80, 252, 456), so a
+  // call covering several lines raises the same interrupts as one per edge.
+  // Visible lines are drawn up to the current cycle; a later register write
+  // syncs first, and the rest of the line is drawn with the new value.
+  while (cycles > 0) {
+    int edge = 456;
+    if (d->LY < 144)
+      edge = d->cycles_in_line < 80 ? 80 : d->cycles_in_line < 252 ? 252 : 456;
+    int step = edge - d->cycles_in_line;
+    if (step > cycles)
+      step = cycles;
+    d->cycles_in_line += step;
+    cycles -= step;
+
+    if (d->LY < 144 && d->render)
+      catch_up_line(d);
+
+    if (d->cycles_in_line >= 456) {
+      d->cycles_in_line -= 456;
+      d->LY++;
+      if (d->LY == 0) {
       }
-      render_bg_scanline(d);
-      render_window_scanline(d);
-      render_sprites_scanline(d);
-    }
+      d->line_x = 0;
 
-    if (d->LY == 144) {
-      d->STAT = (d->STAT & ~0x03) | 1; // mode 1 = VBlank
-      b->IF |= 0x01;                   // request VBlank interrupt
-
-      if (d->STAT & 0x10) // STAT bit 4 = VBlank interrupt enable
-        b->IF |= 0x02;
-      d->frame_ready = true;
-    } else if (d->LY > 153) {
-      d->LY = 0;
-      d->STAT = (d->STAT & ~0x03) | 2; 
-      if (d->STAT & 0x20)              
-        b->IF |= 0x02;
-    } else if (d->LY < 144) {
-      d->STAT = (d->STAT & ~0x03) | 2;
-      if (d->STAT & 0x20)
-        b->IF |= 0x02;
-    }
+      if (d->LY == 144) {
+        d->STAT = (d->STAT & ~0x03) | 1; // mode 1 = VBlank
+        b->IF |= 0x01;                   // request VBlank interrupt
 
-    if (d->LY == d->LYC) {
-      d->STAT |= 0x04;
-      if (d->STAT & 0x40) 
-        b->IF |= 0x02;
-    } else {
-      d->STAT &= ~0x04;
-    }
-  }
+        if (d->STAT & 0x10) // STAT bit 4 = VBlank interrupt enable
+          b->IF |= 0x02;
+        d->frame_ready = true;
+        d->frame_unchanged = !d->frame_changed;
+        d->frame_changed = false;
+        d->frame_serial++;
+        if (d->thread)
+          ppu_thread_frame(d->thread, !d->frame_unchanged);
+      } else if (d->LY > 153) {
+        d->LY = 0;
+        d->STAT = (d->STAT & ~0x03) | 2; 
+        if (d->STAT & 0x20)              
+          b->IF |= 0x02;
+      } else if (d->LY < 144) {
+        d->STAT = (d->STAT & ~0x03) | 2;
+        if (d->STAT & 0x20)
+          b->IF |= 0x02;
+      }
 
-  if (d->LY < 144) {
-    if (d->cycles_in_line < 80) {
-      // mode 2: OAM scan
-      d->STAT = (d->STAT & ~0x03) | 2;
-    } else if (d->cycles_in_line < 252) {
-      // mode 3: drawing (OAM+VRAM)
-      d->STAT = (d->STAT & ~0x03) | 3;
-    } else {
-      // mode 0: HBlank
-      if ((d->STAT & 0x03) != 0) {
-        if (d->STAT & 0x08) 
+      if (d->LY == d->LYC) {
+        d->STAT |= 0x04;
+        if (d->STAT & 0x40) 
           b->IF |= 0x02;
+      } else {
+        d->STAT &= ~0x04;
       }
-      d->STAT = (d->STAT & ~0x03) | 0;
     }
+
+    if (d->LY < 144) {
+      if (d->cycles_in_line < 80) {
+        // mode 2: OAM scan
+        d->STAT = (d->STAT & ~0x03) | 2;
+      } else if (d->cycles_in_line < 252) {
+        // mode 3: drawing (OAM+VRAM)
+        d->STAT = (d->STAT & ~0x03) | 3;
+      } else {
+        // mode 0: HBlank
+        if ((d->STAT & 0x03) != 0) {
+          if (d->STAT & 0x08) 
+            b->IF |= 0x02;
+        }
+        d->STAT = (d->STAT & ~0x03) | 0;
+      }
+    }
+  }
+}
+
+uint32_t ppu_next_event(const Ppu_t *d) {
+  if (!(d->LCDC & LCDC_ENABLE))
+    return PPU_NO_EVENT;
+  if (d->dma_pending || d->dma_active)
+    return 0;  // DMA copies a byte every 4 cycles
+  // only edges that can raise IF: enabled STAT sources and VBlank, which
+  // is at most a frame away
+  if (d->LY < 144 && d->cycles_in_line < 252 && (d->STAT & 0x08))
+    return 252 - d->cycles_in_line;
+  uint32_t t = 456 - d->cycles_in_line;
+  for (int ly = d->LY + 1;; ly++) {
+    if (ly > 153)
+      ly = 0;
+    if (ly == 144 || (ly < 144 && (d->STAT & 0x20)) ||
+        (ly == d->LYC && (d->STAT & 0x40)))
+      return t;
+    if (ly < 144 && (d->STAT & 0x08))
+      return t + 252;
+    t += 456;
   }
 }
 
+uint32_t ppu_next_change(const Ppu_t *d, uint16_t addr) {
+  if (!(d->LCDC & LCDC_ENABLE))
+    return PPU_NO_EVENT;
+  if (d->dma_pending || d->dma_active)
+    return 0;
+  // STAT's mode bits move at every mode edge, LY (and the LYC flag) at
+  // every line, none of which has to be an event
+  if (addr == STAT && d->LY < 144 && d->cycles_in_line < 252)
+    return (d->cycles_in_line < 80 ? 80 : 252) - d->cycles_in_line;
+  return 456 - d->cycles_in_line;
+}
+
 bool ppu_is_mode2(Ppu_t *ppu) {
   if (!ppu) return false;
   // Mode 2 = OAM scan (STAT bits 0-1 == 2)
@@ -358,6 +539,43 @@ void ppu_vram_write(Ppu_t *ppu, uint16_t addr, uint8_t byte) {
   }
 
   //write_log("[PPU VRAM WRITE] off=0x%04X indx=%zu addr=0x%04X val=0x%02X\n",offset, index, addr, byte);
+  if (ppu->bus->vram[index] == byte)
+    return;
   ppu->bus->vram[index] = byte;
+  ppu_touch(ppu);
+  if (ppu->thread)
+    ppu_thread_write(ppu->thread, PPU_CMD_VRAM, (uint16_t)index, byte);
+  if (index < TILE_COUNT * 16u) {
+    unsigned t = (unsigned)(index >> 4);
+    ppu->tile_dirty[t / 32] |= 1u << (t % 32);
+  }
 }
 
+void ppu_oam_write(Ppu_t *ppu, uint16_t index, uint8_t byte) {
+  if (ppu->bus->oam[index] == byte)
+    return;
+  ppu->bus->oam[index] = byte;
+  ppu->obj_dirty = true;
+  ppu_touch(ppu);
+  if (ppu->thread)
+    ppu_thread_write(ppu->thread, PPU_CMD_OAM, index, byte);
+}
+
+bool ppu_enable_thread(Ppu_t *d, bool enable) {
+  if (enable && !d->thread)
+    d->thread = ppu_thread_new(d);
+  else if (!enable && d->thread) {
+    ppu_thread_free(d->thread, d);
+    d->thread = NULL;
+  }
+  return (d->thread != NULL) == enable;
+}
+
+const uint32_t *ppu_frame(Ppu_t *d, int *pitch) {
+  if (d->thread) {
+    *pitch = GB_WIDTH;
+    return ppu_thread_wait(d->thread);
+  }
+  *pitch = d->fb_pitch;
+  return d->framebuffer;
+}
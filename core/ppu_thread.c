@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200112L
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "ppu_thread.h"
+#include "memory.h"
+
+#define SPIN_POLLS 4096  // empty-ring polls before the worker sleeps
+#define KICK_LINES 16    // finished lines queued before a sleeping worker is woken
+
+struct ppu_thread {
+  // worker side: its own PPU (registers, tile cache, sprite lists) drawing
+  // into buf[back], over its own VRAM/OAM in bus
+  Ppu_t r;
+  Bus_t *bus;
+  uint32_t *buf[2];
+  int back;
+  bool row_drawn[GB_HEIGHT];  // rows drawn since the last swap
+
+  // ring: head is only written by the emulation thread, tail by the worker
+  ppu_cmd_t ring[PPU_RING_SIZE];
+  unsigned head, tail;
+  unsigned tail_seen;          // producer's last look at tail
+  bool sleeping, quit;
+  int front;                   // atomic: buffer with the last finished frame
+  unsigned long frames_queued; // emulation thread only
+  unsigned long frames_done;   // under lock
+
+  pthread_t th;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  // worker: commands or quit
+  pthread_cond_t done;  // producer: a frame finished
+
+  ppu_thread_stats_t stats;
+};
+
+static inline void relax(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#endif
+}
+
+static inline unsigned load(const unsigned *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+// wake the worker if it went to sleep on an empty ring
+static void kick(ppu_thread_t *t) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&t->sleeping, __ATOMIC_SEQ_CST))
+    return;
+  pthread_mutex_lock(&t->lock);
+  pthread_cond_signal(&t->wake);
+  pthread_mutex_unlock(&t->lock);
+  t->stats.wakes++;
+}
+
+static void push(ppu_thread_t *t, const ppu_cmd_t *c) {
+  unsigned head = t->head;
+  if (head - t->tail_seen == PPU_RING_SIZE) {
+    t->tail_seen = load(&t->tail);
+    if (head - t->tail_seen == PPU_RING_SIZE) {
+      t->stats.waits++;
+      kick(t);
+      while (head - (t->tail_seen = load(&t->tail)) == PPU_RING_SIZE)
+        relax();
+    }
+  }
+  t->ring[head % PPU_RING_SIZE] = *c;
+  __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* --------------- worker --------------- */
+
+static void run_span(ppu_thread_t *t, const ppu_cmd_t *c) {
+  Ppu_t *r = &t->r;
+  if ((r->LCDC ^ c->LCDC) & 0x04)
+    r->obj_dirty = true;  // sprite height
+  bool pal = r->BGP != c->BGP || r->OBP0 != c->OBP0 || r->OBP1 != c->OBP1;
+  r->LCDC = c->LCDC;
+  r->SCY = c->SCY;
+  r->SCX = c->SCX;
+  r->BGP = c->BGP;
+  r->OBP0 = c->OBP0;
+  r->OBP1 = c->OBP1;
+  r->WY = c->WY;
+  r->WX = c->WX;
+  r->LY = c->ly;
+  r->dma_active = c->dma_active;
+  if (pal)
+    ppu_update_palettes(r);
+  ppu_render_span(r, c->x0, c->x1);
+  t->row_drawn[c->ly] = true;
+  t->stats.spans++;
+}
+
+// publish buf[back] and carry the rows that changed over to the other one,
+// which becomes the new back buffer
+static void run_frame(ppu_thread_t *t, bool changed) {
+  if (changed) {
+    int front = t->back;
+    __atomic_store_n(&t->front, front, __ATOMIC_RELEASE);
+    t->back ^= 1;
+    for (int y = 0; y < GB_HEIGHT; y++) {
+      if (t->row_drawn[y])
+        memcpy(t->buf[t->back] + y * GB_WIDTH, t->buf[front] + y * GB_WIDTH,
+               GB_WIDTH * sizeof(uint32_t));
+    }
+    memset(t->row_drawn, 0, sizeof(t->row_drawn));
+    t->r.framebuffer = t->buf[t->back];
+  }
+  pthread_mutex_lock(&t->lock);
+  t->frames_done++;
+  pthread_cond_signal(&t->done);
+  pthread_mutex_unlock(&t->lock);
+}
+
+static void run(ppu_thread_t *t, const ppu_cmd_t *c) {
+  switch (c->op) {
+    case PPU_CMD_SPAN: run_span(t, c); break;
+    case PPU_CMD_VRAM:
+      ppu_vram_write(&t->r, 0x8000 + c->addr, (uint8_t)c->val);
+      t->stats.writes++;
+      break;
+    case PPU_CMD_OAM:
+      ppu_oam_write(&t->r, c->addr, (uint8_t)c->val);
+      t->stats.writes++;
+      break;
+    case PPU_CMD_PALETTE:
+      t->r.pallete[c->addr] = c->val;
+      ppu_update_palettes(&t->r);
+      t->stats.writes++;
+      break;
+    case PPU_CMD_FRAME: run_frame(t, c->changed); break;
+  }
+}
+
+static void *worker(void *arg) {
+  ppu_thread_t *t = arg;
+  for (;;) {
+    unsigned tail = t->tail;
+    unsigned head = load(&t->head);
+    for (int i = 0; head == tail && i < SPIN_POLLS; i++) {
+      relax();
+      head = load(&t->head);
+    }
+    if (head == tail) {
+      pthread_mutex_lock(&t->lock);
+      __atomic_store_n(&t->sleeping, true, __ATOMIC_SEQ_CST);
+      while ((head = __atomic_load_n(&t->head, __ATOMIC_SEQ_CST)) == tail &&
+             !t->quit)
+        pthread_cond_wait(&t->wake, &t->lock);
+      __atomic_store_n(&t->sleeping, false, __ATOMIC_SEQ_CST);
+      bool quit = t->quit;
+      pthread_mutex_unlock(&t->lock);
+      if (head == tail && quit)
+        return NULL;
+    }
+    for (; tail != head; tail++)
+      run(t, &t->ring[tail % PPU_RING_SIZE]);
+    __atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+  }
+}
+
+/* --------------- emulation thread --------------- */
+
+ppu_thread_t *ppu_thread_new(const Ppu_t *d) {
+  ppu_thread_t *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NULL;
+  t->bus = calloc(1, sizeof(Bus_t));
+  t->buf[0] = malloc(GB_WIDTH * GB_HEIGHT * sizeof(uint32_t));
+  t->buf[1] = malloc(GB_WIDTH * GB_HEIGHT * sizeof(uint32_t));
+  if (!t->bus || !t->buf[0] || !t->buf[1])
+    goto fail;
+
+  memcpy(t->bus->vram, d->bus->vram, sizeof(t->bus->vram));
+  memcpy(t->bus->oam, d->bus->oam, sizeof(t->bus->oam));
+  // both buffers start as what the inline renderer has drawn so far
+  for (int y = 0; y < GB_HEIGHT; y++) {
+    memcpy(t->buf[0] + y * GB_WIDTH, d->framebuffer + y * d->fb_pitch,
+           GB_WIDTH * sizeof(uint32_t));
+  }
+  memcpy(t->buf[1], t->buf[0], GB_WIDTH * GB_HEIGHT * sizeof(uint32_t));
+
+  t->r = *d;
+  t->r.bus = t->bus;
+  t->r.thread = NULL;
+  t->r.framebuffer = t->buf[0];
+  t->r.fb_pitch = GB_WIDTH;
+  t->r.fb_own = NULL;
+  t->front = 1;
+
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->wake, NULL);
+  pthread_cond_init(&t->done, NULL);
+  if (pthread_create(&t->th, NULL, worker, t) != 0) {
+    fprintf(stderr, "[PPU] can't start the render thread\n");
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->wake);
+    pthread_cond_destroy(&t->done);
+    goto fail;
+  }
+  return t;
+
+fail:
+  free(t->buf[0]);
+  free(t->buf[1]);
+  free(t->bus);
+  free(t);
+  return NULL;
+}
+
+void ppu_thread_free(ppu_thread_t *t, Ppu_t *d) {
+  if (!t)
+    return;
+  pthread_mutex_lock(&t->lock);
+  t->quit = true;
+  pthread_cond_signal(&t->wake);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->th, NULL);
+
+  for (int y = 0; y < GB_HEIGHT; y++) {
+    memcpy(d->framebuffer + y * d->fb_pitch, t->buf[t->back] + y * GB_WIDTH,
+           GB_WIDTH * sizeof(uint32_t));
+  }
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->wake);
+  pthread_cond_destroy(&t->done);
+  free(t->buf[0]);
+  free(t->buf[1]);
+  free(t->bus);
+  free(t);
+}
+
+void ppu_thread_span(ppu_thread_t *t, const Ppu_t *d, int x0, int x1) {
+  ppu_cmd_t c = {
+    .op = PPU_CMD_SPAN, .ly = d->LY, .x0 = (uint8_t)x0, .x1 = (uint8_t)x1,
+    .LCDC = d->LCDC, .SCY = d->SCY, .SCX = d->SCX, .BGP = d->BGP,
+    .OBP0 = d->OBP0, .OBP1 = d->OBP1, .WY = d->WY, .WX = d->WX,
+    .dma_active = d->dma_active,
+  };
+  push(t, &c);
+  if (x1 == GB_WIDTH && d->LY % KICK_LINES == KICK_LINES - 1)
+    kick(t);
+}
+
+void ppu_thread_write(ppu_thread_t *t, uint8_t op, uint16_t addr, uint32_t val) {
+  ppu_cmd_t c = { .op = op, .addr = addr, .val = val };
+  push(t, &c);
+}
+
+void ppu_thread_frame(ppu_thread_t *t, bool changed) {
+  ppu_cmd_t c = { .op = PPU_CMD_FRAME, .changed = changed };
+  push(t, &c);
+  t->frames_queued++;
+  kick(t);
+}
+
+const uint32_t *ppu_thread_wait(ppu_thread_t *t) {
+  kick(t);
+  pthread_mutex_lock(&t->lock);
+  while (t->frames_done < t->frames_queued)
+    pthread_cond_wait(&t->done, &t->lock);
+  pthread_mutex_unlock(&t->lock);
+  return t->buf[__atomic_load_n(&t->front, __ATOMIC_ACQUIRE)];
+}
+
+ppu_thread_stats_t ppu_thread_stats(ppu_thread_t *t) {
+  // the worker counts as it replays: let it finish what's queued first
+  kick(t);
+  while (load(&t->tail) != t->head)
+    relax();
+  pthread_mutex_lock(&t->lock);
+  ppu_thread_stats_t st = t->stats;
+  pthread_mutex_unlock(&t->lock);
+  return st;
+}
@@ -0,0 +1,46 @@
+#include "sched.h"
+#include "memory.h"
+#include "ppu.h"
+#include "timers.h"
+
+static void advance(Bus_t *b, uint32_t cycles) {
+  if (!cycles)
+    return;
+  tick_timers(&b->timers, cycles, &b->IF);
+  display_cycle(b->ppu, b, cycles);
+  b->sched.synced += cycles;
+}
+
+static void reschedule(Bus_t *b) {
+  Sched_t *s = &b->sched;
+  unsigned long next = SCHED_NEVER;
+  uint32_t t = timers_next_event(&b->timers);
+  uint32_t p = ppu_next_event(b->ppu);
+
+  s->at[SCHED_TIMER] = t == TIMER_NO_EVENT ? SCHED_NEVER : s->synced + t;
+  s->at[SCHED_PPU] = p == PPU_NO_EVENT ? SCHED_NEVER : s->synced + p;
+  for (int i = 0; i < SCHED_SLOTS; i++) {
+    if (s->at[i] < next)
+      next = s->at[i];
+  }
+#ifdef GB_EAGER_SCHED
+  next = s->synced;  // tick the components on every access, like before
+#endif
+  s->next = next;
+}
+
+void sched_flush(Bus_t *b, uint32_t last) {
+  Sched_t *s = &b->sched;
+  advance(b, (uint32_t)(s->time - s->synced - last));
+  advance(b, last);
+  s->flushes++;
+  reschedule(b);
+}
+
+void sched_sync(Bus_t *b) {
+  Sched_t *s = &b->sched;
+  if (s->time == s->synced)
+    return;
+  advance(b, (uint32_t)(s->time - s->synced));
+  s->syncs++;
+}
@@ -44,6 +44,29 @@ void tick_timers(Timers_t *timers, uint32_t cycles, uint8_t *IF_REG) {
   }
 }
 
+uint32_t timers_next_event(const Timers_t *t) {
+  if (t->tima_overflow)
+    return 0;
+  if (!(t->TAC & 0x04))
+    return TIMER_NO_EVENT;
+
+  // the call that carries TIMA past 0xFF
+  int32_t left = (int32_t)select_tima(t->TAC) * (0x100 - t->TIMA) -
+                 (int32_t)t->tima_count;
+  return left > 0 ? (uint32_t)left : 0;
+}
+
+uint32_t timers_next_change(const Timers_t *t, uint16_t addy) {
+  if (addy == 0xFF04)  // reads return bits 16-23 of div_count
+    return 0x10000 - (t->div_count & 0xFFFF);
+  if (t->tima_overflow)
+    return 0;
+  if (!(t->TAC & 0x04))
+    return TIMER_NO_EVENT;
+  uint16_t period = select_tima(t->TAC);
+  return t->tima_count < period ? period - t->tima_count : 0;
+}
+
 uint8_t timers_read(Timers_t *t, uint16_t addy) {
   switch(addy) {
     case 0xFF04:
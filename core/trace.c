@@ -0,0 +1,76 @@
+#define _POSIX_C_SOURCE 200112L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "trace.h"
+
+trace_t *trace_open(const char *path, unsigned long records) {
+  uint64_t capacity = 1;
+  while (capacity < records)
+    capacity <<= 1;
+  size_t size = sizeof(trace_hdr_t) + capacity * sizeof(trace_rec_t);
+
+  trace_t *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NULL;
+  t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (t->fd < 0) {
+    fprintf(stderr, "[TRACE] can't create %s\n", path);
+    free(t);
+    return NULL;
+  }
+  if (ftruncate(t->fd, (off_t)size) != 0) {
+    fprintf(stderr, "[TRACE] can't size %s to %zu bytes\n", path, size);
+    goto fail;
+  }
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "[TRACE] can't map %s\n", path);
+    goto fail;
+  }
+
+  t->hdr = map;
+  t->rec = (trace_rec_t *)(t->hdr + 1);
+  t->mask = capacity - 1;
+  t->size = size;
+  memcpy(t->hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  t->hdr->version = TRACE_VERSION;
+  t->hdr->rec_size = sizeof(trace_rec_t);
+  t->hdr->capacity = capacity;
+  t->hdr->count = 0;
+  return t;
+
+fail:
+  close(t->fd);
+  free(t);
+  return NULL;
+}
+
+void trace_close(trace_t *t) {
+  if (!t)
+    return;
+  munmap(t->hdr, t->size);
+  close(t->fd);
+  free(t);
+}
+
+uint8_t trace_peek(const Bus_t *bus, uint16_t addy) {
+  const uint8_t *page = bus->read_map[addy >> 8];
+  if (page)
+    return page[addy & 0xFF];
+  // read_map is off during DMA: look at the memory behind it directly
+  if (addy < 0x100 && bus->bootrom_enabled && bus->bootrom)
+    return bus->bootrom[addy];
+  if (addy < 0x8000 && bus->cartridge) {
+    const uint8_t *rom = cart_rom_window(bus->cartridge, addy, NULL);
+    return rom ? rom[addy & 0x3FFF] : 0xFF;
+  }
+  if (addy >= 0xC000 && addy < 0xFE00)
+    return bus->wram[(addy - 0xC000) & 0x1FFF];
+  if (addy >= 0xFF80 && addy < 0xFFFF)
+    return bus->hram[addy - 0xFF80];
+  return 0xFF;  // VRAM, cart RAM, OAM, I/O: reads may have effects
+}
@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include "triple.h"
+
+bool triple_init(triple_t *t, size_t pixels) {
+  for (int i = 0; i < 3; i++) {
+    t->buf[i] = calloc(pixels, sizeof(uint32_t));
+    t->stamp[i] = 0;
+  }
+  t->back = 0;
+  t->state = 1;
+  t->front = 2;
+  t->published = 0;
+  t->dropped = 0;
+  if (!t->buf[0] || !t->buf[1] || !t->buf[2]) {
+    triple_free(t);
+    return false;
+  }
+  return true;
+}
+
+void triple_free(triple_t *t) {
+  for (int i = 0; i < 3; i++) {
+    free(t->buf[i]);
+    t->buf[i] = NULL;
+  }
+}
+
+void triple_publish(triple_t *t, uint64_t stamp) {
+  t->stamp[t->back] = stamp;
+  int old = __atomic_exchange_n(&t->state, t->back | TRIPLE_FRESH,
+                                __ATOMIC_ACQ_REL);
+  if (old & TRIPLE_FRESH)
+    t->dropped++;
+  t->back = old & 3;
+  t->published++;
+}
+
+const uint32_t *triple_take(triple_t *t, uint64_t *stamp) {
+  if (!(__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) & TRIPLE_FRESH))
+    return NULL;
+  int old = __atomic_exchange_n(&t->state, t->front, __ATOMIC_ACQ_REL);
+  t->front = old & 3;
+  if (stamp)
+    *stamp = t->stamp[t->front];
+  return t->buf[t->front];
+}
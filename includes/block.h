@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "memory.h"
+
+// Straight-line runs of SM83 code, decoded once and replayed by
+// cpu_run_blocks(). ROM blocks are keyed by (bank, PC); WRAM/HRAM blocks are
+// tagged with the write generation of their page and rebuilt once it moves.
+
+#define BLOCK_MAX_OPS 32
+#define BLOCK_CACHE_ENTRIES 2048  // direct mapped, power of two
+#define BLOCK_BANK_RAM 0xFFFFFFFFu
+
+struct jit_regs;
+
+typedef struct {
+  const instr_t *in;
+  u8 bytes[3];  // opcode + immediates, replayed through cpu->fetch_ptr
+  u8 len;
+  // JIT entry for the run of native_len ops starting here (see jit.h)
+  void (*native)(struct jit_regs *regs, uint32_t count);
+  u8 native_len;
+  u16 native_cycles;  // most T-cycles those ops can take
+} block_op_t;
+
+typedef struct {
+  bool valid;
+  u16 pc;
+  uint32_t bank;
+  const uint32_t *gen;  // &cart->bank_gen for ROM, &bus->code_gen[page] for RAM
+  uint32_t built_gen;
+  uint32_t runs;  // executions since it was built, for the JIT
+  bool jitted;
+  u8 count;
+  block_op_t ops[BLOCK_MAX_OPS];
+} block_t;
+
+typedef struct block_cache {
+  block_t *entries;
+  unsigned long hits;
+  unsigned long builds;
+} block_cache_t;
+
+block_cache_t *block_cache_new(void);
+void block_cache_free(block_cache_t *bc);
+void block_cache_flush(block_cache_t *bc);
+block_t *block_lookup(block_cache_t *bc, Bus_t *bus, u16 pc);
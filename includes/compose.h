@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+// Scanline compositing kernels. The PPU builds a line of BG/window colour
+// indices and expands it to ARGB through a 4-entry table (BGP already
+// applied, see ppu_update_palettes()); sprites then go on top. The bulk
+// expansion lives here, in a scalar and an AVX2 version; compose_best()
+// picks one at runtime.
+typedef struct compose {
+  const char *name;
+  // dst[i] = lut[idx[i]], idx[i] in 0-3
+  void (*argb)(uint32_t *dst, const uint8_t *idx, const uint32_t *lut, int n);
+} compose_t;
+
+// fastest kernel set the host CPU supports (AVX2 > scalar)
+const compose_t *compose_best(void);
+// kernel sets this host can run, slowest first; returns how many
+int compose_list(const compose_t **out, int max);
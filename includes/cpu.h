@@ -16,6 +16,44 @@ typedef uint8_t u8;
     u16 A##B;		\
   }			\
 
+// Predecoded view of an opcode, built once per opcode (see decode_table in
+// cpu.c) so handlers never have to go back to the bus for it. Entries
+// 0x000-0x0FF are the base opcodes, 0x100-0x1FF the $CB page.
+typedef struct {
+  u8 opcode;
+  u8 r_dst;    // bits 5-3: destination register (bit index / RST vector on $CB and RST)
+  u8 r_src;    // bits 2-0: source register
+  u8 rr;       // bits 5-4: 16-bit register pair
+  u8 imm_len;  // immediate bytes fetched after the opcode
+  u8 cycles;   // base T-cycles (branch not taken), including the fetch
+  u8 handler;  // slot in the threaded core's handler list
+  u8 flags;    // INSTR_* bits
+} instr_t;
+
+#define INSTR_BRANCH 0x01  // may change PC non-sequentially (also HALT/STOP)
+
+struct block_cache;
+struct jit;
+struct trace;
+
+// Idle-loop detector state (idle_check() in cpu.c): the last backward branch
+// and what the CPU looked like when it was taken.
+typedef struct {
+  bool armed;
+  bool repeat;          // the snapshot repeated the one before it
+  bool dirty;           // a write, interrupt or HALT since the snapshot
+  u8 reads;             // IDLE_* registers read since the snapshot
+  u16 pc;               // loop head
+  u8 A, F;
+  u16 BC, DE, HL, SP;
+  bool IME;
+  unsigned long cycle;
+  unsigned long flushes;   // sched.flushes at the snapshot
+  unsigned long until[4];  // next STAT/DIV/TIMA/LY change seen from it
+  unsigned long skipped;   // cycles skipped (stats)
+  unsigned long loops;     // skips taken
+} idle_t;
+
 typedef struct {
 
   Bus_t *bus;
@@ -32,6 +70,10 @@ typedef struct {
   u16 PC; 
 
   struct {bool Z, N, H, C;} F;
+  // pending lazy flag op (cpu.c), F is stale while op != 0. Use
+  // cpu_sync_flags()/cpu_flags_byte() before looking at F from outside.
+  // -DGB_EAGER_FLAGS materializes F after every op instead.
+  struct { u8 op, a, b; u16 res; } lf;
 
   unsigned long cycle;
   
@@ -41,6 +83,15 @@ typedef struct {
   bool IME;
   bool ime_pending;
 
+  // block cache (NULL = off); while a cached block runs, fetch8/fetch16
+  // take immediates from fetch_ptr instead of reading them from the bus
+  struct block_cache *blocks;
+  const u8 *fetch_ptr;
+  struct jit *jit;  // native tier over the block cache (NULL = off)
+  idle_t idle;
+  int breakpoint;  // PC the batch entry points stop at, -1 = none
+  struct trace *trace;  // instruction trace (trace.h), NULL = off
+
 } registers_t; 
 
 void cpu_go(registers_t *cpu);
@@ -48,6 +99,36 @@ void RESET_CPU(registers_t *cpu);
 u8 fetch8(registers_t *cpu);
 u16 fetch16(registers_t *cpu);
 void helper(registers_t *cpu);
+void cpu_sync_flags(registers_t *cpu);
+u8 cpu_flags_byte(const registers_t *cpu);  // ZNHC0000, pending ops resolved
+
+// Run `steps` helper() steps; returns how many ran. cpu_run uses the core
+// picked at build time (CORE=threaded in the Makefile for the threaded one).
+// A step taken in HALT runs up to the next timer/PPU event, not just 4 cycles.
+unsigned long cpu_run(registers_t *cpu, unsigned long steps);
+unsigned long cpu_run_table(registers_t *cpu, unsigned long steps);
+unsigned long cpu_run_threaded(registers_t *cpu, unsigned long steps);
+unsigned long cpu_run_blocks(registers_t *cpu, unsigned long steps);
+
+// Batched execution: run until the cycle budget is spent (gb_run_cycles) or
+// the PPU reaches VBlank (gb_run_frame), stopping early at cpu->breakpoint
+// or STOP. The last instruction (or HALT/idle skip) may run past the budget.
+typedef enum {
+  GB_CYCLES_DONE,  // budget spent
+  GB_FRAME_DONE,   // ppu->frame_ready is set
+  GB_BREAKPOINT,   // PC == cpu->breakpoint, not executed yet
+  GB_STOPPED,      // STOP executed
+} gb_status_t;
+
+gb_status_t gb_run_cycles(registers_t *cpu, unsigned long cycles);
+gb_status_t gb_run_frame(registers_t *cpu);
+
+// decode_table entry: 0x00-0xFF base opcodes, 0x100-0x1FF the $CB page
+const instr_t *cpu_decode(u16 index);
+bool cpu_enable_block_cache(registers_t *cpu, bool enable);
+// mode is JIT_OFF / JIT_ON / JIT_VERIFY (jit.h); turns the block cache on.
+// Returns false (leaving the interpreter in charge) if the host can't JIT.
+bool cpu_enable_jit(registers_t *cpu, int mode);
 
 
 
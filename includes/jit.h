@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "block.h"
+
+// x86-64 translation of hot ROM blocks. Compiled runs cover the register
+// ops (loads between registers, 8/16-bit ALU, rotates, $CB ops), loads and
+// stores, PUSH/POP, and a JR/JP/CALL/RET that ends the block. Memory goes
+// through the bus's read_map/write_map inline; a NULL page calls back into
+// cpu.c, which first ticks the cycles the run has spent up to that access.
+// Cycle counts are known when the run is compiled, so nothing else is
+// ticked until the run exits. cpu.c only enters a run that ends before the
+// scheduler's next deadline, where no interrupt can become pending except
+// through a store, and a slow-path store other than to HRAM ends the run
+// after its op. JIT_VERIFY replays each run against the interpreter's.
+
+#define JIT_HOT_THRESHOLD 16      // block executions before it is compiled
+#define JIT_MIN_OPS 2             // shortest run worth a native entry
+#define JIT_CODE_SIZE (1u << 20)  // code arena; flushed when it fills up
+
+enum { JIT_OFF, JIT_ON, JIT_VERIFY };
+
+// SM83 state as the native code sees it; f uses the SM83 F layout (ZNHC0000)
+typedef struct jit_regs {
+  uint32_t a, f, b, c, d, e, h, l, sp;
+  uint32_t pc;      // set by a compiled branch at the end of the run
+  uint32_t cycles;  // T-cycles of the ops run, set on exit
+  uint32_t synced;  // of those, already ticked by the call-outs
+  uint32_t ran;     // ops run, set on exit
+  uint32_t stop;    // a call-out stored somewhere the run can't go past
+  uint32_t dirty;   // a store went straight through write_map
+  uint32_t pad;
+  // the bus's page maps, and the slow path for the pages they leave NULL;
+  // `at` is the access's cycle counted from the start of the run
+  const uint8_t *const *read_map;
+  uint8_t *const *write_map;
+  uint32_t (*read)(struct jit_regs *r, uint32_t addy, uint32_t at);
+  uint32_t (*write)(struct jit_regs *r, uint32_t addy, uint32_t val,
+                    uint32_t at);  // nonzero: end the run after this op
+  void *ctx;        // the call-outs' state
+} jit_regs_t;
+
+typedef void (*jit_fn_t)(jit_regs_t *regs, uint32_t count);
+
+typedef struct jit {
+  int mode;
+  u8 *code;
+  size_t used;
+  unsigned long segments;    // native runs compiled
+  unsigned long native_ops;  // ops executed natively
+  unsigned long checked;     // runs compared in JIT_VERIFY mode
+  unsigned long mismatches;
+  unsigned long flushes;
+  struct jit_shadow *shadow;  // JIT_VERIFY scratch, owned by cpu.c
+} jit_t;
+
+// NULL when the host can't run generated code (not x86-64, no mmap)
+jit_t *jit_new(int mode);
+void jit_free(jit_t *jit);
+
+// Give every run of compilable ops in b a native entry; flushes the whole
+// arena (and every block's entries) when it is full.
+void jit_compile_block(jit_t *jit, block_cache_t *bc, block_t *b);
+void jit_flush(jit_t *jit, block_cache_t *bc);
+bool jit_supported(const block_op_t *op);
+// most T-cycles op can take (a conditional branch counted as taken)
+int jit_op_cycles(const block_op_t *op);
+
+// Slow-path stores the run stops after: anything but HRAM can switch banks,
+// start DMA, make an interrupt pending or overwrite cached code.
+static inline bool jit_write_ends_run(uint32_t addy) {
+  return addy < 0xFF80 || addy == 0xFFFF;
+}
@@ -8,9 +8,59 @@
 #include "cpu.h"
 #include "memory.h"
 
+// Diagnostics by category and level:
+//   LOG(LOG_INT, LOG_DEBUG, "[INT] ...", ...);
+// Anything above GB_LOG_LEVEL (make LOG=...) or outside GB_LOG_CATS is
+// compiled out with its arguments. What's left costs one load and one
+// branch on log_mask, the categories and levels turned on at runtime
+// (log_enable(), GB_LOG in main.c).
+enum { LOG_ERROR = 1, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_TRACE };
+enum { LOG_CPU, LOG_INT, LOG_MBC, LOG_PPU, LOG_INPUT, LOG_BOOT, LOG_CATS };
+
+#ifndef GB_LOG_LEVEL
+#define GB_LOG_LEVEL LOG_INFO
+#endif
+#ifndef GB_LOG_CATS
+#define GB_LOG_CATS 0xFFu  // bit per category
+#endif
+
+#define LOG_BIT(cat, lvl) (1ull << ((cat) * 8 + (lvl)))
+extern uint64_t log_mask;
+
+// true when cat/lvl messages are compiled in and turned on
+#define LOG_ON(cat, lvl)                                                     \
+  ((lvl) <= GB_LOG_LEVEL && (GB_LOG_CATS >> (cat) & 1) &&                    \
+   __builtin_expect((log_mask & LOG_BIT(cat, lvl)) != 0, 0))
+
+#define LOG(cat, lvl, ...)                                                   \
+  do {                                                                       \
+    if (LOG_ON(cat, lvl))                                                    \
+      write_log(__VA_ARGS__);                                                \
+  } while (0)
+
+// only the first n messages from this call site
+#define LOG_FIRST(n, cat, lvl, ...)                                          \
+  do {                                                                       \
+    static int log_count_;                                                   \
+    if (LOG_ON(cat, lvl) && log_count_ < (n)) {                              \
+      log_count_++;                                                          \
+      write_log(__VA_ARGS__);                                                \
+    }                                                                        \
+  } while (0)
+
+// turn the given categories (bit per LOG_*) on up to level, the rest off
+void log_enable(unsigned cats, int level);
+// "int,mbc:debug" style list (or "all", "none"); false if it didn't parse
+bool log_parse(const char *spec);
+
+// Queued for a background writer (see logging.c): cheap enough for hot
+// paths. %s arguments are copied, all others are kept by value.
 void write_log(const char *format, ...);
 void set_log_file(const char *filename);
+// flushes and stops the writer; the next write_log() opens the file again
 void close_log_file(void);
+// write out everything queued so far (also done at exit and on a crash)
+void log_flush(void);
 void dump_cpu(const registers_t *cpu, const char *filename);
 void dump_vram(const Bus_t *bus, const char *filename);
 void dump_wram(const Bus_t *bus, const char *filename);
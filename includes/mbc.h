@@ -7,10 +7,24 @@
 typedef enum {
   MBC_0 = 0,
   MBC_1,
+  MBC_2,
   MBC_3, 
   MBC_5
 } mbc_t;
 
+struct Cartridge;
+
+// Picked once by load_cart(). Reads of 0000-7FFF and of A000-BFFF while a
+// RAM window is mapped never reach the mapper; map() recomputes those
+// windows after every register write.
+typedef struct mapper {
+  const char *name;
+  void (*write_reg)(struct Cartridge *cart, uint16_t addy, uint8_t val);  // 0000-7FFF
+  void (*map)(struct Cartridge *cart);
+  uint8_t (*ram_read)(struct Cartridge *cart, uint16_t addy);  // A000-BFFF, no window
+  void (*ram_write)(struct Cartridge *cart, uint16_t addy, uint8_t val);
+} mapper_t;
+
 typedef struct Cartridge {
   mbc_t type;
   uint8_t *rom;
@@ -20,13 +34,20 @@ typedef struct Cartridge {
   size_t ram_size; 
   bool ram_enable;
 
-  uint8_t rom_bank;
+  uint16_t rom_bank;	// 9 bits on MBC5
   uint8_t ram_bank;
   uint8_t mode;
 
   uint16_t rom_banks;
   uint16_t ram_banks;
 
+  uint32_t bank_gen;	// bumped on every MBC register write
+
+  const mapper_t *mapper;
+  const uint8_t *rom_window[2];	// 0000-3FFF, 4000-7FFF (NULL = bank past the image)
+  uint32_t rom_window_bank[2];
+  uint8_t *ram_window;		// A000-BFFF, NULL = mapper->ram_read/ram_write
+
   uint8_t rtc_regs[5];	// 0 S | 1 M | 2 H | 3 DL | 4 DH
   uint8_t rtc_reg_select;
   bool rtc_latched;
@@ -37,6 +58,8 @@ typedef struct Cartridge {
   uint32_t rtc_total_seconds;
   uint8_t rtc_latch_prev;
 
+  bool rumble;		// MBC5 + motor: 4000-5FFF bit 3 is the motor
+
   //cgb
   bool is_cgb;
 } Cartridge_t;
@@ -46,3 +69,16 @@ void free_cart(Cartridge_t *cart);
 void cart_write(Cartridge_t *cart, uint16_t addy, uint8_t val); 
 uint8_t cart_read(Cartridge_t *cart, uint16_t addy);
 
+// 16KB ROM window currently mapped at addy (< 0x8000) and its bank number,
+// or NULL when that bank lies past the end of the ROM image.
+static inline const uint8_t *cart_rom_window(const Cartridge_t *cart,
+                                             uint16_t addy, uint32_t *bank) {
+  int slot = (addy >> 14) & 1;
+  if (bank) *bank = cart->rom_window_bank[slot];
+  return cart->rom_window[slot];
+}
+// 8KB RAM bank mapped at A000 when it is plain memory (enabled, no RTC
+// register selected, fully backed), else NULL
+static inline uint8_t *cart_ram_window(Cartridge_t *cart) {
+  return cart->ram_window;
+}
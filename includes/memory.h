@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include "mbc.h"
 #include "timers.h"
+#include "sched.h"
 
 /*
 
@@ -21,10 +22,29 @@
 
 struct Ppu;
 
+// Slow-path accesses in order, recorded while JIT_VERIFY checks a run
+#define BUS_LOG_MAX 64
+typedef struct bus_access {
+  unsigned long time;  // sched.time of the access
+  uint16_t addy;
+  uint8_t val;
+  bool write;
+} bus_access_t;
+
+typedef struct bus_log {
+  int n;
+  bool overflow;
+  bus_access_t at[BUS_LOG_MAX];
+} bus_log_t;
+
+// code_gen[] slots: one per WRAM page (C000-DFFF), plus one for HRAM
+#define CODE_GEN_HRAM 0x20
+
 typedef struct Bus {
   Cartridge_t *cartridge;
   Timers_t timers;
   struct Ppu *ppu;
+  Sched_t sched;  // when the timers/PPU next need to run (sched.h)
 
 
   uint8_t rom[0x8000];
@@ -37,6 +57,19 @@ typedef struct Bus {
   uint8_t vram[0x2000];
   uint8_t oam[0xA0];
 
+  // write generations of the pages code can run from (see block.h)
+  uint32_t code_gen[CODE_GEN_HRAM + 1];
+  // WRAM pages the block cache holds code from; their writes take the slow
+  // path so code_gen gets bumped
+  bool code_watch[CODE_GEN_HRAM];
+
+  // one entry per 256-byte page: plain memory behind it, or NULL for the
+  // slow path (I/O, OAM, MBC registers, VRAM writes, anything during DMA).
+  // Rebuilt by bus_remap() when banks, the boot ROM or DMA change.
+  const uint8_t *read_map[256];
+  uint8_t *write_map[256];
+  bus_log_t *log;  // NULL unless a JIT run is being checked
+
   uint8_t IE;
   uint8_t IF;
   uint8_t JOYP;
@@ -47,9 +80,28 @@ typedef struct Bus {
 } Bus_t;
 
 void init_bus(Bus_t* b);
-uint8_t read_byte_bus(Bus_t* bus, uint16_t addy);
-void write_byte_bus(Bus_t* bus, uint16_t addy, uint8_t val);
+uint8_t bus_read_slow(Bus_t* bus, uint16_t addy);
+void bus_write_slow(Bus_t* bus, uint16_t addy, uint8_t val);
 int bus_load_rom(Bus_t *bus, const char* path);
+void bus_remap(Bus_t *b);
+void bus_remap_cart(Bus_t *b);
+void bus_watch_code(Bus_t *b, uint16_t addy);
+
+static inline uint8_t read_byte_bus(Bus_t* bus, uint16_t addy) {
+  const uint8_t *page = bus->read_map[addy >> 8];
+  if (page)
+    return page[addy & 0xFF];
+  return bus_read_slow(bus, addy);
+}
+
+static inline void write_byte_bus(Bus_t* bus, uint16_t addy, uint8_t val) {
+  uint8_t *page = bus->write_map[addy >> 8];
+  if (page) {
+    page[addy & 0xFF] = val;
+    return;
+  }
+  bus_write_slow(bus, addy, val);
+}
 
 static inline uint16_t bus_read16(Bus_t* b, uint16_t addr) {
   uint8_t lo = read_byte_bus(b, addr);
@@ -1,14 +1,20 @@
 #pragma once
 #include <stdint.h> 
 #include <stdbool.h> 
+#include "compose.h"
 
 #define GB_WIDTH 160
 #define GB_HEIGHT 144
 #define OAM_SIZE 160
+#define LINE_OBJS 10  // sprites drawn per line
 
 #define LCDC_ENABLE 0x80
 
+// tile data at 8000-97FF: 384 tiles of 16 bytes
+#define TILE_COUNT 384
+
 typedef struct Bus Bus_t;
+struct ppu_thread;
 
 enum {
   LCDC=0xFF40, STAT=0xFF41, SCY=0xFF42, SCX=0xFF43, LY=0xFF44, LYC=0xFF45,
@@ -18,15 +24,55 @@ enum {
 typedef struct Ppu {
   uint8_t LCDC, LY, LYC, STAT, SCY, SCX, BGP, OBP0, OBP1, WY, WX;
 
+  // where lines are drawn: GB_HEIGHT rows of GB_WIDTH pixels, fb_pitch
+  // pixels apart. fb_own unless ppu_set_target() gave another one.
   uint32_t *framebuffer;
-  uint32_t *scaled_framebuffer;
-  uint32_t *temp_framebuffer;
-  uint32_t *background_buffer;
+  int fb_pitch;
+  uint32_t *fb_own;
+
+  uint32_t pallete[4];  // user palette, 0xRRGGBB per shade
+
+  // ARGB per colour index with BGP/OBP0/OBP1 applied to pallete, kept in
+  // step by ppu_update_palettes(); blank is what BG/window off shows
+  uint32_t bg_lut[4];
+  uint32_t obj_lut[2][4];
+  uint32_t blank;
+
+  // Decoded tile data: colour index (0-3) per pixel, and the rows mirrored
+  // for X-flipped sprites. ppu_vram_write() marks tiles in tile_dirty; they
+  // are decoded again before the next scanline is rendered.
+  uint8_t tiles[TILE_COUNT][8][8];
+  uint8_t tiles_flip[TILE_COUNT][8][8];
+  uint32_t tile_dirty[TILE_COUNT / 32];
+  const compose_t *compose;  // scanline kernels, compose_best() by default
+  // BG/window colour index (0-3, before BGP) of each pixel of the line
+  // being drawn; 0 where both are off. Sprite priority tests this.
+  uint8_t bg_index[GB_WIDTH];
 
-  uint32_t pallete[4];
+  // OAM indices of the sprites on each line, highest priority (lowest X,
+  // then lowest index) first. Rebuilt before the next line is drawn once
+  // obj_dirty is set: OAM writes, OAM DMA end, LCDC sprite height change.
+  uint8_t line_objs[GB_HEIGHT][LINE_OBJS];
+  uint8_t line_obj_count[GB_HEIGHT];
+  bool obj_dirty;
+
+  // Frame reuse: pix_gen moves on every change to what gets drawn (see
+  // ppu_touch()); line_gen[y] is the pix_gen row y was last drawn with in
+  // full, 0 if none, and row_valid[y] says the target still holds it. A
+  // span of a valid row whose line_gen is still current is left as it is.
+  uint32_t pix_gen;
+  uint32_t line_gen[GB_HEIGHT];
+  bool row_valid[GB_HEIGHT];
+  uint32_t line_start_gen;  // pix_gen when line LY started drawing
+  bool frame_changed;       // a row changed since the last VBlank
+  // frame_serial counts VBlanks; row_serial[y] is the frame in which row y
+  // was last drawn into the target (see ppu_swap_target())
+  unsigned long frame_serial;
+  unsigned long row_serial[GB_HEIGHT];
 
   int cycles_in_line;
   int mode;
+  uint8_t line_x;  // pixels of line LY drawn so far (see display_cycle)
 
   Bus_t *bus;
   uint8_t DMA; 
@@ -35,10 +81,55 @@ typedef struct Ppu {
   uint8_t dma_counter;
   uint16_t dma_source;
   bool frame_ready;
+  // set with frame_ready: the framebuffer is the same as at the last VBlank
+  bool frame_unchanged;
+  // false: lines aren't drawn, LY/STAT/interrupts run as usual. Flip it
+  // between frames (after gb_run_frame()) to skip or request whole frames.
+  bool render;
+  struct ppu_thread *thread;  // worker renderer (NULL = draw inline)
 } Ppu_t;
 
-void start_display(Ppu_t *display, Bus_t *bus, int scale);
+void start_display(Ppu_t *display, Bus_t *bus);
+// Draw into pixels (ARGB8888, pitch in bytes, e.g. from SDL_LockTexture)
+// from now on; NULL goes back to fb_own. What the new target holds isn't
+// trusted, every row is drawn again.
+void ppu_set_target(Ppu_t *d, void *pixels, int pitch);
+// Same, for a target that already holds what the current one held at the
+// VBlank ending frame `held` (a frame_serial): only the rows drawn since
+// are copied over from the current target, and the rest stay valid.
+void ppu_swap_target(Ppu_t *d, void *pixels, int pitch, unsigned long held);
 void display_cycle(Ppu_t *d, Bus_t *b, int cycles);
+void ppu_render_line(Ppu_t *d);  // draw all of line LY into the framebuffer
+void ppu_render_span(Ppu_t *d, int x0, int x1);  // pixels [x0, x1) of it
+// Draw on a worker thread (ppu_thread.h) instead of inline; false if it
+// can't be started. The target set by ppu_set_target() isn't drawn to
+// while it runs; ppu_frame() gives the finished frames.
+bool ppu_enable_thread(Ppu_t *d, bool enable);
+// The frame finished at the last VBlank, *pitch pixels per row. Waits for
+// the worker in threaded mode.
+const uint32_t *ppu_frame(Ppu_t *d, int *pitch);
+// rebuild bg_lut/obj_lut, after a BGP/OBP0/OBP1 or pallete change
+void ppu_update_palettes(Ppu_t *d);
+// swap the user palette (shades 0-3 as 0xRRGGBB), any time
+void ppu_set_palette(Ppu_t *d, const uint32_t colors[4]);
+
+#define PPU_PALETTE_COUNT 3
+extern const uint32_t *const ppu_palettes[PPU_PALETTE_COUNT];
 uint8_t ppu_vram_read(Ppu_t *ppu, uint16_t addr);
 void ppu_vram_write(Ppu_t *ppu, uint16_t addr, uint8_t byte);
+void ppu_oam_write(Ppu_t *ppu, uint16_t index, uint8_t byte);  // FE00 + index
+
+// what the PPU draws changed: VRAM, OAM, LCDC/SCX/SCY/WX/WY/BGP/OBP0/OBP1
+// or the user palette (call only for real changes)
+static inline void ppu_touch(Ppu_t *d) {
+  if (++d->pix_gen == 0)
+    d->pix_gen = 1;
+}
 bool ppu_is_mode2(Ppu_t *ppu);
+
+#define PPU_NO_EVENT UINT32_MAX
+// cycles until display_cycle() next changes IF or runs DMA; rendering and
+// STAT/LY in between catch up whenever the bus syncs
+uint32_t ppu_next_event(const Ppu_t *d);
+// cycles until a read of the register at addr can return a different value
+uint32_t ppu_next_change(const Ppu_t *d, uint16_t addr);
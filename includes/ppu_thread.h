@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "ppu.h"
+
+// Threaded rendering (ppu_enable_thread()). The emulation thread still
+// decides which spans of which lines to draw (catch_up_line() in ppu.c) but
+// only records them: the registers a span is drawn with, and every VRAM,
+// OAM or user palette byte that changed, go through a single-producer ring
+// to a worker thread. The worker replays them on its own copy of the PPU,
+// VRAM and OAM with the same render code, into two buffers: the front one
+// holds the last finished frame and is swapped in with an atomic store.
+
+#define PPU_RING_SIZE (1u << 15)  // commands; the producer waits when full
+
+enum { PPU_CMD_SPAN, PPU_CMD_VRAM, PPU_CMD_OAM, PPU_CMD_PALETTE, PPU_CMD_FRAME };
+
+typedef struct ppu_cmd {
+  uint8_t op;                   // PPU_CMD_*
+  uint8_t ly, x0, x1;           // SPAN: pixels [x0, x1) of line ly
+  uint8_t LCDC, SCY, SCX, BGP, OBP0, OBP1, WY, WX;
+  bool dma_active;              // SPAN: sprites are off
+  bool changed;                 // FRAME: it differs from the last one
+  uint16_t addr;                // VRAM/OAM offset, PALETTE shade
+  uint32_t val;                 // byte written, PALETTE colour
+} ppu_cmd_t;
+
+typedef struct ppu_thread ppu_thread_t;
+
+// Start a worker from d's current state (registers, tile cache, VRAM, OAM,
+// framebuffer); NULL if the thread can't be created
+ppu_thread_t *ppu_thread_new(const Ppu_t *d);
+// Let the worker finish what's queued, stop it and leave what it drew in
+// d->framebuffer, so the inline renderer carries on from there
+void ppu_thread_free(ppu_thread_t *t, Ppu_t *d);
+
+void ppu_thread_span(ppu_thread_t *t, const Ppu_t *d, int x0, int x1);
+void ppu_thread_write(ppu_thread_t *t, uint8_t op, uint16_t addr, uint32_t val);
+void ppu_thread_frame(ppu_thread_t *t, bool changed);
+// Wait until the worker has finished the last frame passed to
+// ppu_thread_frame() and return it (GB_WIDTH pitch). It stays intact until
+// the worker finishes the next one.
+const uint32_t *ppu_thread_wait(ppu_thread_t *t);
+
+typedef struct {
+  unsigned long spans;   // spans drawn by the worker
+  unsigned long writes;  // VRAM/OAM/palette bytes replayed
+  unsigned long waits;   // producer stalls on a full ring
+  unsigned long wakes;   // times the worker had to be woken up
+} ppu_thread_stats_t;
+
+// waits until the worker has replayed everything queued so far
+ppu_thread_stats_t ppu_thread_stats(ppu_thread_t *t);
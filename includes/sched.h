@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Discrete-event scheduling of the timers and the PPU. The CPU only adds its
+// T-cycles to sched.time; tick_timers()/display_cycle() are run when time
+// reaches the earliest deadline (next TIMA overflow, next enabled STAT
+// interrupt or VBlank, any cycle while OAM DMA runs) or when the bus touches
+// their registers, VRAM or OAM. Between deadlines those components can't
+// raise IF, so running them late in one call gives the same state as running
+// them every access; the PPU draws the pixels it owes on the way.
+
+struct Bus;
+
+enum { SCHED_TIMER, SCHED_PPU, SCHED_SLOTS };
+
+#define SCHED_NEVER (~0ul)
+
+typedef struct Sched {
+  unsigned long time;              // cycles the CPU has spent (not stopped)
+  unsigned long synced;            // cycles the timers/PPU have seen
+  unsigned long next;              // min(at[])
+  unsigned long at[SCHED_SLOTS];   // deadline per component
+  unsigned long flushes;           // deadline hits, for the benches
+  unsigned long syncs;             // register-access catch-ups
+} Sched_t;
+
+// Bring the timers/PPU up to sched.time. The last `last` cycles are run as
+// their own call so an event inside them fires exactly as it used to.
+void sched_flush(struct Bus *b, uint32_t last);
+// Catch up before a register access (no deadline can be inside the gap)
+void sched_sync(struct Bus *b);
+// Deadlines depend on registers; call after writing one of them
+static inline void sched_invalidate(Sched_t *s) {
+  s->next = s->time;
+}
+
+static inline void sched_tick(struct Bus *b, Sched_t *s, uint32_t cycles) {
+  s->time += cycles;
+  if (s->time >= s->next)
+    sched_flush(b, cycles);
+}
@@ -17,3 +17,9 @@ void tick_timers(Timers_t *timers, uint32_t cycles, uint8_t *IF_REG);
 void timers_init(Timers_t *timers);
 uint8_t timers_read(Timers_t *t, uint16_t addy);
 void timers_write(Timers_t *t, uint16_t addy, uint8_t val);
+
+#define TIMER_NO_EVENT UINT32_MAX
+// cycles until tick_timers() next raises IF (TIMA overflow or its reload)
+uint32_t timers_next_event(const Timers_t *t);
+// cycles until a read of DIV/TIMA can return a different value
+uint32_t timers_next_change(const Timers_t *t, uint16_t addy);
@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+
+// Instruction trace (cpu->trace, GB_TRACE in main.c): one fixed-size record
+// per executed instruction, taken just before its opcode is fetched, in a
+// ring that is a memory-mapped file. Records are plain stores into the
+// mapping and the kernel writes the pages back, so the trace survives a
+// crash and costs no syscalls while the CPU runs. tools/gbtrace decodes it.
+//
+// File: trace_hdr_t, then `capacity` trace_rec_t. Record i of the run is at
+// i % capacity; the last min(count, capacity) are there.
+
+#define TRACE_MAGIC "GBTRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_hdr {
+  char magic[8];         // TRACE_MAGIC
+  uint32_t version;      // TRACE_VERSION
+  uint32_t rec_size;     // sizeof(trace_rec_t)
+  uint64_t capacity;     // records in the ring, a power of two
+  uint64_t count;        // records written so far
+  uint8_t pad[32];
+} trace_hdr_t;
+
+typedef struct trace_rec {
+  uint64_t cycle;        // cpu->cycle before the instruction
+  uint16_t pc, sp;
+  uint16_t bank;         // ROM bank at pc (< 0x8000), else 0
+  uint8_t a, f, b, c, d, e, h, l;
+  uint8_t op[4];         // bytes at pc..pc+3 (0xFF where reading has effects)
+  uint8_t ime, IF, IE;
+  uint8_t pad[3];
+} trace_rec_t;
+
+typedef struct trace {
+  trace_hdr_t *hdr;      // the mapping
+  trace_rec_t *rec;
+  uint64_t mask;         // capacity - 1
+  uint64_t count;
+  size_t size;           // bytes mapped
+  int fd;
+} trace_t;
+
+// Create (truncate) path holding `records` records (rounded up to a power
+// of two); NULL with a message on stderr if it can't be mapped
+trace_t *trace_open(const char *path, unsigned long records);
+// unmap and close; the file keeps the last records
+void trace_close(trace_t *t);
+
+// what pc's instruction looks like without side effects
+uint8_t trace_peek(const Bus_t *bus, uint16_t addy);
+
+static inline void trace_step(trace_t *t, const registers_t *cpu) {
+  trace_rec_t *r = &t->rec[t->count & t->mask];
+  const Bus_t *bus = cpu->bus;
+  uint16_t pc = cpu->PC;
+  uint32_t bank = 0;
+  if (pc < 0x8000 && bus->cartridge && !(bus->bootrom_enabled && pc < 0x100))
+    cart_rom_window(bus->cartridge, pc, &bank);
+
+  r->cycle = cpu->cycle;
+  r->pc = pc;
+  r->sp = cpu->SP;
+  r->bank = (uint16_t)bank;
+  r->a = cpu->A;
+  r->f = cpu_flags_byte(cpu);
+  r->b = cpu->B;
+  r->c = cpu->C;
+  r->d = cpu->D;
+  r->e = cpu->E;
+  r->h = cpu->H;
+  r->l = cpu->L;
+  const uint8_t *page = bus->read_map[pc >> 8];
+  if (page && (pc & 0xFF) <= 0xFC) {
+    memcpy(r->op, page + (pc & 0xFF), 4);
+  } else {
+    for (int i = 0; i < 4; i++)
+      r->op[i] = trace_peek(bus, (uint16_t)(pc + i));
+  }
+  r->ime = cpu->IME;
+  r->IF = bus->IF;
+  r->IE = bus->IE;
+  t->hdr->count = ++t->count;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Triple-buffered frames between one producer (the emulation thread) and
+// one consumer (the presentation thread). The producer fills back and
+// publishes it; the consumer takes whatever was published last and never
+// waits. Frames published over one that wasn't taken yet are dropped.
+// Neither side blocks: one atomic exchange per publish and per take.
+
+#define TRIPLE_FRESH 4  // state bit: the middle buffer wasn't taken yet
+
+typedef struct triple {
+  uint32_t *buf[3];
+  uint64_t stamp[3];   // caller's timestamp of each published frame
+  int state;           // atomic: middle index | TRIPLE_FRESH
+  int back;            // producer's buffer
+  int front;           // consumer's buffer
+  unsigned long published;  // producer only
+  unsigned long dropped;    // producer only: published over a fresh one
+} triple_t;
+
+// `pixels` uint32_t per buffer, zeroed; false when out of memory
+bool triple_init(triple_t *t, size_t pixels);
+void triple_free(triple_t *t);
+
+// producer: the buffer to fill, then hand it over with its timestamp
+static inline uint32_t *triple_back(triple_t *t) {
+  return t->buf[t->back];
+}
+void triple_publish(triple_t *t, uint64_t stamp);
+
+// consumer: the newest published frame, or NULL if nothing new since the
+// last call. It stays untouched until the next call.
+const uint32_t *triple_take(triple_t *t, uint64_t *stamp);
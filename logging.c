@@ -1,11 +1,375 @@
+#define _POSIX_C_SOURCE 200809L
 #include "logging.h"
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+
+// write_log() only records: the format pointer, its arguments and a global
+// sequence number go into a fixed-size record in the calling thread's ring
+// (single producer, no locks). A background thread merges the rings in
+// sequence order, formats the records and writes them in blocks, with one
+// fflush per pass instead of one per message.
+//
+// The writer looks at the rings every LOG_IDLE_MS; a producer whose ring
+// passes LOG_HIGH_WATER wakes it right away. A producer that still finds
+// its ring full drains the rings itself, so nothing is lost; with
+// -DGB_LOG_DROP it drops the record instead and the writer reports how many
+// went missing. log_flush() drains everything right away; it runs at
+// exit(), from close_log_file() and on a fatal signal.
+
+#define LOG_RING_SIZE 4096   // records per thread
+#define LOG_MAX_ARGS  12     // more than this and the message is formatted in place
+#define LOG_STR_BYTES 80     // %s arguments are copied here (truncated)
+#define LOG_IDLE_MS   10     // writer sleep when every ring is empty
+#define LOG_HIGH_WATER (LOG_RING_SIZE / 2)  // queued records that wake it
+#define LOG_BLOCK     (64 * 1024)
+
+typedef union {
+  long long i;         // integers; %s: offset into str
+  double d;
+  const void *p;
+} log_arg_t;
+
+typedef struct {
+  const char *fmt;       // NULL: str holds the formatted message
+  unsigned long seq;
+  log_arg_t arg[LOG_MAX_ARGS];
+  char str[LOG_STR_BYTES];
+} log_rec_t;
+
+typedef struct log_ring {
+  log_rec_t rec[LOG_RING_SIZE];
+  unsigned head, tail;       // head: owner thread, tail: writer
+  unsigned tail_seen;        // owner's last look at tail
+  unsigned long dropped;     // owner thread; read by the writer
+  unsigned long dropped_seen;
+  struct log_ring *next;
+} log_ring_t;
 
 static FILE *log_file = NULL;
 static char log_filename[256] = "log.txt";
 
+#define LOG_LEVELS_UP_TO(lvl) ((0xFFull >> (7 - (lvl))) & ~1ull)
+#define LOG_DEFAULT_MASK (LOG_LEVELS_UP_TO(GB_LOG_LEVEL) * 0x010101010101ull)
+uint64_t log_mask = LOG_DEFAULT_MASK;
+
+static __thread log_ring_t *my_ring;
+static log_ring_t *rings;          // every thread that ever logged
+static unsigned long log_seq;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;   // rings list
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;  // writer side
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static bool writer_running, writer_quit;
+static bool writer_sleeping;       // atomic
+
+static char block[LOG_BLOCK];
+static size_t block_len;
+
+/* --------------- format conversions --------------- */
+
+// one conversion of a printf format
+typedef struct {
+  const char *start;  // the '%'
+  int len;
+  char kind;          // i l q z j t d D p s n %
+  int stars;          // '*' width/precision ints before the value
+} log_spec_t;
+
+// the next conversion at or after p, or NULL when there is none
+static const char *next_spec(const char *p, log_spec_t *s) {
+  p = strchr(p, '%');
+  if (!p)
+    return NULL;
+  s->start = p++;
+  s->stars = 0;
+  while (*p && strchr("-+ #0", *p))
+    p++;
+  for (; *p == '*' || (*p >= '0' && *p <= '9') || *p == '.'; p++)
+    s->stars += *p == '*';
+  char len = 0;
+  if (*p == 'h') { p++; if (*p == 'h') p++; }
+  else if (*p == 'l') { p++; len = 'l'; if (*p == 'l') { p++; len = 'q'; } }
+  else if (*p == 'z' || *p == 'j' || *p == 't' || *p == 'L') len = *p++;
+  switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+      s->kind = (len && len != 'L') ? len : 'i'; break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      s->kind = len == 'L' ? 'D' : 'd'; break;
+    case 'p': s->kind = 'p'; break;
+    case 's': s->kind = 's'; break;
+    case '%': s->kind = '%'; break;
+    default: s->kind = 'n'; break;  // %n or garbage: printed as is
+  }
+  if (*p)
+    p++;
+  s->len = (int)(p - s->start);
+  return p;
+}
+
+// copy the arguments of fmt into r; false if there are too many
+static bool capture(log_rec_t *r, const char *fmt, va_list ap) {
+  log_spec_t s;
+  int n = 0;
+  size_t str = 0;
+  for (const char *p = fmt; (p = next_spec(p, &s)); ) {
+    if (s.kind == '%' || s.kind == 'n')
+      continue;
+    if (n + s.stars + 1 > LOG_MAX_ARGS)
+      return false;
+    for (int i = 0; i < s.stars; i++)
+      r->arg[n++].i = va_arg(ap, int);
+    log_arg_t *a = &r->arg[n++];
+    switch (s.kind) {
+      case 'i': a->i = va_arg(ap, int); break;
+      case 'l': a->i = va_arg(ap, long); break;
+      case 'q': a->i = va_arg(ap, long long); break;
+      case 'z': a->i = (long long)va_arg(ap, size_t); break;
+      case 'j': a->i = (long long)va_arg(ap, intmax_t); break;
+      case 't': a->i = (long long)va_arg(ap, ptrdiff_t); break;
+      case 'd': a->d = va_arg(ap, double); break;
+      case 'D': a->d = (double)va_arg(ap, long double); break;
+      case 'p': a->p = va_arg(ap, void *); break;
+      case 's': {
+        // the string may not outlive the call: keep a copy
+        const char *v = va_arg(ap, const char *);
+        if (!v)
+          v = "(null)";
+        size_t room = str < LOG_STR_BYTES ? LOG_STR_BYTES - str - 1 : 0;
+        size_t len = strlen(v);
+        if (len > room)
+          len = room;
+        a->i = (long long)str;
+        if (str < LOG_STR_BYTES) {
+          memcpy(r->str + str, v, len);
+          r->str[str + len] = '\0';
+          str += len + 1;
+        }
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+static void out(const char *p, size_t n) {
+  if (block_len + n > LOG_BLOCK) {
+    fwrite(block, 1, block_len, log_file);
+    block_len = 0;
+    if (n > LOG_BLOCK) {
+      fwrite(p, 1, n, log_file);
+      return;
+    }
+  }
+  memcpy(block + block_len, p, n);
+  block_len += n;
+}
+
+// print one conversion with its value (and '*' ints) into buf
+static int format_spec(char *buf, size_t size, const log_spec_t *s,
+                       const log_rec_t *r, const log_arg_t *a) {
+  char spec[32];
+  int len = s->len < (int)sizeof(spec) - 1 ? s->len : (int)sizeof(spec) - 1;
+  memcpy(spec, s->start, len);
+  spec[len] = '\0';
+  int w0 = s->stars > 0 ? (int)a[0].i : 0;
+  int w1 = s->stars > 1 ? (int)a[1].i : 0;
+  const log_arg_t *v = a + s->stars;
+
+#define LOG_PRINT(x)                                            \
+  (s->stars == 0 ? snprintf(buf, size, spec, x)                 \
+   : s->stars == 1 ? snprintf(buf, size, spec, w0, x)           \
+   : snprintf(buf, size, spec, w0, w1, x))
+  switch (s->kind) {
+    case 'i': return LOG_PRINT((int)v->i);
+    case 'l': return LOG_PRINT((long)v->i);
+    case 'q': return LOG_PRINT(v->i);
+    case 'z': return LOG_PRINT((size_t)v->i);
+    case 'j': return LOG_PRINT((intmax_t)v->i);
+    case 't': return LOG_PRINT((ptrdiff_t)v->i);
+    case 'd': return LOG_PRINT(v->d);
+    case 'D': return LOG_PRINT((long double)v->d);
+    case 'p': return LOG_PRINT(v->p);
+    case 's':
+      return LOG_PRINT(v->i < LOG_STR_BYTES ? r->str + v->i : "");
+  }
+#undef LOG_PRINT
+  return 0;
+}
+
+static void format_rec(const log_rec_t *r) {
+  if (!r->fmt) {
+    out(r->str, strlen(r->str));
+    return;
+  }
+  char buf[512];
+  const char *p = r->fmt;
+  const log_arg_t *a = r->arg;
+  log_spec_t s;
+  for (const char *q; (q = next_spec(p, &s)); p = q) {
+    out(p, (size_t)(s.start - p));
+    if (s.kind == '%') {
+      out("%", 1);
+    } else if (s.kind == 'n') {
+      out(s.start, (size_t)s.len);
+    } else {
+      int n = format_spec(buf, sizeof(buf), &s, r, a);
+      if (n > 0)
+        out(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+      a += s.stars + 1;
+    }
+  }
+  out(p, strlen(p));
+}
+
+/* --------------- writer --------------- */
+
+// write out every record queued so far, oldest first; drain_lock held
+static unsigned long drain(void) {
+  unsigned long n = 0;
+  pthread_mutex_lock(&ring_lock);
+  log_ring_t *list = rings;
+  pthread_mutex_unlock(&ring_lock);
+
+  for (log_ring_t *r = list; r; r = r->next) {
+    unsigned long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->dropped_seen) {
+      char msg[96];
+      int len = snprintf(msg, sizeof(msg),
+                         "[LOG] ring full: %lu messages dropped\n",
+                         dropped - r->dropped_seen);
+      out(msg, (size_t)len);
+      r->dropped_seen = dropped;
+    }
+  }
+
+  for (;;) {
+    // the ring whose oldest record came first
+    log_ring_t *best = NULL;
+    unsigned long best_seq = 0;
+    for (log_ring_t *r = list; r; r = r->next) {
+      if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+        continue;
+      unsigned long seq = r->rec[r->tail % LOG_RING_SIZE].seq;
+      if (!best || seq < best_seq) {
+        best = r;
+        best_seq = seq;
+      }
+    }
+    if (!best)
+      break;
+    format_rec(&best->rec[best->tail % LOG_RING_SIZE]);
+    __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+    n++;
+  }
+
+  if (block_len) {
+    fwrite(block, 1, block_len, log_file);
+    block_len = 0;
+  }
+  if (n)
+    fflush(log_file);
+  return n;
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&drain_lock);
+    unsigned long n = drain();
+    pthread_mutex_unlock(&drain_lock);
+    if (n)
+      continue;
+
+    pthread_mutex_lock(&idle_lock);
+    if (writer_quit) {
+      pthread_mutex_unlock(&idle_lock);
+      return NULL;
+    }
+    __atomic_store_n(&writer_sleeping, true, __ATOMIC_SEQ_CST);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += LOG_IDLE_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&idle_wake, &idle_lock, &ts);
+    __atomic_store_n(&writer_sleeping, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+static void stop_writer(void) {
+  if (!writer_running)
+    return;
+  pthread_mutex_lock(&idle_lock);
+  writer_quit = true;
+  pthread_cond_signal(&idle_wake);
+  pthread_mutex_unlock(&idle_lock);
+  pthread_join(writer, NULL);
+  writer_running = false;
+  writer_quit = false;
+}
+
+// a ring is filling up: don't wait out the writer's sleep
+static void wake_writer(void) {
+  if (!__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST))
+    return;
+  pthread_mutex_lock(&idle_lock);
+  pthread_cond_signal(&idle_wake);
+  pthread_mutex_unlock(&idle_lock);
+}
+
+// the ring is full: write it out from this thread (false if there's no file)
+static bool drain_here(void) {
+  pthread_mutex_lock(&drain_lock);
+  bool ok = log_file != NULL;
+  if (ok)
+    drain();
+  pthread_mutex_unlock(&drain_lock);
+  return ok;
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&drain_lock);
+  if (log_file)
+    drain();
+  pthread_mutex_unlock(&drain_lock);
+}
+
+// best effort: what's queued is worth more than strict signal safety here
+static void crash_flush(int sig) {
+  if (pthread_mutex_trylock(&drain_lock) == 0) {
+    if (log_file)
+      drain();
+    pthread_mutex_unlock(&drain_lock);
+  }
+  raise(sig);  // SA_RESETHAND: the default action this time
+}
+
+static void install_crash_flush(void) {
+  static bool done;
+  if (done)
+    return;
+  done = true;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = crash_flush;
+  sa.sa_flags = SA_RESETHAND;
+  sigemptyset(&sa.sa_mask);
+  int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+  for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+    sigaction(sigs[i], &sa, NULL);
+  atexit(log_flush);
+}
+
 static void init_log_file(void) {
+  pthread_mutex_lock(&drain_lock);
   if (log_file == NULL) {
     log_file = fopen(log_filename, "w");
     if (log_file == NULL) {
@@ -15,33 +379,144 @@ static void init_log_file(void) {
     } else {
       fprintf(stderr, "[LOG] Logging to %s\n", log_filename);
     }
+    install_crash_flush();
+    writer_running = pthread_create(&writer, NULL, writer_main, NULL) == 0;
+    if (!writer_running)
+      fprintf(stderr, "[LOG] can't start the log writer, flushing on exit\n");
   }
+  pthread_mutex_unlock(&drain_lock);
 }
 
-void set_log_file(const char *filename) {
-  if (log_file != NULL && log_file != stderr) {
+// first write_log() on this thread: give it a ring
+static log_ring_t *ring_attach(void) {
+  log_ring_t *r = calloc(1, sizeof(*r));
+  if (!r)
+    return NULL;
+  pthread_mutex_lock(&ring_lock);
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock(&ring_lock);
+  my_ring = r;
+  return r;
+}
+
+static void close_file(void) {
+  stop_writer();
+  log_flush();
+  pthread_mutex_lock(&drain_lock);
+  if (log_file != NULL && log_file != stderr)
     fclose(log_file);
-    log_file = NULL;
-  }
+  log_file = NULL;
+  pthread_mutex_unlock(&drain_lock);
+}
+
+void set_log_file(const char *filename) {
+  if (log_file != NULL)
+    close_file();
   strncpy(log_filename, filename, sizeof(log_filename) - 1);
   log_filename[sizeof(log_filename) - 1] = '\0';
 }
 
 void close_log_file(void) {
-    if (log_file != NULL && log_file != stderr) {
-        fclose(log_file);
-        log_file = NULL;
+  close_file();
+}
+
+void log_enable(unsigned cats, int level) {
+  if (level < 0)
+    level = 0;
+  if (level > LOG_TRACE)
+    level = LOG_TRACE;
+  uint64_t mask = 0;
+  for (int c = 0; c < LOG_CATS; c++) {
+    if (cats >> c & 1)
+      mask |= LOG_LEVELS_UP_TO(level) << (c * 8);
+  }
+  log_mask = mask;
+}
+
+bool log_parse(const char *spec) {
+  static const char *cats[LOG_CATS] = { "cpu", "int", "mbc", "ppu", "input",
+                                        "boot" };
+  static const char *levels[] = { "none", "error", "warn", "info", "debug",
+                                  "trace" };
+  unsigned mask = 0;
+  int level = GB_LOG_LEVEL;
+  const char *colon = strchr(spec, ':');
+  size_t end = colon ? (size_t)(colon - spec) : strlen(spec);
+  if (end == 0)
+    mask = ~0u;  // ":debug": every category
+
+  if (colon) {
+    level = -1;
+    for (int l = 0; l <= LOG_TRACE; l++) {
+      if (strcmp(colon + 1, levels[l]) == 0)
+        level = l;
+    }
+    if (level < 0)
+      return false;
+  }
+  for (size_t i = 0; i < end; ) {
+    size_t len = strcspn(spec + i, ",:");
+    if (len == 3 && strncmp(spec + i, "all", 3) == 0) {
+      mask = ~0u;
+    } else if (!(len == 4 && strncmp(spec + i, "none", 4) == 0)) {
+      int c = 0;
+      while (c < LOG_CATS &&
+             !(strlen(cats[c]) == len && strncmp(spec + i, cats[c], len) == 0))
+        c++;
+      if (c == LOG_CATS)
+        return false;
+      mask |= 1u << c;
     }
+    i += len + (spec[i + len] == ',');
+  }
+  log_enable(mask, level);
+  return true;
 }
 
 void write_log(const char *format, ...) {
-  init_log_file();
+  if (__atomic_load_n(&log_file, __ATOMIC_ACQUIRE) == NULL)
+    init_log_file();
+  log_ring_t *r = my_ring ? my_ring : ring_attach();
+  if (!r)
+    return;
 
+  unsigned head = r->head;
+  if (head - r->tail_seen == LOG_RING_SIZE) {
+    r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - r->tail_seen == LOG_RING_SIZE) {
+#ifndef GB_LOG_DROP
+      if (drain_here())
+        r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      else
+#endif
+      {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+  }
+
+  log_rec_t *rec = &r->rec[head % LOG_RING_SIZE];
+  rec->fmt = format;
+  rec->seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
   va_list args;
   va_start(args, format);
-  vfprintf(log_file, format, args);
+  va_list copy;
+  va_copy(copy, args);
+  if (!capture(rec, format, args)) {
+    vsnprintf(rec->str, sizeof(rec->str), format, copy);
+    rec->fmt = NULL;
+  }
+  va_end(copy);
   va_end(args);
-  fflush(log_file);
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  if (head + 1 - r->tail_seen >= LOG_HIGH_WATER) {
+    r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head + 1 - r->tail_seen >= LOG_HIGH_WATER)
+      wake_writer();
+  }
 }
 
 static int write_binary_file(const void *data, size_t size,
@@ -78,7 +553,9 @@ void dump_cpu(const registers_t *cpu, const char *filename) {
   fwrite(&cpu->HL, sizeof(uint16_t), 1, f);
   fwrite(&cpu->SP, sizeof(uint16_t), 1, f);
   fwrite(&cpu->PC, sizeof(uint16_t), 1, f);
-  fwrite(&cpu->F, sizeof(cpu->F), 1, f);
+  u8 flags = cpu_flags_byte(cpu);
+  bool F[4] = { flags >> 7 & 1, flags >> 6 & 1, flags >> 5 & 1, flags >> 4 & 1 };
+  fwrite(F, sizeof(F), 1, f);
   fwrite(&cpu->cycle, sizeof(unsigned long), 1, f);
   fwrite(&cpu->stopped, sizeof(bool), 1, f);
   fwrite(&cpu->halt, sizeof(bool), 1, f);
@@ -1,16 +1,112 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "cpu.h"
 #include "ppu.h"
 #include "memory.h"
 #include "logging.h"
+#include "jit.h"
+#include "triple.h"
+#include "trace.h"
 #include <SDL2/SDL.h>
 
+// The emulation runs on its own thread and hands finished frames to the SDL
+// thread through a triple buffer, so a stalled present never holds it up.
+// Input and hotkeys go the other way through atomics, read once per frame.
+typedef struct {
+  registers_t *cpu;
+  Ppu_t *ppu;
+  triple_t frames;
+  unsigned long held[3];       // frames.buf[i] holds frame_serial held[i]
+  bool threaded_ppu;           // frames come from the render thread
+  int frameskip;
+  unsigned long long max_cycles;
+  SDL_atomic_t running;
+  SDL_atomic_t buttons;        // buttons_dir | buttons_action << 4
+  SDL_atomic_t palette;        // ppu_palettes index
+  SDL_atomic_t fast_forward;
+  int palette_set;             // emulation thread: palette in use
+} emu_t;
+
+// buttons from the SDL thread, with a joypad interrupt for each press
+static void apply_input(emu_t *e) {
+  Bus_t *bus = e->cpu->bus;
+  int buttons = SDL_AtomicGet(&e->buttons);
+  uint8_t dir = buttons & 0x0F;
+  uint8_t action = (buttons >> 4) & 0x0F;
+  if (dir == bus->buttons_dir && action == bus->buttons_action)
+    return;
+
+  // 0 = pressed: a bit that was 1 and is 0 now
+  if ((bus->buttons_dir & ~dir) || (bus->buttons_action & ~action)) {
+    bus->IF |= 0x10; // JOYP interrupt
+    LOG(LOG_INPUT, LOG_DEBUG, "[INPUT] dir=%02X->%02X action=%02X->%02X | "
+        "IF=%02X->%02X IE=%02X IME=%d (PC=%04X cycle=%lu)\n",
+        bus->buttons_dir, dir, bus->buttons_action, action,
+        bus->IF & ~0x10, bus->IF, bus->IE, e->cpu->IME, e->cpu->PC,
+        e->cpu->cycle);
+  }
+  bus->buttons_dir = dir;
+  bus->buttons_action = action;
+}
+
+static int emulate(void *arg) {
+  emu_t *e = arg;
+  Ppu_t *ppu = e->ppu;
+  unsigned long frames = 0;
+
+  if (!e->threaded_ppu)
+    ppu_set_target(ppu, triple_back(&e->frames), GB_WIDTH * sizeof(uint32_t));
+
+  while (SDL_AtomicGet(&e->running) && e->cpu->cycle < e->max_cycles) {
+    apply_input(e);
+    int palette = SDL_AtomicGet(&e->palette);
+    if (palette != e->palette_set) {
+      ppu_set_palette(ppu, ppu_palettes[palette]);
+      e->palette_set = palette;
+    }
+
+    // skipped frames keep the PPU timing but draw nothing, and neither
+    // they nor frames that came out the same as the last one are handed on
+    bool fast_forward = SDL_AtomicGet(&e->fast_forward);
+    ppu->render = !fast_forward || frames % (e->frameskip + 1) == 0;
+    gb_run_frame(e->cpu);
+
+    if (ppu->frame_ready) {
+      if (ppu->render && !ppu->frame_unchanged) {
+        if (e->threaded_ppu) {
+          int pitch;
+          const uint32_t *fb = ppu_frame(ppu, &pitch);
+          for (int y = 0; y < GB_HEIGHT; y++)
+            memcpy(triple_back(&e->frames) + y * GB_WIDTH, fb + y * pitch,
+                   GB_WIDTH * sizeof(uint32_t));
+        }
+        // the new back buffer holds the frame it was last published with:
+        // bring over only the rows drawn since, the rest stay valid
+        e->held[e->frames.back] = ppu->frame_serial - 1;
+        triple_publish(&e->frames, SDL_GetPerformanceCounter());
+        if (!e->threaded_ppu)
+          ppu_swap_target(ppu, triple_back(&e->frames),
+                          GB_WIDTH * sizeof(uint32_t),
+                          e->held[e->frames.back]);
+      }
+      frames++;
+      ppu->frame_ready = false;
+    }
+  }
+  SDL_AtomicSet(&e->running, 0);  // also ends the SDL loop at max_cycles
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
-    fprintf(stderr, "Usage: %s rom.gb\n", argv[0]);
+    fprintf(stderr, "Usage: %s rom.gb [frameskip]\n", argv[0]);
     return 1;
   }
+  // frames skipped per drawn one while fast-forwarding (F toggles it)
+  int frameskip = (argc > 2) ? atoi(argv[2]) : 4;
+  if (frameskip < 0)
+    frameskip = 0;
 
   Bus_t *bus = malloc(sizeof(Bus_t));
   init_bus(bus);
@@ -52,7 +148,7 @@ int main(int argc, char *argv[]) {
     }
 
     Ppu_t *ppu = malloc(sizeof(Ppu_t));
-    start_display(ppu, bus, 4);
+    start_display(ppu, bus);
 
     bus->ppu = ppu;
 
@@ -60,12 +156,39 @@ int main(int argc, char *argv[]) {
     RESET_CPU(&cpu);
     cpu.bus = bus;
     cpu.ppu = ppu;
+#if defined(GB_JIT_VERIFY)
+    cpu_enable_jit(&cpu, JIT_VERIFY);
+#elif defined(GB_JIT)
+    cpu_enable_jit(&cpu, JIT_ON);
+#elif defined(GB_BLOCK_CACHE)
+    cpu_enable_block_cache(&cpu, true);
+#endif
 
     if (bus->bootrom_enabled && bus->bootrom) {
       cpu.PC = 0x0000; 
       cpu.IME = 0;    
     }
 
+    // GB_TRACE=file[:records] keeps the last records instructions in file
+    // (trace.h, decode with tools/gbtrace)
+    const char *trace_spec = getenv("GB_TRACE");
+    if (trace_spec && *trace_spec) {
+      char path[256];
+      unsigned long records = 1ul << 20;
+      const char *colon = strrchr(trace_spec, ':');
+      size_t len = colon ? (size_t)(colon - trace_spec) : strlen(trace_spec);
+      if (len >= sizeof(path))
+        len = sizeof(path) - 1;
+      memcpy(path, trace_spec, len);
+      path[len] = '\0';
+      if (colon)
+        records = strtoul(colon + 1, NULL, 0);
+      cpu.trace = trace_open(path, records ? records : 1);
+      if (cpu.trace)
+        fprintf(stderr, "[TRACE] last %llu instructions in %s\n",
+                (unsigned long long)cpu.trace->hdr->capacity, path);
+    }
+
   // sdl
   int scale = 4;
   SDL_Init(SDL_INIT_VIDEO);
@@ -77,152 +200,221 @@ int main(int argc, char *argv[]) {
       SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888,
                         SDL_TEXTUREACCESS_STREAMING, GB_WIDTH, GB_HEIGHT);
 
-  bool running = true;
-  unsigned long long max_cycles = 5000000000000000ULL;
+  // Inline, the PPU draws straight into the triple buffer's back frame;
+  // the render thread draws into its own buffers, which are copied there.
+  static emu_t emu;
+  emu.cpu = &cpu;
+  emu.ppu = ppu;
+  emu.frameskip = frameskip;
+  emu.max_cycles = 5000000000000000ULL;
+#ifdef GB_PPU_THREAD
+  emu.threaded_ppu = ppu_enable_thread(ppu, true);
+#endif
+  if (!triple_init(&emu.frames, GB_WIDTH * GB_HEIGHT)) {
+    fprintf(stderr, "[MAIN] out of memory\n");
+    return 1;
+  }
+
+  bool fast_forward = false;
+  int palette = 0;
+  uint8_t dir = 0x0F;  // buttons as the SDL thread sees them
+  uint8_t action = 0x0F;
 
   bus->buttons_dir = 0x0F;   
   bus->buttons_action = 0x0F; 
+  SDL_AtomicSet(&emu.buttons, dir | action << 4);
+  SDL_AtomicSet(&emu.running, 1);
+
+  // presentation: latency is publish -> SDL_RenderPresent() returned
+  double tick_ms = 1000.0 / SDL_GetPerformanceFrequency();
+  unsigned long shown = 0;
+  double latency_sum = 0, latency_max = 0;
   
-  // logs
+  // logs; GB_LOG picks categories and levels, e.g. GB_LOG=int,mbc:debug
   set_log_file("log.txt");
+  const char *log_spec = getenv("GB_LOG");
+  if (log_spec && !log_parse(log_spec))
+    fprintf(stderr, "[LOG] bad GB_LOG '%s' (cpu,int,mbc,ppu,input,boot,all"
+            "[:error|warn|info|debug|trace])\n", log_spec);
   write_log("[MAIN] Starting...\n");
   write_log("[MAIN] ROM: %s\n", argv[1]);
 
-  while (running && cpu.cycle < max_cycles) {
+  SDL_Thread *emu_thread = SDL_CreateThread(emulate, "emulation", &emu);
+  if (!emu_thread) {
+    fprintf(stderr, "[MAIN] can't start the emulation thread: %s\n",
+            SDL_GetError());
+    return 1;
+  }
+
+  while (SDL_AtomicGet(&emu.running)) {
     SDL_Event e;
     int events_processed = 0;
-    while (SDL_PollEvent(&e)) {
+    // sleep until input, or 1 ms to look for a new frame
+    int got = SDL_WaitEventTimeout(&e, 1);
+    for (; got; got = SDL_PollEvent(&e)) {
       events_processed++;
       static int total_events = 0;
       total_events++;
       if (total_events <= 10) {
-        write_log("[SDL] Event #%d: type=%d\n", total_events, e.type);
+        LOG(LOG_INPUT, LOG_TRACE, "[SDL] Event #%d: type=%d\n", total_events,
+            e.type);
       }
       
       if (e.type == SDL_QUIT)
-        running = false;
+        SDL_AtomicSet(&emu.running, 0);
       
       if (e.type == SDL_KEYDOWN) {
         if (!e.key.repeat) {
-          write_log("[SDL] Key down: SDL_Keycode=%d, sym=%d, repeat=%d\n", 
-                    e.key.keysym.scancode, e.key.keysym.sym, e.key.repeat);
+          LOG(LOG_INPUT, LOG_TRACE,
+              "[SDL] Key down: SDL_Keycode=%d, sym=%d, repeat=%d\n",
+              e.key.keysym.scancode, e.key.keysym.sym, e.key.repeat);
         }
         
         if (!e.key.repeat) {
-          uint8_t old_dir = bus->buttons_dir;
-          uint8_t old_action = bus->buttons_action;
+          uint8_t old_dir = dir;
+          uint8_t old_action = action;
           const char *key_name = NULL;
         
         // Direction buttons (0=pressed, 1=released)
         if (e.key.keysym.sym == SDLK_RIGHT) {
-          bus->buttons_dir &= ~0x01;
+          dir &= ~0x01;
           key_name = "RIGHT";
         }
         if (e.key.keysym.sym == SDLK_LEFT) {
-          bus->buttons_dir &= ~0x02;
+          dir &= ~0x02;
           key_name = "LEFT";
         }
         if (e.key.keysym.sym == SDLK_UP) {
-          bus->buttons_dir &= ~0x04;
+          dir &= ~0x04;
           key_name = "UP";
         }
         if (e.key.keysym.sym == SDLK_DOWN) {
-          bus->buttons_dir &= ~0x08;
+          dir &= ~0x08;
           key_name = "DOWN";
         }
         
         if (e.key.keysym.sym == SDLK_x) {
-          bus->buttons_action &= ~0x01;
+          action &= ~0x01;
           key_name = "A (X)";
         }
         if (e.key.keysym.sym == SDLK_z) {
-          bus->buttons_action &= ~0x02;
+          action &= ~0x02;
           key_name = "B (Z)";
         }
         if (e.key.keysym.sym == SDLK_RSHIFT) {
-          bus->buttons_action &= ~0x04;
+          action &= ~0x04;
           key_name = "SELECT (RSHIFT)";
         }
         if (e.key.keysym.sym == SDLK_RETURN) {
-          bus->buttons_action &= ~0x08;
+          action &= ~0x08;
           key_name = "START (RETURN)";
         }
+        // P cycles the screen palette
+        if (e.key.keysym.sym == SDLK_p) {
+          palette = (palette + 1) % PPU_PALETTE_COUNT;
+          SDL_AtomicSet(&emu.palette, palette);
+          LOG(LOG_PPU, LOG_INFO, "[PPU] palette %d\n", palette);
+        }
+        // F toggles fast-forward: only one frame in frameskip + 1 is drawn
+        if (e.key.keysym.sym == SDLK_f) {
+          fast_forward = !fast_forward;
+          SDL_AtomicSet(&emu.fast_forward, fast_forward);
+          write_log("[MAIN] fast-forward %s (frameskip %d)\n",
+                    fast_forward ? "on" : "off", frameskip);
+        }
 
-        // Trigger joypad interrupt on button press
-        if ((bus->buttons_dir != old_dir) || (bus->buttons_action != old_action)) {
-          bus->IF |= 0x10; // JOYP interrupt
-          write_log(
-              "[INPUT] Key pressed: %s | dir=%02X->%02X action=%02X->%02X | "
-              "IF=%02X->%02X IE=%02X IME=%d (PC=%04X cycle=%lu)\n",
-              key_name ? key_name : "UNKNOWN", old_dir, bus->buttons_dir,
-              old_action, bus->buttons_action, bus->IF & ~0x10, bus->IF,
-              bus->IE, cpu.IME, cpu.PC, cpu.cycle);
+        // the emulation thread raises the joypad interrupt
+        if ((dir != old_dir) || (action != old_action)) {
+          SDL_AtomicSet(&emu.buttons, dir | action << 4);
+          LOG(LOG_INPUT, LOG_INFO, "[INPUT] Key pressed: %s | dir=%02X->%02X "
+              "action=%02X->%02X\n", key_name ? key_name : "UNKNOWN",
+              old_dir, dir, old_action, action);
         }
         }
       }
       
       if (e.type == SDL_KEYUP) {
         const char *key_name = NULL;
-        uint8_t old_dir = bus->buttons_dir;
-        uint8_t old_action = bus->buttons_action;
+        uint8_t old_dir = dir;
+        uint8_t old_action = action;
         
         if (e.key.keysym.sym == SDLK_RIGHT) {
-          bus->buttons_dir |= 0x01;
+          dir |= 0x01;
           key_name = "RIGHT";
         }
         if (e.key.keysym.sym == SDLK_LEFT) {
-          bus->buttons_dir |= 0x02;
+          dir |= 0x02;
           key_name = "LEFT";
         }
         if (e.key.keysym.sym == SDLK_UP) {
-          bus->buttons_dir |= 0x04;
+          dir |= 0x04;
           key_name = "UP";
         }
         if (e.key.keysym.sym == SDLK_DOWN) {
-          bus->buttons_dir |= 0x08;
+          dir |= 0x08;
           key_name = "DOWN";
         }
         if (e.key.keysym.sym == SDLK_x) {
-          bus->buttons_action |= 0x01;
+          action |= 0x01;
           key_name = "A (X)";
         }
         if (e.key.keysym.sym == SDLK_z) {
-          bus->buttons_action |= 0x02;
+          action |= 0x02;
           key_name = "B (Z)";
         }
         if (e.key.keysym.sym == SDLK_RSHIFT) {
-          bus->buttons_action |= 0x04;
+          action |= 0x04;
           key_name = "SELECT (RSHIFT)";
         }
         if (e.key.keysym.sym == SDLK_RETURN) {
-          bus->buttons_action |= 0x08;
+          action |= 0x08;
           key_name = "START (RETURN)";
         }
         
-        if (key_name && ((bus->buttons_dir != old_dir) || (bus->buttons_action != old_action))) {
-          write_log("[INPUT] Key released: %s | dir=%02X action=%02X\n",
-                    key_name, bus->buttons_dir, bus->buttons_action);
+        if ((dir != old_dir) || (action != old_action))
+          SDL_AtomicSet(&emu.buttons, dir | action << 4);
+        if (key_name && ((dir != old_dir) || (action != old_action))) {
+          LOG(LOG_INPUT, LOG_INFO,
+              "[INPUT] Key released: %s | dir=%02X action=%02X\n",
+              key_name, dir, action);
         }
       }
     }
 
-    helper(&cpu);
-
-    if (ppu->frame_ready) {
-      SDL_UpdateTexture(tex, NULL, ppu->framebuffer,
-                        GB_WIDTH * sizeof(uint32_t));
+    // always the newest finished frame; older ones were dropped
+    uint64_t stamp;
+    const uint32_t *frame = triple_take(&emu.frames, &stamp);
+    if (frame) {
+      SDL_UpdateTexture(tex, NULL, frame, GB_WIDTH * sizeof(uint32_t));
       SDL_RenderClear(ren);
       SDL_RenderCopy(ren, tex, NULL, NULL);
       SDL_RenderPresent(ren);
-
-      ppu->frame_ready = false;
+      double ms = (SDL_GetPerformanceCounter() - stamp) * tick_ms;
+      latency_sum += ms;
+      if (ms > latency_max)
+        latency_max = ms;
+      shown++;
     }
     }
 
+    SDL_WaitThread(emu_thread, NULL);
+
     SDL_DestroyTexture(tex);
     SDL_DestroyRenderer(ren);
     SDL_DestroyWindow(win);
     SDL_Quit();
+
+    cpu_enable_block_cache(&cpu, false);
+    trace_close(cpu.trace);
+    ppu_enable_thread(ppu, false);
+
+    write_log("[PRESENT] %lu frames shown, %lu dropped, latency %.2f ms "
+              "average, %.2f ms max\n", shown, emu.frames.dropped,
+              shown ? latency_sum / shown : 0.0, latency_max);
+    triple_free(&emu.frames);
+
+    write_log("[IDLE] %s: skipped %lu of %lu cycles in %lu idle loops\n",
+              argv[1], cpu.idle.skipped, cpu.cycle, cpu.idle.loops);
     
     write_log("[MAIN] Emulator shutting down\n");
     close_log_file();
@@ -0,0 +1,171 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "memory.h"
+#include "logging.h"
+#include "block.h"
+#include "jit.h"
+#include "ppu_thread.h"
+#include "trace.h"
+
+// Headless CPU benchmark: runs the same ROM on the table core, the threaded
+// core, the block cache and the JIT from identical fresh machines and
+// reports instructions/s. A last JIT_VERIFY run checks every native run
+// against the interpreter; table runs with ppu.render off and with the
+// render thread show what drawing costs the emulation thread, and one with
+// the instruction trace on what recording costs.
+
+typedef struct {
+  Bus_t bus;
+  Ppu_t ppu;
+  registers_t cpu;
+} machine_t;
+
+static machine_t *machine_new(const char *rom) {
+  machine_t *m = calloc(1, sizeof(machine_t));
+  if (!m) return NULL;
+  init_bus(&m->bus);
+  if (bus_load_rom(&m->bus, rom) != 0) {
+    free(m);
+    return NULL;
+  }
+  start_display(&m->ppu, &m->bus);
+  m->bus.ppu = &m->ppu;
+  RESET_CPU(&m->cpu);
+  m->cpu.bus = &m->bus;
+  m->cpu.ppu = &m->ppu;
+  m->cpu.PC = 0x0100;
+  return m;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double last_cpu;  // CPU time of this thread in the last bench()
+
+static double bench(const char *name, machine_t *m,
+                    unsigned long (*run)(registers_t *, unsigned long),
+                    unsigned long steps) {
+  double t0 = now_sec(), c0 = thread_sec();
+  run(&m->cpu, steps);
+  double dt = now_sec() - t0;
+  last_cpu = thread_sec() - c0;
+  double ips = steps / dt;
+  printf("%-9s %10lu instr  %8.3f s  %8.2f M instr/s  (%lu cycles)\n",
+         name, steps, dt, ips / 1e6, m->cpu.cycle);
+  return ips;
+}
+
+// frames: also compare the framebuffers
+static bool same_state(const machine_t *a, const machine_t *b, bool frames) {
+  const registers_t *x = &a->cpu, *y = &b->cpu;
+  return x->A == y->A && x->BC == y->BC && x->DE == y->DE &&
+         x->HL == y->HL && x->SP == y->SP && x->PC == y->PC &&
+         x->cycle == y->cycle && cpu_flags_byte(x) == cpu_flags_byte(y) &&
+         memcmp(a->bus.wram, b->bus.wram, sizeof(a->bus.wram)) == 0 &&
+         memcmp(a->bus.vram, b->bus.vram, sizeof(a->bus.vram)) == 0 &&
+         (!frames || memcmp(a->ppu.framebuffer, b->ppu.framebuffer,
+                            GB_WIDTH * GB_HEIGHT * sizeof(uint32_t)) == 0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s rom.gb [instructions]\n", argv[0]);
+    return 1;
+  }
+  unsigned long steps = (argc > 2) ? strtoul(argv[2], NULL, 0) : 20000000UL;
+
+  set_log_file("/dev/null");
+
+  machine_t *table = machine_new(argv[1]);
+  machine_t *threaded = machine_new(argv[1]);
+  machine_t *blocks = machine_new(argv[1]);
+  machine_t *jit = machine_new(argv[1]);
+  machine_t *verify = machine_new(argv[1]);
+  machine_t *norender = machine_new(argv[1]);
+  machine_t *pputhread = machine_new(argv[1]);
+  machine_t *traced = machine_new(argv[1]);
+  if (!table || !threaded || !blocks || !jit || !verify || !norender ||
+      !pputhread || !traced ||
+      !cpu_enable_block_cache(&blocks->cpu, true)) {
+    fprintf(stderr, "[BENCH] failed to load '%s'\n", argv[1]);
+    return 1;
+  }
+
+  double a = bench("table", table, cpu_run_table, steps);
+  double table_cpu = last_cpu;
+  const Sched_t *s = &table->bus.sched;
+  printf("sched     %lu deadlines, %lu register syncs (%.1f cycles/run)\n",
+         s->flushes, s->syncs,
+         (double)s->time / (s->flushes + s->syncs + 1));
+  printf("idle      %lu cycles skipped in %lu loops (%.1f%% of the run)\n",
+         table->cpu.idle.skipped, table->cpu.idle.loops,
+         100.0 * table->cpu.idle.skipped / (table->cpu.cycle + 1));
+  double b = bench("threaded", threaded, cpu_run_threaded, steps);
+  printf("speedup   %.2fx\n", b / a);
+  double c = bench("blocks", blocks, cpu_run_blocks, steps);
+  printf("speedup   %.2fx  (%lu block hits, %lu builds)\n", c / a,
+         blocks->cpu.blocks->hits, blocks->cpu.blocks->builds);
+
+  norender->ppu.render = false;
+  double n = bench("norender", norender, cpu_run_table, steps);
+  printf("speedup   %.2fx\n", n / a);
+  bool pput = ppu_enable_thread(&pputhread->ppu, true);
+  if (pput) {
+    double p = bench("pputhread", pputhread, cpu_run_table, steps);
+    ppu_thread_stats_t st = ppu_thread_stats(pputhread->ppu.thread);
+    printf("speedup   %.2fx  (%lu spans, %lu writes, %lu ring stalls, "
+           "%lu wakeups)\n", p / a, st.spans, st.writes, st.waits, st.wakes);
+    printf("emu cpu   %.3f s with the render thread, %.3f s inline\n",
+           last_cpu, table_cpu);
+    ppu_enable_thread(&pputhread->ppu, false);  // the frame so far, inline
+  }
+
+  traced->cpu.trace = trace_open("bench_trace.bin", 1ul << 20);
+  if (traced->cpu.trace) {
+    double t = bench("traced", traced, cpu_run_table, steps);
+    printf("speedup   %.2fx  (%llu records, ring of %llu)\n", t / a,
+           (unsigned long long)traced->cpu.trace->count,
+           (unsigned long long)traced->cpu.trace->hdr->capacity);
+    trace_close(traced->cpu.trace);
+    traced->cpu.trace = NULL;
+    remove("bench_trace.bin");
+  }
+
+  bool same = same_state(table, threaded, true) &&
+              same_state(table, blocks, true) &&
+              same_state(table, norender, false) &&
+              same_state(table, traced, true) &&
+              (!pput || same_state(table, pputhread, true));
+
+  if (cpu_enable_jit(&jit->cpu, JIT_ON) &&
+      cpu_enable_jit(&verify->cpu, JIT_VERIFY)) {
+    double d = bench("jit", jit, cpu_run_blocks, steps);
+    const jit_t *j = jit->cpu.jit;
+    printf("speedup   %.2fx  (%lu runs compiled, %lu ops native, %lu flushes)\n",
+           d / a, j->segments, j->native_ops, j->flushes);
+    bench("verify", verify, cpu_run_blocks, steps);
+    printf("verify    %lu runs checked, %lu mismatches\n",
+           verify->cpu.jit->checked, verify->cpu.jit->mismatches);
+    same = same && same_state(table, jit, true) &&
+           same_state(table, verify, true) &&
+           verify->cpu.jit->mismatches == 0;
+  }
+  printf("state     %s\n", same ? "identical" : "MISMATCH");
+
+  close_log_file();
+  return same ? 0 : 2;
+}
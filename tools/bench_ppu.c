@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ppu.h"
+#include "memory.h"
+#include "compose.h"
+#include "logging.h"
+
+// Scanline microbenchmark: renders a synthetic BG + window + 40 sprite
+// scene with every compose kernel set the host supports and reports ns per
+// scanline, for the kernels alone and for the whole ppu_render_line().
+// The framebuffers of all kernel sets must come out identical.
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void scene(Bus_t *bus, Ppu_t *ppu) {
+  srand(1);
+  for (size_t i = 0; i < sizeof(bus->vram); i++)
+    bus->vram[i] = (uint8_t)rand();
+  for (int i = 0; i < 40; i++) {
+    bus->oam[i * 4] = (uint8_t)(16 + rand() % 144);
+    bus->oam[i * 4 + 1] = (uint8_t)(rand() % 168);
+    bus->oam[i * 4 + 2] = (uint8_t)rand();
+    bus->oam[i * 4 + 3] = (uint8_t)(rand() & 0xF0);
+  }
+  ppu->LCDC = 0x80 | 0x20 | 0x10 | 0x04 | 0x02 | 0x01;
+  ppu->SCX = 3;
+  ppu->SCY = 17;
+  ppu->WX = 7 + 48;
+  ppu->WY = 40;
+  ppu->BGP = 0xE4;
+  ppu->OBP0 = 0xD2;
+  ppu->OBP1 = 0x1B;
+  ppu_update_palettes(ppu);
+}
+
+int main(int argc, char *argv[]) {
+  long frames = (argc > 1) ? strtol(argv[1], NULL, 0) : 2000;
+
+  set_log_file("/dev/null");
+
+  static Bus_t bus;
+  static Ppu_t ppu;
+  init_bus(&bus);
+  start_display(&ppu, &bus);
+  bus.ppu = &ppu;
+  scene(&bus, &ppu);
+
+  const compose_t *kernels[4];
+  int count = compose_list(kernels, 4);
+  uint32_t *ref = malloc(GB_WIDTH * GB_HEIGHT * sizeof(uint32_t));
+  uint8_t idx[GB_WIDTH];
+  uint32_t out[GB_WIDTH];
+  for (int i = 0; i < GB_WIDTH; i++)
+    idx[i] = (uint8_t)(rand() & 3);
+
+  bool same = true;
+  for (int k = 0; k < count; k++) {
+    const compose_t *c = kernels[k];
+    long lines = frames * GB_HEIGHT;
+
+    double t0 = now_sec();
+    for (long i = 0; i < lines; i++)
+      c->argb(out, idx, ppu.obj_lut[i & 1], GB_WIDTH);
+    double kern = (now_sec() - t0) / lines * 1e9;
+
+    ppu.compose = c;
+    t0 = now_sec();
+    for (long f = 0; f < frames; f++) {
+      for (int ly = 0; ly < GB_HEIGHT; ly++) {
+        ppu.LY = (uint8_t)ly;
+        ppu_render_line(&ppu);
+      }
+    }
+    double full = (now_sec() - t0) / lines * 1e9;
+
+    printf("%-7s %8.1f ns/line kernels  %8.1f ns/line rendered  (%ld lines)\n",
+           c->name, kern, full, lines);
+
+    if (k == 0)
+      memcpy(ref, ppu.framebuffer, GB_WIDTH * GB_HEIGHT * sizeof(uint32_t));
+    else if (memcmp(ref, ppu.framebuffer,
+                    GB_WIDTH * GB_HEIGHT * sizeof(uint32_t)) != 0)
+      same = false;
+  }
+  printf("frames  %s\n", same ? "identical" : "MISMATCH");
+
+  free(ref);
+  close_log_file();
+  return same ? 0 : 2;
+}
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+// Decodes a GB_TRACE file (trace.h): oldest record first, one line per
+// instruction with its disassembly and registers, or in the gameboy-doctor
+// format (--doctor) to diff against a reference log.
+
+static const char *usage =
+    "Usage: %s [options] trace.bin\n"
+    "  --doctor        gameboy-doctor lines instead of disassembly\n"
+    "  --last N        only the last N records (after filtering)\n"
+    "  --pc LO[-HI]    only PCs in LO..HI (hex)\n"
+    "  --bank N        only code in ROM bank N\n"
+    "  --cycles A[-B]  only records from cycle A (to B)\n";
+
+/* --------------- disassembler --------------- */
+
+static const char *r8[8] = { "B", "C", "D", "E", "H", "L", "(HL)", "A" };
+static const char *rp[4] = { "BC", "DE", "HL", "SP" };
+static const char *rp2[4] = { "BC", "DE", "HL", "AF" };
+static const char *cc[4] = { "NZ", "Z", "NC", "C" };
+static const char *alu[8] = { "ADD A,", "ADC A,", "SUB ", "SBC A,",
+                              "AND ", "XOR ", "OR ", "CP " };
+static const char *rot[8] = { "RLC", "RRC", "RL", "RR",
+                              "SLA", "SRA", "SWAP", "SRL" };
+static const char *misc[8] = { "RLCA", "RRCA", "RLA", "RRA",
+                               "DAA", "CPL", "SCF", "CCF" };
+
+// mnemonic of the instruction at pc into out; returns its length
+static int disasm(const uint8_t *b, uint16_t pc, char *out, size_t size) {
+  uint8_t op = b[0];
+  int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+  unsigned d8 = b[1], d16 = b[1] | b[2] << 8;
+  int e = (int8_t)b[1];
+  unsigned rel = (uint16_t)(pc + 2 + e);
+
+  if (op == 0xCB) {
+    int cx = b[1] >> 6, cy = (b[1] >> 3) & 7, cz = b[1] & 7;
+    static const char *bit_ops[4] = { NULL, "BIT", "RES", "SET" };
+    if (cx == 0)
+      snprintf(out, size, "%s %s", rot[cy], r8[cz]);
+    else
+      snprintf(out, size, "%s %d,%s", bit_ops[cx], cy, r8[cz]);
+    return 2;
+  }
+
+  switch (x) {
+    case 0:
+      switch (z) {
+        case 0:
+          if (y == 0) { snprintf(out, size, "NOP"); return 1; }
+          if (y == 1) { snprintf(out, size, "LD ($%04X),SP", d16); return 3; }
+          if (y == 2) { snprintf(out, size, "STOP"); return 2; }
+          if (y == 3) { snprintf(out, size, "JR $%04X", rel); return 2; }
+          snprintf(out, size, "JR %s,$%04X", cc[y - 4], rel);
+          return 2;
+        case 1:
+          if (!q) { snprintf(out, size, "LD %s,$%04X", rp[p], d16); return 3; }
+          snprintf(out, size, "ADD HL,%s", rp[p]);
+          return 1;
+        case 2: {
+          static const char *ind[4] = { "(BC)", "(DE)", "(HL+)", "(HL-)" };
+          if (!q)
+            snprintf(out, size, "LD %s,A", ind[p]);
+          else
+            snprintf(out, size, "LD A,%s", ind[p]);
+          return 1;
+        }
+        case 3:
+          snprintf(out, size, "%s %s", q ? "DEC" : "INC", rp[p]);
+          return 1;
+        case 4: snprintf(out, size, "INC %s", r8[y]); return 1;
+        case 5: snprintf(out, size, "DEC %s", r8[y]); return 1;
+        case 6: snprintf(out, size, "LD %s,$%02X", r8[y], d8); return 2;
+        default: snprintf(out, size, "%s", misc[y]); return 1;
+      }
+    case 1:
+      if (op == 0x76)
+        snprintf(out, size, "HALT");
+      else
+        snprintf(out, size, "LD %s,%s", r8[y], r8[z]);
+      return 1;
+    case 2:
+      snprintf(out, size, "%s%s", alu[y], r8[z]);
+      return 1;
+  }
+
+  switch (z) {
+    case 0:
+      if (y < 4) { snprintf(out, size, "RET %s", cc[y]); return 1; }
+      if (y == 4) { snprintf(out, size, "LDH ($FF%02X),A", d8); return 2; }
+      if (y == 5) { snprintf(out, size, "ADD SP,%d", e); return 2; }
+      if (y == 6) { snprintf(out, size, "LDH A,($FF%02X)", d8); return 2; }
+      snprintf(out, size, "LD HL,SP%+d", e);
+      return 2;
+    case 1: {
+      static const char *pops[4] = { "RET", "RETI", "JP HL", "LD SP,HL" };
+      if (!q)
+        snprintf(out, size, "POP %s", rp2[p]);
+      else
+        snprintf(out, size, "%s", pops[p]);
+      return 1;
+    }
+    case 2:
+      if (y < 4) { snprintf(out, size, "JP %s,$%04X", cc[y], d16); return 3; }
+      if (y == 4) { snprintf(out, size, "LD ($FF00+C),A"); return 1; }
+      if (y == 5) { snprintf(out, size, "LD ($%04X),A", d16); return 3; }
+      if (y == 6) { snprintf(out, size, "LD A,($FF00+C)"); return 1; }
+      snprintf(out, size, "LD A,($%04X)", d16);
+      return 3;
+    case 3:
+      if (y == 0) { snprintf(out, size, "JP $%04X", d16); return 3; }
+      if (y == 6) { snprintf(out, size, "DI"); return 1; }
+      if (y == 7) { snprintf(out, size, "EI"); return 1; }
+      break;
+    case 4:
+      if (y < 4) { snprintf(out, size, "CALL %s,$%04X", cc[y], d16); return 3; }
+      break;
+    case 5:
+      if (!q) { snprintf(out, size, "PUSH %s", rp2[p]); return 1; }
+      if (p == 0) { snprintf(out, size, "CALL $%04X", d16); return 3; }
+      break;
+    case 6:
+      snprintf(out, size, "%s$%02X", alu[y], d8);
+      return 2;
+    case 7:
+      snprintf(out, size, "RST $%02X", y * 8);
+      return 1;
+  }
+  snprintf(out, size, "DB $%02X", op);
+  return 1;
+}
+
+/* --------------- filters --------------- */
+
+typedef struct {
+  bool doctor;
+  unsigned long last;
+  unsigned pc_lo, pc_hi;
+  long bank;                        // -1 = any
+  unsigned long long cyc_lo, cyc_hi;
+} opts_t;
+
+static bool wanted(const opts_t *o, const trace_rec_t *r) {
+  return r->pc >= o->pc_lo && r->pc <= o->pc_hi &&
+         (o->bank < 0 || (r->pc < 0x8000 && r->bank == o->bank)) &&
+         r->cycle >= o->cyc_lo && r->cycle <= o->cyc_hi;
+}
+
+// "A" or "A-B" in base `base`; B stays as is when absent
+static bool range(const char *s, int base, unsigned long long *lo,
+                  unsigned long long *hi) {
+  char *end;
+  *lo = strtoull(s, &end, base);
+  if (end == s)
+    return false;
+  if (*end == '-') {
+    const char *b = end + 1;
+    *hi = strtoull(b, &end, base);
+    if (end == b)
+      return false;
+  }
+  return *end == '\0';
+}
+
+static void print(const opts_t *o, const trace_rec_t *r) {
+  if (o->doctor) {
+    printf("A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X "
+           "SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X\n",
+           r->a, r->f, r->b, r->c, r->d, r->e, r->h, r->l, r->sp, r->pc,
+           r->op[0], r->op[1], r->op[2], r->op[3]);
+    return;
+  }
+  char text[32], bytes[12];
+  int len = disasm(r->op, r->pc, text, sizeof(text));
+  int n = 0;
+  for (int i = 0; i < len; i++)
+    n += snprintf(bytes + n, sizeof(bytes) - n, "%02X ", r->op[i]);
+  printf("%12llu %03X:%04X  %-9s %-16s A:%02X F:%c%c%c%c BC:%02X%02X "
+         "DE:%02X%02X HL:%02X%02X SP:%04X IME:%d IE:%02X IF:%02X\n",
+         (unsigned long long)r->cycle, r->bank, r->pc, bytes, text, r->a,
+         r->f & 0x80 ? 'Z' : '-', r->f & 0x40 ? 'N' : '-',
+         r->f & 0x20 ? 'H' : '-', r->f & 0x10 ? 'C' : '-',
+         r->b, r->c, r->d, r->e, r->h, r->l, r->sp, r->ime, r->IE, r->IF);
+}
+
+int main(int argc, char *argv[]) {
+  opts_t o = { false, 0, 0, 0xFFFF, -1, 0, ~0ull };
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+    unsigned long long lo, hi;
+    bool ok = true;
+    if (strcmp(a, "--doctor") == 0) {
+      o.doctor = true;
+      continue;
+    } else if (strcmp(a, "--last") == 0 && v) {
+      o.last = strtoul(v, NULL, 0);
+    } else if (strcmp(a, "--pc") == 0 && v) {
+      hi = ~0ull;
+      ok = range(v, 16, &lo, &hi);
+      o.pc_lo = (unsigned)lo;
+      o.pc_hi = hi == ~0ull ? o.pc_lo : (unsigned)hi;
+    } else if (strcmp(a, "--bank") == 0 && v) {
+      o.bank = strtol(v, NULL, 0);
+    } else if (strcmp(a, "--cycles") == 0 && v) {
+      hi = ~0ull;
+      ok = range(v, 10, &lo, &hi);
+      o.cyc_lo = lo;
+      o.cyc_hi = hi;
+    } else if (a[0] != '-' && !path) {
+      path = a;
+      continue;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, usage, argv[0]);
+      return 1;
+    }
+    i++;  // the value
+  }
+  if (!path) {
+    fprintf(stderr, usage, argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "[TRACE] can't open %s\n", path);
+    return 1;
+  }
+  trace_hdr_t h;
+  if (fread(&h, sizeof(h), 1, f) != 1 ||
+      memcmp(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+      h.version != TRACE_VERSION || h.rec_size != sizeof(trace_rec_t) ||
+      h.capacity == 0 || (h.capacity & (h.capacity - 1))) {
+    fprintf(stderr, "[TRACE] %s is not a version %d trace\n", path,
+            TRACE_VERSION);
+    fclose(f);
+    return 1;
+  }
+
+  uint64_t n = h.count < h.capacity ? h.count : h.capacity;
+  trace_rec_t *recs = malloc(h.capacity * sizeof(trace_rec_t));
+  if (!recs || fread(recs, sizeof(trace_rec_t), h.capacity, f) != h.capacity) {
+    fprintf(stderr, "[TRACE] %s is truncated\n", path);
+    fclose(f);
+    free(recs);
+    return 1;
+  }
+  fclose(f);
+
+  // oldest surviving record first
+  uint64_t first = h.count - n;
+  uint64_t skip = 0;
+  if (o.last) {
+    uint64_t match = 0;
+    for (uint64_t i = first; i < h.count; i++)
+      match += wanted(&o, &recs[i & (h.capacity - 1)]);
+    if (match > o.last)
+      skip = match - o.last;
+  }
+  for (uint64_t i = first; i < h.count; i++) {
+    const trace_rec_t *r = &recs[i & (h.capacity - 1)];
+    if (!wanted(&o, r))
+      continue;
+    if (skip) {
+      skip--;
+      continue;
+    }
+    print(&o, r);
+  }
+  if (!o.doctor && h.count > n)
+    fprintf(stderr, "[TRACE] %llu older records were overwritten\n",
+            (unsigned long long)(h.count - n));
+
+  free(recs);
+  return 0;
+}